@@ -0,0 +1,16 @@
+# Converts a PEM bundle into BearSSL trust anchors (C source) with "brssl ta".
+#
+# Usage: cmake -DBRSSL=<brssl> -DINPUT=<cert.pem> -DOUTPUT=<trustanchors.h> -P trust_anchors.cmake
+
+execute_process(
+	COMMAND ${BRSSL} ta -q ${INPUT}
+	OUTPUT_FILE ${OUTPUT}.tmp
+	RESULT_VARIABLE result
+)
+
+if (NOT result EQUAL 0)
+	file(REMOVE ${OUTPUT}.tmp)
+	message(FATAL_ERROR "Could not convert ${INPUT} into trust anchors")
+endif()
+
+file(RENAME ${OUTPUT}.tmp ${OUTPUT})
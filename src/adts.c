@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "adts.h"
+#include "errors.h"
+
+#define ADTS_HEADER_SIZE 7
+
+static const uint32_t ADTS_SAMPLE_RATES[] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+int adts_parse_header(const unsigned char* const data, const size_t size, struct ADTSHeader* const header) {
+	/*
+	Parses the header at the start of "data".
+	
+	Returns UERR_SUCCESS, or UERR_UNSUPPORTED if there is no valid header there.
+	*/
+	
+	if (size < ADTS_HEADER_SIZE || data[0] != 0xFF || (data[1] & 0xF6) != 0xF0) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	header->profile = data[2] >> 6;
+	header->sample_rate_index = (data[2] >> 2) & 0x0F;
+	header->channels = (unsigned int) (((data[2] & 0x01) << 2) | (data[3] >> 6));
+	header->blocks = (data[6] & 0x03) + 1;
+	header->header_size = (data[1] & 0x01) ? ADTS_HEADER_SIZE : ADTS_HEADER_SIZE + 2;
+	header->frame_size = (size_t) (((data[3] & 0x03) << 11) | (data[4] << 3) | (data[5] >> 5));
+	
+	if (header->sample_rate_index >= sizeof(ADTS_SAMPLE_RATES) / sizeof(*ADTS_SAMPLE_RATES) || header->frame_size < header->header_size) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	header->sample_rate = ADTS_SAMPLE_RATES[header->sample_rate_index];
+	
+	return UERR_SUCCESS;
+	
+}
+
+void adts_get_config(const struct ADTSHeader* const header, unsigned char* const config) {
+	/*
+	Builds the AudioSpecificConfig of the stream: object type, sampling frequency
+	index and channel configuration.
+	*/
+	
+	config[0] = (unsigned char) (((header->profile + 1) << 3) | (header->sample_rate_index >> 1));
+	config[1] = (unsigned char) (((header->sample_rate_index & 0x01) << 7) | (header->channels << 3));
+	
+}
@@ -0,0 +1,28 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+Samples of audio decoded from each AAC frame.
+*/
+#define ADTS_FRAME_SAMPLES 1024
+
+#define ADTS_CONFIG_SIZE 2
+
+/*
+The header of an ADTS frame: an AAC frame as found in MPEG-TS streams and raw
+".aac" files. "frame_size" includes the header.
+*/
+struct ADTSHeader {
+	unsigned int profile;
+	unsigned int sample_rate_index;
+	uint32_t sample_rate;
+	unsigned int channels;
+	unsigned int blocks;
+	size_t header_size;
+	size_t frame_size;
+};
+
+int adts_parse_header(const unsigned char* const data, const size_t size, struct ADTSHeader* const header);
+void adts_get_config(const struct ADTSHeader* const header, unsigned char* const config);
+
+#pragma once
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <bearssl.h>
+
+#include "aes.h"
+#include "filesystem.h"
+#include "fstream.h"
+#include "errors.h"
+
+static const br_block_cbcdec_class* aes_get_cbcdec(void) {
+	/*
+	Picks the fastest CBC decoder the CPU supports: AES-NI on x86 and the crypto
+	extensions on POWER8, or a portable table based one otherwise.
+	*/
+	
+	const br_block_cbcdec_class* decoder = br_aes_x86ni_cbcdec_get_vtable();
+	
+	if (decoder != NULL) {
+		return decoder;
+	}
+	
+	decoder = br_aes_pwr8_cbcdec_get_vtable();
+	
+	if (decoder != NULL) {
+		return decoder;
+	}
+	
+	return &br_aes_big_cbcdec_vtable;
+	
+}
+
+int aes_decrypt(unsigned char* const buffer, size_t* const size, const unsigned char* const key, const unsigned char* const iv) {
+	/*
+	Decrypts an AES-128-CBC (PKCS#7 padded) buffer in place, as HLS segments with
+	METHOD=AES-128 are encrypted. On success, "size" is set to the size of the
+	plaintext, with the padding stripped.
+	*/
+	
+	if (*size < AES_BLOCK_SIZE || (*size % AES_BLOCK_SIZE) != 0) {
+		return UERR_AES_DECRYPT_FAILURE;
+	}
+	
+	const br_block_cbcdec_class* const decoder = aes_get_cbcdec();
+	
+	br_aes_gen_cbcdec_keys context;
+	decoder->init(&context.vtable, key, AES_BLOCK_SIZE);
+	
+	unsigned char chain[AES_BLOCK_SIZE];
+	memcpy(chain, iv, sizeof(chain));
+	
+	decoder->run(&context.vtable, chain, buffer, *size);
+	
+	/*
+	A wrong key (or IV) almost never yields valid padding.
+	*/
+	const unsigned char padding = buffer[*size - 1];
+	
+	int valid = (padding > 0 && padding <= AES_BLOCK_SIZE);
+	
+	for (size_t index = 0; valid && index < padding; index++) {
+		valid = (buffer[*size - 1 - index] == padding);
+	}
+	
+	if (!valid) {
+		return UERR_AES_DECRYPT_FAILURE;
+	}
+	
+	*size -= padding;
+	
+	return UERR_SUCCESS;
+	
+}
+
+int aes_decrypt_file(const char* const filename, const unsigned char* const key, const unsigned char* const iv) {
+	/*
+	Same as aes_decrypt(), for a whole file.
+	*/
+	
+	const long long file_size = get_file_size(filename);
+	
+	if (file_size < AES_BLOCK_SIZE || (file_size % AES_BLOCK_SIZE) != 0) {
+		return UERR_AES_DECRYPT_FAILURE;
+	}
+	
+	size_t size = (size_t) file_size;
+	
+	unsigned char* const buffer = malloc(size);
+	
+	if (buffer == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	struct FStream* stream = fstream_open(filename, "rb");
+	
+	if (stream == NULL) {
+		free(buffer);
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	const ssize_t rsize = fstream_read(stream, (char*) buffer, size);
+	
+	fstream_close(stream);
+	
+	if (rsize != (ssize_t) size) {
+		free(buffer);
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	const int code = aes_decrypt(buffer, &size, key, iv);
+	
+	if (code != UERR_SUCCESS) {
+		free(buffer);
+		return code;
+	}
+	
+	stream = fstream_open(filename, "wb");
+	
+	if (stream == NULL) {
+		free(buffer);
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	const int status = fstream_write(stream, (const char*) buffer, size);
+	
+	fstream_close(stream);
+	free(buffer);
+	
+	return status ? UERR_SUCCESS : UERR_FSTREAM_FAILURE;
+	
+}
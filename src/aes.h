@@ -0,0 +1,8 @@
+#include <stdlib.h>
+
+#define AES_BLOCK_SIZE 16
+
+int aes_decrypt(unsigned char* const buffer, size_t* const size, const unsigned char* const key, const unsigned char* const iv);
+int aes_decrypt_file(const char* const filename, const unsigned char* const key, const unsigned char* const iv);
+
+#pragma once
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <ctype.h>
+
+#include <curl/curl.h>
+
+#include "bandwidth.h"
+#include "threads.h"
+#include "errors.h"
+
+/*
+Part of the budget metadata requests get while bulk transfers are running too.
+Bulk transfers are never starved completely, and no transfer is ever throttled
+below BANDWIDTH_MIN_SHARE bytes per second.
+*/
+static const double BANDWIDTH_METADATA_SHARE = 0.9;
+static const curl_off_t BANDWIDTH_MIN_SHARE = 1024;
+
+static int BANDWIDTH_INITIALIZED = 0;
+
+/*
+Global budget in bytes per second (0 means unlimited) and how many transfers
+of each class are currently receiving data. "generation" changes whenever the
+shares change, so that owners of long running transfers know when to apply
+them again.
+*/
+static curl_off_t bandwidth_limit = 0;
+static size_t bandwidth_active[BANDWIDTH_CLASSES] = {0};
+static unsigned long bandwidth_generation = 0;
+
+static struct Mutex bandwidth_lock;
+
+static void bandwidth_destroy(void) {
+	
+	mutex_destroy(&bandwidth_lock);
+	
+}
+
+static curl_off_t bandwidth_parse_limit(const char* const value) {
+	/*
+	Parses a rate like "500K" or "2M" (bytes per second, with optional binary
+	suffixes). Returns 0 if the value is not valid.
+	*/
+	
+	char* end = NULL;
+	const double number = strtod(value, &end);
+	
+	if (end == value || !(number > 0)) {
+		return 0;
+	}
+	
+	double multiplier = 1;
+	
+	switch (toupper((unsigned char) *end)) {
+		case 'K':
+			multiplier = 1024;
+			end++;
+			break;
+		case 'M':
+			multiplier = 1024 * 1024;
+			end++;
+			break;
+		case 'G':
+			multiplier = 1024 * 1024 * 1024;
+			end++;
+			break;
+	}
+	
+	if (*end != '\0') {
+		return 0;
+	}
+	
+	const curl_off_t limit = (curl_off_t) (number * multiplier);
+	
+	return (limit < BANDWIDTH_MIN_SHARE) ? BANDWIDTH_MIN_SHARE : limit;
+	
+}
+
+int bandwidth_initialize(void) {
+	/*
+	The budget comes from "SPARKLEC_MAX_BANDWIDTH"; without it nothing is
+	throttled at all.
+	*/
+	
+	if (BANDWIDTH_INITIALIZED) {
+		return UERR_SUCCESS;
+	}
+	
+	if (!mutex_init(&bandwidth_lock)) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	atexit(bandwidth_destroy);
+	
+	const char* const value = getenv("SPARKLEC_MAX_BANDWIDTH");
+	
+	if (value != NULL) {
+		bandwidth_limit = bandwidth_parse_limit(value);
+	}
+	
+	BANDWIDTH_INITIALIZED = 1;
+	
+	return UERR_SUCCESS;
+	
+}
+
+curl_off_t bandwidth_get_limit(void) {
+	
+	return bandwidth_limit;
+	
+}
+
+void bandwidth_acquire(const enum BandwidthClass priority) {
+	/*
+	Accounts for a transfer of the given class that is about to receive data.
+	*/
+	
+	if (bandwidth_limit == 0) {
+		return;
+	}
+	
+	mutex_lock(&bandwidth_lock);
+	
+	bandwidth_active[priority]++;
+	bandwidth_generation++;
+	
+	mutex_unlock(&bandwidth_lock);
+	
+}
+
+void bandwidth_release(const enum BandwidthClass priority, const size_t count) {
+	/*
+	Gives back the share of "count" transfers of the given class that stopped
+	receiving data (finished, failed or were interrupted).
+	*/
+	
+	if (bandwidth_limit == 0 || count == 0) {
+		return;
+	}
+	
+	mutex_lock(&bandwidth_lock);
+	
+	bandwidth_active[priority] -= (count > bandwidth_active[priority]) ? bandwidth_active[priority] : count;
+	bandwidth_generation++;
+	
+	mutex_unlock(&bandwidth_lock);
+	
+}
+
+curl_off_t bandwidth_get_share(const enum BandwidthClass priority) {
+	/*
+	Returns the receive rate (for CURLOPT_MAX_RECV_SPEED_LARGE) each transfer of
+	the given class is entitled to right now, or 0 if there is no budget.
+	
+	Metadata gets most of the budget whenever some of it is in flight. Bulk
+	classes split the rest evenly between the ones that are active, so a few
+	attachments are not drowned by dozens of video segments (or vice versa).
+	Inside a class the share is split evenly between its transfers.
+	*/
+	
+	if (bandwidth_limit == 0) {
+		return 0;
+	}
+	
+	mutex_lock(&bandwidth_lock);
+	
+	const size_t metadata = bandwidth_active[BANDWIDTH_CLASS_METADATA];
+	const size_t media = bandwidth_active[BANDWIDTH_CLASS_MEDIA];
+	const size_t attachments = bandwidth_active[BANDWIDTH_CLASS_ATTACHMENT];
+	
+	const size_t active = bandwidth_active[priority];
+	
+	mutex_unlock(&bandwidth_lock);
+	
+	double budget = (double) bandwidth_limit;
+	
+	if (priority == BANDWIDTH_CLASS_METADATA) {
+		if (media > 0 || attachments > 0) {
+			budget *= BANDWIDTH_METADATA_SHARE;
+		}
+	} else {
+		if (metadata > 0) {
+			budget *= 1 - BANDWIDTH_METADATA_SHARE;
+		}
+		
+		const int shared = (priority == BANDWIDTH_CLASS_MEDIA) ? (attachments > 0) : (media > 0);
+		
+		if (shared) {
+			budget /= 2;
+		}
+	}
+	
+	const curl_off_t share = (curl_off_t) (budget / (double) ((active == 0) ? 1 : active));
+	
+	return (share < BANDWIDTH_MIN_SHARE) ? BANDWIDTH_MIN_SHARE : share;
+	
+}
+
+unsigned long bandwidth_get_generation(void) {
+	
+	if (bandwidth_limit == 0) {
+		return 0;
+	}
+	
+	mutex_lock(&bandwidth_lock);
+	
+	const unsigned long generation = bandwidth_generation;
+	
+	mutex_unlock(&bandwidth_lock);
+	
+	return generation;
+	
+}
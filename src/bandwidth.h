@@ -0,0 +1,24 @@
+#include <curl/curl.h>
+
+/*
+Priority classes sharing the global bandwidth budget. Metadata requests (the
+ones a provider crawl is made of) preempt bulk transfers; media and attachments
+are both bulk and get equal halves of whatever is left while both are running.
+*/
+enum BandwidthClass {
+	BANDWIDTH_CLASS_METADATA,
+	BANDWIDTH_CLASS_MEDIA,
+	BANDWIDTH_CLASS_ATTACHMENT
+};
+
+#define BANDWIDTH_CLASSES 3
+
+int bandwidth_initialize(void);
+curl_off_t bandwidth_get_limit(void);
+
+void bandwidth_acquire(const enum BandwidthClass priority);
+void bandwidth_release(const enum BandwidthClass priority, const size_t count);
+curl_off_t bandwidth_get_share(const enum BandwidthClass priority);
+unsigned long bandwidth_get_generation(void);
+
+#pragma once
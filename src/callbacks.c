@@ -10,6 +10,17 @@
 	#include "wio.h"
 #endif
 
+/*
+Bytes handed to curl_write_string_cb() so far (after content decoding).
+*/
+static curl_off_t string_total = 0;
+
+curl_off_t curl_write_string_total(void) {
+	
+	return string_total;
+	
+}
+
 size_t curl_write_string_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
 	
 	struct String* string = (struct String*) userdata;
@@ -28,6 +39,8 @@ size_t curl_write_string_cb(char* ptr, size_t size, size_t nmemb, void* userdata
 	string->s[slength] = '\0';
 	string->slength = slength;
 	
+	string_total += (curl_off_t) chunk_size;
+	
 	return chunk_size;
 	
 }
@@ -62,6 +75,36 @@ size_t curl_write_file_cb(char* ptr, size_t size, size_t nmemb, void* userdata)
 	
 }
 
+size_t curl_write_buffer_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
+	
+	struct DownloadBuffer* const buffer = (struct DownloadBuffer*) userdata;
+	
+	const size_t chunk_size = size * nmemb;
+	
+	if (buffer->size - buffer->offset < chunk_size) {
+		size_t capacity = (buffer->size == 0) ? CURL_MAX_WRITE_SIZE : buffer->size;
+		
+		while (capacity - buffer->offset < chunk_size) {
+			capacity *= 2;
+		}
+		
+		char* const data = realloc(buffer->data, capacity);
+		
+		if (data == NULL) {
+			return 0;
+		}
+		
+		buffer->data = data;
+		buffer->size = capacity;
+	}
+	
+	memcpy(buffer->data + buffer->offset, ptr, chunk_size);
+	buffer->offset += chunk_size;
+	
+	return chunk_size;
+	
+}
+
 size_t curl_discard_body_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
 	
 	(void) ptr;
@@ -0,0 +1,420 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <curl/curl.h>
+#include <bearssl.h>
+
+#include "certificates.h"
+#include "filesystem.h"
+#include "stringu.h"
+#include "symbols.h"
+#include "fstream.h"
+#include "errors.h"
+
+#ifdef SPARKLEC_HAS_TRUST_ANCHORS
+	/*
+	Generated at build time by "brssl ta" from the CA bundle; defines "TAs" and
+	"TAs_NUM".
+	*/
+	#include "trustanchors.h"
+#endif
+
+static const char CA_CERT_FILENAME[] =
+	PATH_SEPARATOR
+	"etc"
+	PATH_SEPARATOR
+	"tls"
+	PATH_SEPARATOR
+	"cert.pem";
+
+static int CERTIFICATES_INITIALIZED = 0;
+
+/*
+The PEM bundle, only loaded when the trust anchors were not compiled in (or
+"SPARKLEC_CA_BUNDLE" overrides them).
+*/
+static struct curl_blob certificates_bundle = {0};
+
+/*
+Trust anchors every TLS handshake is verified against. They either point to
+the compiled in ones or are decoded from the PEM bundle once, at startup, in
+which case "certificates_owned" is set and they are freed on exit.
+*/
+static const br_x509_trust_anchor* certificates_anchors = NULL;
+static size_t certificates_count = 0;
+static int certificates_owned = 0;
+
+/*
+The first members of the X.509 context libcurl's BearSSL backend installs on
+the engine (see "struct x509_context" in lib/vtls/bearssl.c): its own vtable,
+wrapping a minimal X.509 engine that does the actual chain validation.
+*/
+struct CurlX509Context {
+	const br_x509_class* vtable;
+	br_x509_minimal_context minimal;
+};
+
+struct Buffer {
+	unsigned char* data;
+	size_t size;
+	int failed;
+};
+
+static void certificates_destroy(void) {
+	
+	if (certificates_owned) {
+		for (size_t index = 0; index < certificates_count; index++) {
+			free(certificates_anchors[index].dn.data);
+		}
+		
+		free((br_x509_trust_anchor*) certificates_anchors);
+	}
+	
+	certificates_anchors = NULL;
+	certificates_count = 0;
+	certificates_owned = 0;
+	
+	free(certificates_bundle.data);
+	
+	certificates_bundle.data = NULL;
+	certificates_bundle.len = 0;
+	
+}
+
+static void buffer_append_cb(void* const context, const void* const data, const size_t size) {
+	
+	struct Buffer* const buffer = (struct Buffer*) context;
+	
+	if (buffer->failed) {
+		return;
+	}
+	
+	unsigned char* const destination = realloc(buffer->data, buffer->size + size);
+	
+	if (destination == NULL) {
+		buffer->failed = 1;
+		return;
+	}
+	
+	memcpy(destination + buffer->size, data, size);
+	
+	buffer->data = destination;
+	buffer->size += size;
+	
+}
+
+static int certificates_is_bearssl(void) {
+	/*
+	Pre-decoded trust anchors can only be handed to libcurl's BearSSL backend.
+	*/
+	
+	const curl_version_info_data* const info = curl_version_info(CURLVERSION_NOW);
+	
+	return info->ssl_version != NULL && strncmp(info->ssl_version, "BearSSL", 7) == 0;
+	
+}
+
+static int certificates_decode_anchor(const unsigned char* const der, const size_t size, br_x509_trust_anchor* const anchor) {
+	/*
+	Decodes a DER encoded certificate into a trust anchor. Its name and public
+	key are copied into a single allocation owned by "anchor->dn.data".
+	
+	Returns 0 (without touching "anchor") for certificates that can not be used
+	as a trust anchor.
+	*/
+	
+	struct Buffer dn = {0};
+	
+	br_x509_decoder_context decoder;
+	br_x509_decoder_init(&decoder, buffer_append_cb, &dn);
+	br_x509_decoder_push(&decoder, der, size);
+	
+	const br_x509_pkey* const pkey = br_x509_decoder_get_pkey(&decoder);
+	
+	if (pkey == NULL || dn.failed) {
+		free(dn.data);
+		return 0;
+	}
+	
+	size_t key_size = 0;
+	
+	switch (pkey->key_type) {
+		case BR_KEYTYPE_RSA:
+			key_size = pkey->key.rsa.nlen + pkey->key.rsa.elen;
+			break;
+		case BR_KEYTYPE_EC:
+			key_size = pkey->key.ec.qlen;
+			break;
+		default:
+			free(dn.data);
+			return 0;
+	}
+	
+	unsigned char* const data = realloc(dn.data, dn.size + key_size);
+	
+	if (data == NULL) {
+		free(dn.data);
+		return 0;
+	}
+	
+	unsigned char* key = data + dn.size;
+	
+	anchor->dn.data = data;
+	anchor->dn.len = dn.size;
+	anchor->flags = br_x509_decoder_isCA(&decoder) ? BR_X509_TA_CA : 0;
+	anchor->pkey.key_type = pkey->key_type;
+	
+	if (pkey->key_type == BR_KEYTYPE_RSA) {
+		memcpy(key, pkey->key.rsa.n, pkey->key.rsa.nlen);
+		anchor->pkey.key.rsa.n = key;
+		anchor->pkey.key.rsa.nlen = pkey->key.rsa.nlen;
+		
+		key += pkey->key.rsa.nlen;
+		
+		memcpy(key, pkey->key.rsa.e, pkey->key.rsa.elen);
+		anchor->pkey.key.rsa.e = key;
+		anchor->pkey.key.rsa.elen = pkey->key.rsa.elen;
+	} else {
+		memcpy(key, pkey->key.ec.q, pkey->key.ec.qlen);
+		anchor->pkey.key.ec.curve = pkey->key.ec.curve;
+		anchor->pkey.key.ec.q = key;
+		anchor->pkey.key.ec.qlen = pkey->key.ec.qlen;
+	}
+	
+	return 1;
+	
+}
+
+static int certificates_decode_bundle(void) {
+	/*
+	Decodes every certificate in the PEM bundle into a trust anchor, the same way
+	libcurl would otherwise do on each new connection. Certificates that can not
+	be decoded are skipped.
+	*/
+	
+	const unsigned char* const bundle = certificates_bundle.data;
+	const size_t size = certificates_bundle.len;
+	
+	size_t capacity = 0;
+	br_x509_trust_anchor* anchors = NULL;
+	
+	struct Buffer der = {0};
+	int inside = 0;
+	
+	br_pem_decoder_context decoder;
+	br_pem_decoder_init(&decoder);
+	
+	size_t offset = 0;
+	
+	/*
+	The decoder only reports the end of an object once it sees the line break
+	after it, hence the extra one pushed after the bundle.
+	*/
+	while (offset <= size) {
+		if (offset == size) {
+			br_pem_decoder_push(&decoder, "\n", 1);
+			offset++;
+		} else {
+			offset += br_pem_decoder_push(&decoder, bundle + offset, size - offset);
+		}
+		
+		switch (br_pem_decoder_event(&decoder)) {
+			case BR_PEM_BEGIN_OBJ: {
+				const char* const name = br_pem_decoder_name(&decoder);
+				
+				inside = strcmp(name, "CERTIFICATE") == 0 || strcmp(name, "X509 CERTIFICATE") == 0;
+				der.size = 0;
+				
+				br_pem_decoder_setdest(&decoder, inside ? buffer_append_cb : NULL, &der);
+				
+				break;
+			}
+			case BR_PEM_END_OBJ: {
+				if (!inside || der.failed) {
+					break;
+				}
+				
+				inside = 0;
+				
+				if (certificates_count == capacity) {
+					capacity = (capacity == 0) ? 128 : capacity * 2;
+					
+					br_x509_trust_anchor* const destination = realloc(anchors, capacity * sizeof(*anchors));
+					
+					if (destination == NULL) {
+						der.failed = 1;
+						break;
+					}
+					
+					anchors = destination;
+				}
+				
+				certificates_count += certificates_decode_anchor(der.data, der.size, &anchors[certificates_count]);
+				
+				break;
+			}
+			case BR_PEM_ERROR:
+				/*
+				Keep whatever was decoded before the malformed part.
+				*/
+				offset = size + 1;
+				break;
+		}
+		
+		if (der.failed) {
+			break;
+		}
+	}
+	
+	free(der.data);
+	
+	certificates_anchors = anchors;
+	certificates_owned = 1;
+	
+	return der.failed ? UERR_MEMORY_ALLOCATE_FAILURE : UERR_SUCCESS;
+	
+}
+
+static int certificates_load_bundle(const char* const filename) {
+	
+	const long long file_size = get_file_size(filename);
+	
+	if (file_size < 1) {
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	struct FStream* const stream = fstream_open(filename, "r");
+	
+	if (stream == NULL) {
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	certificates_bundle.data = malloc((size_t) file_size);
+	
+	if (certificates_bundle.data == NULL) {
+		fstream_close(stream);
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	const ssize_t rsize = fstream_read(stream, certificates_bundle.data, (size_t) file_size);
+	
+	fstream_close(stream);
+	
+	if (rsize != (ssize_t) file_size) {
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	certificates_bundle.len = (size_t) rsize;
+	
+	return UERR_SUCCESS;
+	
+}
+
+int certificates_initialize(void) {
+	/*
+	Sets up the trust anchors. The ones compiled in are used unless
+	"SPARKLEC_CA_BUNDLE" points to a PEM bundle to be used instead; without
+	compiled in anchors, the bundle installed along with the program is used.
+	
+	With libcurl's BearSSL backend, the bundle is decoded once here rather than
+	on every new connection.
+	*/
+	
+	if (CERTIFICATES_INITIALIZED) {
+		return UERR_SUCCESS;
+	}
+	
+	atexit(certificates_destroy);
+	
+	CERTIFICATES_INITIALIZED = 1;
+	
+	const int bearssl = certificates_is_bearssl();
+	const char* const value = getenv("SPARKLEC_CA_BUNDLE");
+	
+	int code = UERR_SUCCESS;
+	
+	if (value != NULL && *value != '\0') {
+		code = certificates_load_bundle(value);
+	} else {
+		#ifdef SPARKLEC_HAS_TRUST_ANCHORS
+			if (bearssl) {
+				certificates_anchors = TAs;
+				certificates_count = TAs_NUM;
+				
+				return UERR_SUCCESS;
+			}
+		#endif
+		
+		char app_filename[PATH_MAX];
+		get_app_filename(app_filename);
+		
+		char app_root_directory[PATH_MAX];
+		get_parent_directory(app_filename, app_root_directory, 2);
+		
+		char ca_bundle[strlen(app_root_directory) + strlen(CA_CERT_FILENAME) + 1];
+		strcpy(ca_bundle, app_root_directory);
+		strcat(ca_bundle, CA_CERT_FILENAME);
+		
+		code = certificates_load_bundle(ca_bundle);
+	}
+	
+	if (code != UERR_SUCCESS || !bearssl) {
+		return code;
+	}
+	
+	return certificates_decode_bundle();
+	
+}
+
+const struct curl_blob* certificates_get_bundle(void) {
+	
+	if (certificates_bundle.data == NULL) {
+		return NULL;
+	}
+	
+	return &certificates_bundle;
+	
+}
+
+static CURLcode certificates_ssl_ctx_cb(CURL* const curl, void* const ssl_ctx, void* const userdata) {
+	/*
+	Called by libcurl right after it set up the BearSSL client context of a new
+	connection. Points the X.509 engine at the trust anchors decoded at startup,
+	since libcurl itself was given none to parse.
+	*/
+	
+	(void) curl;
+	(void) userdata;
+	
+	const br_ssl_client_context* const context = (const br_ssl_client_context*) ssl_ctx;
+	struct CurlX509Context* const x509 = (struct CurlX509Context*) context->eng.x509ctx;
+	
+	/*
+	Refuse to go on (rather than silently skipping verification) if libcurl's
+	context does not look like what we expect.
+	*/
+	if (x509 == NULL || x509->minimal.vtable != &br_x509_minimal_vtable) {
+		return CURLE_SSL_CERTPROBLEM;
+	}
+	
+	x509->minimal.trust_anchors = certificates_anchors;
+	x509->minimal.trust_anchors_num = certificates_count;
+	
+	return CURLE_OK;
+	
+}
+
+curl_ssl_ctx_callback certificates_get_ssl_ctx_cb(void) {
+	/*
+	Returns the CURLOPT_SSL_CTX_FUNCTION handing out the pre-decoded trust
+	anchors, or NULL if there are none and the PEM bundle has to be used.
+	*/
+	
+	if (certificates_count == 0) {
+		return NULL;
+	}
+	
+	return certificates_ssl_ctx_cb;
+	
+}
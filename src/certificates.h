@@ -0,0 +1,7 @@
+#include <curl/curl.h>
+
+int certificates_initialize(void);
+const struct curl_blob* certificates_get_bundle(void);
+curl_ssl_ctx_callback certificates_get_ssl_ctx_cb(void);
+
+#pragma once
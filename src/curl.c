@@ -1,10 +1,10 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifdef _WIN32
 	#include <synchapi.h>
-#else
-	#include <unistd.h>
 #endif
 
 #include <curl/curl.h>
@@ -15,20 +15,28 @@
 #include "symbols.h"
 #include "fstream.h"
 #include "errors.h"
-
-#ifndef SPARKLEC_DISABLE_CERTIFICATE_VALIDATION
-	static const char CA_CERT_FILENAME[] = 
-		PATH_SEPARATOR
-		"etc"
-		PATH_SEPARATOR
-		"tls"
-		PATH_SEPARATOR
-		"cert.pem";
-#endif
+#include "threads.h"
+#include "os.h"
+#include "bandwidth.h"
+#include "callbacks.h"
+#include "certificates.h"
 
 static const char HTTP_DEFAULT_USER_AGENT[] = "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/109.0.5414.119 Safari/537.36";
-static const long HTTP_MAX_CONCURRENT_CONNECTIONS = 30L;
 static const size_t HTTP_MAX_RETRIES = 10;
+static const long long HTTP_RETRY_BASE_DELAY = 500;
+static const long long HTTP_RETRY_MAX_DELAY = 30000;
+static const long long HTTP_RETRY_AFTER_MAX_DELAY = 600000;
+
+/*
+A transfer receiving less than HTTP_LOW_SPEED_LIMIT bytes per second for
+HTTP_LOW_SPEED_TIME seconds in a row is considered stalled and aborted (and then
+retried like any other timeout).
+*/
+static const long HTTP_LOW_SPEED_LIMIT = 512;
+static const long HTTP_LOW_SPEED_TIME = 30;
+
+#define HTTP_MAX_POOLED_HANDLES 64
+#define HTTP_MAX_TEMPLATE_OPTIONS 24
 
 static char CURL_ERROR_MESSAGE[CURL_ERROR_SIZE] = {'\0'};
 
@@ -36,21 +44,288 @@ static int GLOBALS_INITIALIZED = 0;
 
 static CURL* curl_easy_global = NULL;
 static CURLM* curl_multi_global = NULL;
-static struct curl_blob curl_blob_global = {0};
+static CURLM* curl_multi_workers[8] = {NULL};
+static CURLSH* curl_share_global = NULL;
+
+/*
+Value of CURLOPT_ACCEPT_ENCODING for metadata requests: every encoding libcurl
+can decode, or NULL if it was built without any of them. Bulk transfers never
+ask for it, since media segments and attachments are compressed already.
+*/
+static const char* curl_accept_encoding = NULL;
+
+/*
+Bytes metadata response bodies took on the wire and their size once decoded.
+Metadata requests are only made from the main thread.
+*/
+static curl_off_t curl_metadata_wire = 0;
+static curl_off_t curl_metadata_decoded = 0;
+static struct Mutex curl_share_locks[CURL_LOCK_DATA_LAST];
+
+/*
+Installed on every handle when the trust anchors were decoded ahead of time
+(see certificates.c).
+*/
+static curl_ssl_ctx_callback curl_ssl_ctx_function = NULL;
+
+/*
+Options every handle starts with. They are computed once and then simply
+replayed on new handles and on handles returned to the pool.
+*/
+struct CurlOption {
+	CURLoption option;
+	long number;
+	const void* pointer;
+};
+
+static struct CurlOption curl_options_template[HTTP_MAX_TEMPLATE_OPTIONS] = {0};
+static size_t curl_options_count = 0;
+
+static long curl_http_version = CURL_HTTP_VERSION_1_1;
+
+/*
+Idle easy handles, ready to be handed out again by curl_easy_acquire().
+*/
+static CURL* curl_easy_pool[HTTP_MAX_POOLED_HANDLES] = {NULL};
+static size_t curl_easy_pool_size = 0;
+static struct Mutex curl_easy_pool_lock;
+
+static void curl_option_long(const CURLoption option, const long value) {
+	
+	curl_options_template[curl_options_count++] = (struct CurlOption) {
+		.option = option,
+		.number = value
+	};
+	
+}
+
+static void curl_option_pointer(const CURLoption option, const void* const value) {
+	
+	curl_options_template[curl_options_count++] = (struct CurlOption) {
+		.option = option,
+		.pointer = value
+	};
+	
+}
+
+long curl_get_ipresolve(void) {
+	/*
+	Connections race IPv4 and IPv6 against each other ("Happy Eyeballs") by default.
+	Setting "SPARKLEC_IPRESOLVE" to "v4" (or "v6") restricts them to a single family.
+	*/
+	
+	const char* const value = getenv("SPARKLEC_IPRESOLVE");
+	
+	if (value == NULL) {
+		return CURL_IPRESOLVE_WHATEVER;
+	}
+	
+	if (strcmp(value, "v4") == 0) {
+		return CURL_IPRESOLVE_V4;
+	}
+	
+	if (strcmp(value, "v6") == 0) {
+		return CURL_IPRESOLVE_V6;
+	}
+	
+	return CURL_IPRESOLVE_WHATEVER;
+	
+}
+
+static long curl_get_http_version(void) {
+	/*
+	HTTP/2 is used whenever libcurl was built with it, so that concurrent requests
+	to the same host are multiplexed over a few connections instead of each one
+	paying for its own TCP and TLS handshakes. Setting "SPARKLEC_HTTP_VERSION" to
+	"1.1" forces HTTP/1.1 anyway.
+	*/
+	
+	const char* const value = getenv("SPARKLEC_HTTP_VERSION");
+	
+	if (value != NULL && strcmp(value, "1.1") == 0) {
+		return CURL_HTTP_VERSION_1_1;
+	}
+	
+	const curl_version_info_data* const info = curl_version_info(CURLVERSION_NOW);
+	
+	if ((info->features & CURL_VERSION_HTTP2) == 0) {
+		return CURL_HTTP_VERSION_1_1;
+	}
+	
+	return CURL_HTTP_VERSION_2TLS;
+	
+}
+
+static const char* curl_get_accept_encoding(void) {
+	
+	const curl_version_info_data* const info = curl_version_info(CURLVERSION_NOW);
+	
+	if ((info->features & (CURL_VERSION_LIBZ | CURL_VERSION_BROTLI | CURL_VERSION_ZSTD)) == 0) {
+		return NULL;
+	}
+	
+	/*
+	An empty string makes libcurl advertise (and decode) all of them.
+	*/
+	return "";
+	
+}
+
+static void curl_options_initialize(void) {
+	
+	curl_options_count = 0;
+	curl_http_version = curl_get_http_version();
+	curl_accept_encoding = curl_get_accept_encoding();
+	
+	curl_option_long(CURLOPT_FAILONERROR, 1L);
+	curl_option_long(CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_option_long(CURLOPT_TCP_KEEPIDLE, 30L);
+	curl_option_long(CURLOPT_TCP_KEEPINTVL, 15L);
+	curl_option_long(CURLOPT_VERBOSE, 0L);
+	curl_option_long(CURLOPT_HTTP_VERSION, curl_http_version);
+	
+	/*
+	Rather wait for a connection that can be multiplexed than open a new one.
+	*/
+	if (curl_http_version != CURL_HTTP_VERSION_1_1) {
+		curl_option_long(CURLOPT_PIPEWAIT, 1L);
+	}
+	
+	curl_option_pointer(CURLOPT_USERAGENT, HTTP_DEFAULT_USER_AGENT);
+	curl_option_long(CURLOPT_IPRESOLVE, curl_get_ipresolve());
+	curl_option_pointer(CURLOPT_CAINFO, NULL);
+	curl_option_pointer(CURLOPT_CAPATH, NULL);
+	curl_option_long(CURLOPT_DNS_CACHE_TIMEOUT, -1L);
+	curl_option_long(CURLOPT_TCP_FASTOPEN, 1L);
+	curl_option_long(CURLOPT_DNS_SHUFFLE_ADDRESSES, 1L);
+	curl_option_long(CURLOPT_NOSIGNAL, 1L);
+	curl_option_long(CURLOPT_LOW_SPEED_LIMIT, HTTP_LOW_SPEED_LIMIT);
+	curl_option_long(CURLOPT_LOW_SPEED_TIME, HTTP_LOW_SPEED_TIME);
+	curl_option_pointer(CURLOPT_SHARE, curl_share_global);
+	
+	/*
+	Sharing cookies does not turn the cookie engine on; without it, handles
+	neither send the shared cookies nor store the ones they receive.
+	*/
+	curl_option_pointer(CURLOPT_COOKIEFILE, "");
+	
+	#ifdef SPARKLEC_DISABLE_CERTIFICATE_VALIDATION
+		curl_option_long(CURLOPT_SSL_VERIFYPEER, 0L);
+	#else
+		curl_ssl_ctx_function = certificates_get_ssl_ctx_cb();
+		
+		const struct curl_blob* const bundle = certificates_get_bundle();
+		
+		if (curl_ssl_ctx_function == NULL && bundle == NULL) {
+			curl_option_long(CURLOPT_SSL_VERIFYPEER, 0L);
+		} else if (curl_ssl_ctx_function == NULL) {
+			curl_option_pointer(CURLOPT_CAINFO_BLOB, bundle);
+		}
+	#endif
+	
+}
+
+static int curl_set_options(CURL* handle) {
+	
+	for (size_t index = 0; index < curl_options_count; index++) {
+		const struct CurlOption* const option = &curl_options_template[index];
+		
+		if (option->option < CURLOPTTYPE_OBJECTPOINT) {
+			curl_easy_setopt(handle, option->option, option->number);
+		} else {
+			curl_easy_setopt(handle, option->option, option->pointer);
+		}
+	}
+	
+	if (curl_ssl_ctx_function != NULL) {
+		curl_easy_setopt(handle, CURLOPT_SSL_CTX_FUNCTION, curl_ssl_ctx_function);
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static void curl_share_lock_cb(CURL* const handle, const curl_lock_data data, const curl_lock_access access, void* const userptr) {
+	
+	(void) handle;
+	(void) access;
+	(void) userptr;
+	
+	mutex_lock(&curl_share_locks[data]);
+	
+}
+
+static void curl_share_unlock_cb(CURL* const handle, const curl_lock_data data, void* const userptr) {
+	
+	(void) handle;
+	(void) userptr;
+	
+	mutex_unlock(&curl_share_locks[data]);
+	
+}
+
+static int curl_share_initialize(void) {
+	/*
+	A single share object backs every handle we create, so that the DNS cache, TLS
+	sessions and cookies warmed up by one of them (e.g. while authenticating or
+	crawling a course) are available to all the others, including the ones used
+	concurrently by the transfer workers.
+	
+	The connection pool is not shared: libcurl does not support using a shared
+	pool from concurrent threads, so each multi handle keeps its own.
+	*/
+	
+	for (size_t index = 0; index < sizeof(curl_share_locks) / sizeof(*curl_share_locks); index++) {
+		if (!mutex_init(&curl_share_locks[index])) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+	}
+	
+	curl_share_global = curl_share_init();
+	
+	if (curl_share_global == NULL) {
+		return UERR_CURL_FAILURE;
+	}
+	
+	curl_share_setopt(curl_share_global, CURLSHOPT_LOCKFUNC, curl_share_lock_cb);
+	curl_share_setopt(curl_share_global, CURLSHOPT_UNLOCKFUNC, curl_share_unlock_cb);
+	curl_share_setopt(curl_share_global, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curl_share_global, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(curl_share_global, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+	
+	return UERR_SUCCESS;
+	
+}
 
 static void globals_destroy(void) {
 	
+	for (size_t index = 0; index < sizeof(curl_multi_workers) / sizeof(*curl_multi_workers); index++) {
+		curl_multi_cleanup(curl_multi_workers[index]);
+		curl_multi_workers[index] = NULL;
+	}
+	
 	curl_multi_cleanup(curl_multi_global);
 	curl_multi_global = NULL;
 	
 	curl_easy_cleanup(curl_easy_global);
 	curl_easy_global = NULL;
 	
-	if (curl_blob_global.data != NULL) {
-		free(curl_blob_global.data);
+	while (curl_easy_pool_size > 0) {
+		curl_easy_cleanup(curl_easy_pool[--curl_easy_pool_size]);
+	}
+	
+	mutex_destroy(&curl_easy_pool_lock);
+	
+	/*
+	Only safe once no easy handle references the share anymore.
+	*/
+	if (curl_share_global != NULL) {
+		curl_share_cleanup(curl_share_global);
+		curl_share_global = NULL;
 		
-		curl_blob_global.data = NULL;
-		curl_blob_global.len = 0;
+		for (size_t index = 0; index < sizeof(curl_share_locks) / sizeof(*curl_share_locks); index++) {
+			mutex_destroy(&curl_share_locks[index]);
+		}
 	}
 	
 }
@@ -63,75 +338,39 @@ static int globals_initialize(void) {
 	
 	curl_global_init(CURL_GLOBAL_ALL);
 	
-	atexit(globals_destroy);
-	
+	/*
+	Before registering our own cleanup, so that the trust anchors outlive every
+	handle and connection.
+	*/
 	#ifndef SPARKLEC_DISABLE_CERTIFICATE_VALIDATION
-		char app_filename[PATH_MAX];
-		get_app_filename(app_filename);
-		
-		char app_root_directory[PATH_MAX];
-		get_parent_directory(app_filename, app_root_directory, 2);
-		
-		char ca_bundle[strlen(app_root_directory) + strlen(CA_CERT_FILENAME) + 1];
-		strcpy(ca_bundle, app_root_directory);
-		strcat(ca_bundle, CA_CERT_FILENAME);
-		
-		const long long file_size = get_file_size(ca_bundle);
-		
-		struct FStream* const stream = fstream_open(ca_bundle, "r");
-		
-		if (stream == NULL) {
-			return UERR_FSTREAM_FAILURE;
-		}
-		
-		curl_blob_global.data = malloc((size_t) file_size);
+		const int status = certificates_initialize();
 		
-		if (curl_blob_global.data == NULL) {
-			return UERR_MEMORY_ALLOCATE_FAILURE;
-		}
-		
-		const ssize_t rsize = fstream_read(stream, curl_blob_global.data, (size_t) file_size);
-		
-		fstream_close(stream);
-		
-		if (rsize != (ssize_t) file_size) {
-			return UERR_FSTREAM_FAILURE;
+		if (status != UERR_SUCCESS) {
+			return status;
 		}
-		
-		curl_blob_global.len = (size_t) rsize;
 	#endif
 	
-	GLOBALS_INITIALIZED = 1;
+	atexit(globals_destroy);
 	
-	return UERR_SUCCESS;
+	if (!mutex_init(&curl_easy_pool_lock)) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
 	
-}
-
-static int curl_set_options(CURL* handle) {
+	int code = curl_share_initialize();
 	
-	curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
-	curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
-	curl_easy_setopt(handle, CURLOPT_TCP_KEEPIDLE, 30L);
-	curl_easy_setopt(handle, CURLOPT_TCP_KEEPINTVL, 15L);
-	curl_easy_setopt(handle, CURLOPT_VERBOSE, 0L);
-	curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
-	curl_easy_setopt(handle, CURLOPT_USERAGENT, HTTP_DEFAULT_USER_AGENT);
-	curl_easy_setopt(handle, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
-	curl_easy_setopt(handle, CURLOPT_CAINFO, NULL);
-	curl_easy_setopt(handle, CURLOPT_CAPATH, NULL);
-	curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, -1L);
-	curl_easy_setopt(handle, CURLOPT_TCP_FASTOPEN, 1L);
-	curl_easy_setopt(handle, CURLOPT_DNS_SHUFFLE_ADDRESSES, 1L);
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
 	
-	#ifdef SPARKLEC_DISABLE_CERTIFICATE_VALIDATION
-		curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0L);
-	#else
-		if (curl_blob_global.data == NULL) {
-			curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0L);
-		} else {
-			curl_easy_setopt(handle, CURLOPT_CAINFO_BLOB, &curl_blob_global);
-		}
-	#endif
+	code = bandwidth_initialize();
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	curl_options_initialize();
+	
+	GLOBALS_INITIALIZED = 1;
 	
 	return UERR_SUCCESS;
 	
@@ -177,6 +416,62 @@ CURL* curl_easy_new(void) {
 	
 }
 
+CURL* curl_easy_acquire(void) {
+	/*
+	Hands out a ready-to-use easy handle, recycling an idle one whenever possible.
+	Handles obtained here must be given back with curl_easy_release().
+	*/
+	
+	if (globals_initialize() != UERR_SUCCESS) {
+		return NULL;
+	}
+	
+	CURL* handle = NULL;
+	
+	mutex_lock(&curl_easy_pool_lock);
+	
+	if (curl_easy_pool_size > 0) {
+		handle = curl_easy_pool[--curl_easy_pool_size];
+	}
+	
+	mutex_unlock(&curl_easy_pool_lock);
+	
+	if (handle != NULL) {
+		return handle;
+	}
+	
+	return curl_easy_new();
+	
+}
+
+void curl_easy_release(CURL* const handle) {
+	/*
+	Returns a handle to the pool. Its options are reset back to the template,
+	while its connections, DNS and TLS session caches are kept.
+	*/
+	
+	if (handle == NULL) {
+		return;
+	}
+	
+	curl_easy_reset(handle);
+	curl_set_options(handle);
+	
+	mutex_lock(&curl_easy_pool_lock);
+	
+	if (curl_easy_pool_size < HTTP_MAX_POOLED_HANDLES) {
+		curl_easy_pool[curl_easy_pool_size++] = handle;
+		mutex_unlock(&curl_easy_pool_lock);
+		
+		return;
+	}
+	
+	mutex_unlock(&curl_easy_pool_lock);
+	
+	curl_easy_cleanup(handle);
+	
+}
+
 CURLM* get_global_curl_multi(void) {
 	
 	if (globals_initialize() != UERR_SUCCESS) {
@@ -187,63 +482,250 @@ CURLM* get_global_curl_multi(void) {
 		return curl_multi_global;
 	}
 	
-	curl_multi_global = curl_multi_init();
+	curl_multi_global = curl_multi_new();
 	
 	if (curl_multi_global == NULL) {
 		return NULL;
 	}
 	
-	curl_multi_setopt(curl_multi_global, CURLMOPT_MAX_HOST_CONNECTIONS, HTTP_MAX_CONCURRENT_CONNECTIONS);
-	curl_multi_setopt(curl_multi_global, CURLMOPT_MAX_TOTAL_CONNECTIONS, HTTP_MAX_CONCURRENT_CONNECTIONS);
-	
 	return curl_multi_global;
 	
 }
 
+CURLM* get_worker_curl_multi(const size_t index) {
+	/*
+	Each transfer worker drives its own multi handle (a multi handle must never be
+	used by more than one thread at a time). They are kept alive for the whole
+	process so that their connection caches survive between transfers.
+	
+	Worker 0 runs on the calling thread and simply uses the global multi handle.
+	*/
+	
+	if (index == 0) {
+		return get_global_curl_multi();
+	}
+	
+	if (index > sizeof(curl_multi_workers) / sizeof(*curl_multi_workers)) {
+		return NULL;
+	}
+	
+	CURLM** const handle = &curl_multi_workers[index - 1];
+	
+	if (*handle == NULL) {
+		*handle = curl_multi_new();
+	}
+	
+	return *handle;
+	
+}
+
+CURLM* curl_multi_new(void) {
+	/*
+	No connection limits are set here; how many requests each host gets is
+	decided by the transfer engine (see hosts.c). With HTTP/2 those requests
+	are multiplexed as streams over as few connections as possible.
+	*/
+	
+	if (globals_initialize() != UERR_SUCCESS) {
+		return NULL;
+	}
+	
+	CURLM* const handle = curl_multi_init();
+	
+	if (handle == NULL) {
+		return NULL;
+	}
+	
+	curl_multi_setopt(handle, CURLMOPT_PIPELINING, (curl_http_version == CURL_HTTP_VERSION_1_1) ? CURLPIPE_NOTHING : CURLPIPE_MULTIPLEX);
+	
+	return handle;
+	
+}
+
 const char* get_global_curl_error(void) {
 	
 	return CURL_ERROR_MESSAGE;
 	
 }
 
-CURLcode curl_easy_perform_retry(CURL* const curl) {
+int curl_is_transient(CURL* const handle, const CURLcode code) {
+	/*
+	Whether a failed request is worth retrying: network errors, timeouts and
+	HTTP status codes that mean "try again later".
+	*/
+	
+	switch (code) {
+		case CURLE_HTTP_RETURNED_ERROR: {
+			long status_code = 0;
+			curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status_code);
+			
+			return status_code == 408 || status_code == 429 || status_code == 500 || status_code == 502 || status_code == 503 || status_code == 504;
+		}
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_SSL_CONNECT_ERROR:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_PARTIAL_FILE:
+		case CURLE_GOT_NOTHING:
+			return 1;
+		default:
+			return 0;
+	}
+	
+}
+
+long long curl_get_retry_after(CURL* const handle) {
+	/*
+	Returns how many milliseconds the server asked us to wait through the
+	"Retry-After" header of its last response (at most 10 minutes), or 0 if it
+	did not.
+	*/
+	
+	curl_off_t retry_after = 0;
+	
+	if (curl_easy_getinfo(handle, CURLINFO_RETRY_AFTER, &retry_after) != CURLE_OK || retry_after < 1) {
+		return 0;
+	}
+	
+	if (retry_after > HTTP_RETRY_AFTER_MAX_DELAY / 1000) {
+		return HTTP_RETRY_AFTER_MAX_DELAY;
+	}
+	
+	return (long long) retry_after * 1000;
+	
+}
+
+long long curl_get_retry_delay(CURL* const handle, const size_t retries) {
+	/*
+	Returns how many milliseconds to wait before the given retry (starting at 1)
+	of a failed request, or -1 once it ran out of retries.
+	
+	The delay doubles with every retry up to HTTP_RETRY_MAX_DELAY; half of it is
+	random so that requests that failed together do not come back together. A
+	longer wait asked for by the server through "Retry-After" always wins.
+	*/
+	
+	if (retries < 1 || retries > HTTP_MAX_RETRIES) {
+		return -1;
+	}
+	
+	long long delay = HTTP_RETRY_BASE_DELAY;
+	
+	for (size_t index = 1; index < retries && delay < HTTP_RETRY_MAX_DELAY; index++) {
+		delay *= 2;
+	}
+	
+	if (delay > HTTP_RETRY_MAX_DELAY) {
+		delay = HTTP_RETRY_MAX_DELAY;
+	}
+	
+	/*
+	splitmix64 over the clock and the handle address; good enough for jitter and
+	safe to call from any thread.
+	*/
+	uint64_t seed = (uint64_t) get_monotonic_time() ^ (uint64_t) (uintptr_t) handle ^ (uint64_t) retries;
+	seed += 0x9E3779B97F4A7C15ULL;
+	seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+	seed ^= seed >> 31;
+	
+	const long long jittered = delay / 2 + (long long) (seed % (uint64_t) (delay / 2 + 1));
+	const long long retry_after = curl_get_retry_after(handle);
+	
+	return (retry_after > jittered) ? retry_after : jittered;
+	
+}
+
+CURLcode curl_easy_perform_resumable(CURL* const curl, const enum BandwidthClass priority, const curl_rewind_cb rewind, void* const userdata) {
+	/*
+	Performs a request within the share of the global bandwidth budget its
+	priority class is entitled to, retrying it on transient failures. "rewind"
+	(if not NULL) is called before each retry, so that whatever the failed attempt
+	already wrote can be either continued or discarded.
+	
+	Only metadata responses are asked to be compressed. Their sizes are accounted
+	when they are written with curl_write_string_cb(), which is what every
+	provider collects them with.
+	*/
+	
+	const int metadata = (priority == BANDWIDTH_CLASS_METADATA);
+	
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, metadata ? curl_accept_encoding : NULL);
 	
-	size_t retry_after = 1;
 	size_t retries = 0;
 	
 	while (1) {
+		if (retries > 0 && rewind != NULL && (*rewind)(curl, userdata) != UERR_SUCCESS) {
+			return CURLE_WRITE_ERROR;
+		}
+		
+		bandwidth_acquire(priority);
+		
+		curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, bandwidth_get_share(priority));
+		
+		const curl_off_t written = curl_write_string_total();
+		
 		const CURLcode code = curl_easy_perform(curl);
 		
-		switch (code) {
-			case CURLE_HTTP_RETURNED_ERROR: {
-				long status_code = 0;
-				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
-				
-				if (!(status_code == 408 || status_code == 429 || status_code == 500 || status_code == 502 || status_code == 503 || status_code == 504)) {
-					return code;
-				}
-				
-				break;
-			}
-			case CURLE_OPERATION_TIMEDOUT:
-				break;
-			default:
-				return code;
+		bandwidth_release(priority, 1);
+		
+		const curl_off_t decoded = curl_write_string_total() - written;
+		
+		if (metadata && decoded > 0) {
+			curl_off_t wire = 0;
+			curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+			
+			curl_metadata_wire += wire;
+			curl_metadata_decoded += decoded;
+		}
+		
+		if (code == CURLE_OK || !curl_is_transient(curl, code)) {
+			return code;
 		}
 		
 		retries++;
 		
-		if (retries > HTTP_MAX_RETRIES) {
+		const long long delay = curl_get_retry_delay(curl, retries);
+		
+		if (delay < 0) {
 			return code;
 		}
 		
-		retry_after += retry_after;
-		
 		#ifdef _WIN32
-			Sleep((DWORD) (retry_after * 1000));
+			Sleep((DWORD) delay);
 		#else
-			sleep(retry_after);
+			const struct timespec duration = {
+				.tv_sec = (time_t) (delay / 1000),
+				.tv_nsec = (long) ((delay % 1000) * 1000000)
+			};
+			
+			nanosleep(&duration, NULL);
 		#endif
 	}
 	
-}
\ No newline at end of file
+}
+
+void curl_get_metadata_sizes(curl_off_t* const wire, curl_off_t* const decoded) {
+	/*
+	Returns how many bytes metadata responses took on the wire and how many they
+	decoded to, so far.
+	*/
+	
+	*wire = curl_metadata_wire;
+	*decoded = curl_metadata_decoded;
+	
+}
+
+CURLcode curl_easy_perform_priority(CURL* const curl, const enum BandwidthClass priority) {
+	
+	return curl_easy_perform_resumable(curl, priority, NULL, NULL);
+	
+}
+
+CURLcode curl_easy_perform_retry(CURL* const curl) {
+	
+	return curl_easy_perform_priority(curl, BANDWIDTH_CLASS_METADATA);
+	
+}
@@ -1,10 +1,30 @@
 #include <curl/curl.h>
 
+#include "bandwidth.h"
+
 CURL* get_global_curl_easy(void);
 CURL* curl_easy_new(void);
 
+CURL* curl_easy_acquire(void);
+void curl_easy_release(CURL* const handle);
+
 CURLM* get_global_curl_multi(void);
+CURLM* get_worker_curl_multi(const size_t index);
+CURLM* curl_multi_new(void);
 
 const char* get_global_curl_error(void);
+long curl_get_ipresolve(void);
+
+int curl_is_transient(CURL* const handle, const CURLcode code);
+long long curl_get_retry_after(CURL* const handle);
+long long curl_get_retry_delay(CURL* const handle, const size_t retries);
+/*
+Called before each retry of curl_easy_perform_resumable(). Returns UERR_SUCCESS
+to go on with the retry, or any other UERR_* code to give up.
+*/
+typedef int (*curl_rewind_cb)(CURL* const curl, void* const userdata);
 
+CURLcode curl_easy_perform_resumable(CURL* const curl, const enum BandwidthClass priority, const curl_rewind_cb rewind, void* const userdata);
+void curl_get_metadata_sizes(curl_off_t* const wire, curl_off_t* const decoded);
+CURLcode curl_easy_perform_priority(CURL* const curl, const enum BandwidthClass priority);
 CURLcode curl_easy_perform_retry(CURL* const curl);
\ No newline at end of file
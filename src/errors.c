@@ -30,6 +30,20 @@ const char* strurr(const int code) {
 			return "Não foi encontrado um canal de reprodução para a mídia";
 		case UERR_TIDY_FAILURE:
 			return "Não foi possível processar o conteúdo HTML";
+		case UERR_CURLM_FAILURE:
+			return "Não foi possível gerenciar as transferências HTTP simultâneas";
+		case UERR_TRANSFER_TOO_MANY_FILES:
+			return "O limite de arquivos abertos simultaneamente foi atingido";
+		case UERR_TRANSFER_LOOP_FAILURE:
+			return "Não foi possível aguardar por eventos de rede";
+		case UERR_TRANSFER_RETRIES_EXHAUSTED:
+			return "O download de um dos arquivos falhou mesmo após várias tentativas";
+		case UERR_TRANSFER_RANGE_MISMATCH:
+			return "O servidor não respeitou o intervalo de bytes requisitado";
+		case UERR_AES_INVALID_KEY:
+			return "A chave de criptografia da mídia é inválida";
+		case UERR_AES_DECRYPT_FAILURE:
+			return "Não foi possível descriptografar um dos seguimentos de mídia";
 		default:
 			return "Causa desconhecida ou não especificada";
 	}
@@ -34,6 +34,13 @@
 #define UERR_UNSUPPORTED -25
 #define UERR_CURL_GETINFO_FAILURE -26
 #define UERR_BUFFER_OVERFLOW_FAILURE -27
+#define UERR_CURLM_FAILURE -28
+#define UERR_TRANSFER_TOO_MANY_FILES -29
+#define UERR_TRANSFER_LOOP_FAILURE -30
+#define UERR_TRANSFER_RETRIES_EXHAUSTED -31
+#define UERR_TRANSFER_RANGE_MISMATCH -32
+#define UERR_AES_INVALID_KEY -33
+#define UERR_AES_DECRYPT_FAILURE -34
 
 struct SystemError {
 	int code;
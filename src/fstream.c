@@ -1,10 +1,13 @@
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _WIN32
 	#include <windows.h>
 	#include <fileapi.h>
 #else
 	#include <stdio.h>
+	#include <fcntl.h>
+	#include <unistd.h>
 #endif
 
 #include "fstream.h"
@@ -20,6 +23,13 @@ struct FStream* fstream_open(const char* const filename, const char* const mode)
 		DWORD dwCreationDisposition = 0;
 		const DWORD dwFlagsAndAttributes = FILE_ATTRIBUTE_NORMAL;
 		
+		/*
+		Files opened for update ("r+") are written at different offsets by several
+		streams at once (see transfer.c), so those must not lock each other out.
+		*/
+		const int update = (strchr(mode, '+') != NULL);
+		const DWORD dwShareMode = update ? (FILE_SHARE_READ | FILE_SHARE_WRITE) : 0;
+		
 		switch (*mode) {
 			case 'w':
 				dwDesiredAccess |= GENERIC_WRITE;
@@ -28,6 +38,11 @@ struct FStream* fstream_open(const char* const filename, const char* const mode)
 			case 'r':
 				dwDesiredAccess |= GENERIC_READ;
 				dwCreationDisposition |= OPEN_EXISTING;
+				
+				if (update) {
+					dwDesiredAccess |= GENERIC_WRITE;
+				}
+				
 				break;
 			default:
 				return NULL;
@@ -50,7 +65,7 @@ struct FStream* fstream_open(const char* const filename, const char* const mode)
 			HANDLE handle = CreateFileW(
 				lpFileName,
 				dwDesiredAccess,
-				0,
+				dwShareMode,
 				NULL,
 				dwCreationDisposition,
 				dwFlagsAndAttributes,
@@ -60,7 +75,7 @@ struct FStream* fstream_open(const char* const filename, const char* const mode)
 			HANDLE handle = CreateFileA(
 				filename,
 				dwDesiredAccess,
-				0,
+				dwShareMode,
 				NULL,
 				dwCreationDisposition,
 				dwFlagsAndAttributes,
@@ -144,7 +159,7 @@ int fstream_write(struct FStream* const stream, const char* const buffer, const
 	
 }
 
-int fstream_seek(struct FStream* const stream, const long int offset, const enum FStreamSeek method) {
+int fstream_seek(struct FStream* const stream, const long long offset, const enum FStreamSeek method) {
 	
 	#ifdef _WIN32
 		DWORD whence = 0;
@@ -161,7 +176,11 @@ int fstream_seek(struct FStream* const stream, const long int offset, const enum
 				break;
 		}
 		
-		if (SetFilePointer(stream->stream, offset, NULL, whence) == INVALID_SET_FILE_POINTER) {
+		LARGE_INTEGER distance = {
+			.QuadPart = offset
+		};
+		
+		if (SetFilePointerEx(stream->stream, distance, NULL, whence) == 0) {
 			return 0;
 		}
 	#else
@@ -179,7 +198,58 @@ int fstream_seek(struct FStream* const stream, const long int offset, const enum
 				break;
 		}
 		
-		if (fseek(stream->stream, offset, whence) != 0) {
+		if (fseeko(stream->stream, (off_t) offset, whence) != 0) {
+			return 0;
+		}
+	#endif
+	
+	return 1;
+	
+}
+
+int fstream_allocate(struct FStream* const stream, const long long size) {
+	/*
+	Grows the file to "size" bytes up front, so that it can be written out of order
+	(and without fragmenting it). The file position is left untouched.
+	*/
+	
+	#ifdef _WIN32
+		LARGE_INTEGER position = {0};
+		LARGE_INTEGER zero = {0};
+		
+		if (SetFilePointerEx(stream->stream, zero, &position, FILE_CURRENT) == 0) {
+			return 0;
+		}
+		
+		LARGE_INTEGER distance = {
+			.QuadPart = size
+		};
+		
+		if (SetFilePointerEx(stream->stream, distance, NULL, FILE_BEGIN) == 0 || SetEndOfFile(stream->stream) == 0) {
+			return 0;
+		}
+		
+		if (SetFilePointerEx(stream->stream, position, NULL, FILE_BEGIN) == 0) {
+			return 0;
+		}
+	#else
+		if (fflush(stream->stream) != 0) {
+			return 0;
+		}
+		
+		const int descriptor = fileno(stream->stream);
+		
+		#ifdef __linux__
+			/*
+			Reserve the blocks for real where the filesystem supports it; elsewhere
+			(or if it does not) a sparse file will do.
+			*/
+			if (posix_fallocate(descriptor, 0, (off_t) size) == 0) {
+				return 1;
+			}
+		#endif
+		
+		if (ftruncate(descriptor, (off_t) size) != 0) {
 			return 0;
 		}
 	#endif
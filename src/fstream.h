@@ -23,7 +23,8 @@ enum FStreamSeek {
 struct FStream* fstream_open(const char* const filename, const char* const mode);
 ssize_t fstream_read(struct FStream* const stream, char* const buffer, const size_t size);
 int fstream_write(struct FStream* const stream, const char* const buffer, const size_t size);
-int fstream_seek(struct FStream* const stream, const long int offset, const enum FStreamSeek method);
+int fstream_seek(struct FStream* const stream, const long long offset, const enum FStreamSeek method);
+int fstream_allocate(struct FStream* const stream, const long long size);
 int fstream_close(struct FStream* const stream);
 
 #pragma once
@@ -0,0 +1,643 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+#else
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <netdb.h>
+#endif
+
+#include <curl/curl.h>
+
+#include "hosts.h"
+#include "curl.h"
+#include "threads.h"
+#include "errors.h"
+#include "os.h"
+
+/*
+Limits of the per-host concurrency controller. Each host starts with a small
+number of simultaneous connections and, every round (HOST_ROUND_TIME
+milliseconds) in which it used all of them and its throughput went up, doubles
+them until the server first pushes back (or more connections stop paying off),
+then gains only one more per round. It loses half of them whenever the server
+pushes back.
+*/
+static const size_t HOST_INITIAL_LIMIT = 8;
+static const size_t HOST_MAX_LIMIT = 64;
+static const long long HOST_ROUND_TIME = 1000;
+static const double HOST_THROUGHPUT_GAIN = 1.05;
+
+/*
+How long to wait before checking again a host that is at its connection limit.
+*/
+static const long long HOST_BUSY_WAIT_TIME = 50;
+
+/*
+Address scoreboard. The addresses of each host (up to HOST_MAX_ADDRESSES of
+them) are looked up once in the background; measurements are smoothed with a
+weight of HOST_SAMPLE_WEIGHT for the newest one. When a host has more than one
+address, new requests are steered to the one expected to be the fastest, except
+for one in every HOST_EXPLORE_PERIOD requests, which goes to the least measured
+one so that the others (and changes in their performance) keep being explored.
+An address that could not be connected to is left out for HOST_DEMOTE_TIME
+milliseconds.
+*/
+#define HOST_MAX_ADDRESSES 16
+#define HOST_MAX_ADDRESS_LENGTH 64
+
+static const double HOST_SAMPLE_WEIGHT = 0.3;
+static const size_t HOST_EXPLORE_PERIOD = 8;
+static const long long HOST_DEMOTE_TIME = 30000;
+
+static int HOSTS_INITIALIZED = 0;
+
+static struct Host** hosts = NULL;
+static size_t hosts_offset = 0;
+static size_t hosts_size = 0;
+
+static struct Mutex hosts_lock;
+
+static struct HostRateLimit hosts_rate_limit = {0};
+
+static void hosts_destroy(void) {
+	
+	for (size_t index = 0; index < hosts_offset; index++) {
+		struct Host* const host = hosts[index];
+		
+		if (host->resolving) {
+			thread_join(&host->resolver);
+		}
+		
+		for (size_t subindex = 0; subindex < host->addresses_offset; subindex++) {
+			struct HostAddress* const address = &host->addresses[subindex];
+			
+			free(address->address);
+			curl_slist_free_all(address->connect_to);
+		}
+		
+		free(host->addresses);
+		free(host->name);
+		free(host);
+	}
+	
+	free(hosts);
+	hosts = NULL;
+	
+	hosts_offset = 0;
+	hosts_size = 0;
+	
+	mutex_destroy(&hosts_lock);
+	
+}
+
+int hosts_initialize(void) {
+	/*
+	Must be called from the main thread before hosts are looked up from any
+	other thread.
+	*/
+	
+	if (HOSTS_INITIALIZED) {
+		return UERR_SUCCESS;
+	}
+	
+	if (!mutex_init(&hosts_lock)) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	atexit(hosts_destroy);
+	
+	HOSTS_INITIALIZED = 1;
+	
+	return UERR_SUCCESS;
+	
+}
+
+void hosts_set_rate_limit(const struct HostRateLimit* const rate_limit) {
+	/*
+	Sets the request rate limit of hosts seen from now on; usually the one of the
+	selected provider.
+	*/
+	
+	hosts_rate_limit = *rate_limit;
+	
+}
+
+static struct HostAddress* host_add_address(struct Host* const host, const char* const address) {
+	/*
+	Must be called with the hosts lock held. Returns NULL on error, or if the
+	host already has too many addresses.
+	*/
+	
+	if (host->addresses_offset >= HOST_MAX_ADDRESSES) {
+		return NULL;
+	}
+	
+	if (host->addresses == NULL) {
+		host->addresses = calloc(HOST_MAX_ADDRESSES, sizeof(*host->addresses));
+		
+		if (host->addresses == NULL) {
+			return NULL;
+		}
+	}
+	
+	/*
+	"<name>::<address>:" connects to the given address whatever the port is, while
+	still talking to (and verifying the certificate of) the host name.
+	*/
+	const int ipv6 = (strchr(address, ':') != NULL);
+	
+	char connect_to[strlen(host->name) + strlen(address) + 6];
+	strcpy(connect_to, host->name);
+	strcat(connect_to, "::");
+	strcat(connect_to, ipv6 ? "[" : "");
+	strcat(connect_to, address);
+	strcat(connect_to, ipv6 ? "]:" : ":");
+	
+	struct HostAddress item = {0};
+	
+	item.address = malloc(strlen(address) + 1);
+	
+	if (item.address == NULL) {
+		return NULL;
+	}
+	
+	strcpy(item.address, address);
+	
+	item.connect_to = curl_slist_append(NULL, connect_to);
+	
+	if (item.connect_to == NULL) {
+		free(item.address);
+		return NULL;
+	}
+	
+	struct HostAddress* const slot = &host->addresses[host->addresses_offset++];
+	*slot = item;
+	
+	return slot;
+	
+}
+
+static struct HostAddress* host_find_address(struct Host* const host, const char* const address) {
+	
+	for (size_t index = 0; index < host->addresses_offset; index++) {
+		if (strcmp(host->addresses[index].address, address) == 0) {
+			return &host->addresses[index];
+		}
+	}
+	
+	return NULL;
+	
+}
+
+static int host_resolve(void* const argument) {
+	/*
+	Looks up every address of a host, so that the scoreboard knows about all of
+	them and not only the ones curl happened to connect to. Runs on its own
+	thread, so transfers never wait for it.
+	
+	Only addresses of the families connections are allowed to use (see
+	curl_get_ipresolve()) and this machine has a route for are kept.
+	*/
+	
+	struct Host* const host = (struct Host*) argument;
+	
+	const long ipresolve = curl_get_ipresolve();
+	
+	const struct addrinfo hints = {
+		.ai_flags = AI_ADDRCONFIG,
+		.ai_family = (ipresolve == CURL_IPRESOLVE_V4) ? AF_INET : (ipresolve == CURL_IPRESOLVE_V6) ? AF_INET6 : AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	
+	struct addrinfo* addresses = NULL;
+	
+	if (getaddrinfo(host->name, NULL, &hints, &addresses) != 0) {
+		return 0;
+	}
+	
+	mutex_lock(&hosts_lock);
+	
+	for (const struct addrinfo* item = addresses; item != NULL; item = item->ai_next) {
+		char address[HOST_MAX_ADDRESS_LENGTH];
+		
+		if (getnameinfo(item->ai_addr, item->ai_addrlen, address, sizeof(address), NULL, 0, NI_NUMERICHOST) != 0) {
+			continue;
+		}
+		
+		if (host_find_address(host, address) == NULL) {
+			host_add_address(host, address);
+		}
+	}
+	
+	mutex_unlock(&hosts_lock);
+	
+	freeaddrinfo(addresses);
+	
+	return 0;
+	
+}
+
+static struct Host* hosts_add(const char* const name) {
+	
+	if (hosts_offset >= hosts_size) {
+		const size_t size = (hosts_size < 1) ? 8 : hosts_size * 2;
+		struct Host** const items = realloc(hosts, size * sizeof(*hosts));
+		
+		if (items == NULL) {
+			return NULL;
+		}
+		
+		hosts = items;
+		hosts_size = size;
+	}
+	
+	struct Host* const host = calloc(1, sizeof(*host));
+	
+	if (host == NULL) {
+		return NULL;
+	}
+	
+	host->name = malloc(strlen(name) + 1);
+	
+	if (host->name == NULL) {
+		free(host);
+		return NULL;
+	}
+	
+	strcpy(host->name, name);
+	
+	host->ipresolve = curl_get_ipresolve();
+	host->limit = HOST_INITIAL_LIMIT;
+	host->slow_start = 1;
+	host->round = get_monotonic_time();
+	host->rate_limit = hosts_rate_limit;
+	host->tokens = hosts_rate_limit.burst;
+	host->refilled = host->round;
+	
+	hosts[hosts_offset++] = host;
+	
+	host->resolving = thread_create(&host->resolver, host_resolve, host);
+	
+	return host;
+	
+}
+
+struct Host* hosts_get(const char* const url) {
+	/*
+	Returns the host the given URL points to, creating it if this is the first
+	time we see it.
+	
+	Returns NULL on error.
+	*/
+	
+	CURLU* const cu = curl_url();
+	
+	if (cu == NULL) {
+		return NULL;
+	}
+	
+	char* name = NULL;
+	
+	if (curl_url_set(cu, CURLUPART_URL, url, 0) != CURLUE_OK || curl_url_get(cu, CURLUPART_HOST, &name, 0) != CURLUE_OK) {
+		curl_url_cleanup(cu);
+		return NULL;
+	}
+	
+	curl_url_cleanup(cu);
+	
+	struct Host* host = NULL;
+	
+	mutex_lock(&hosts_lock);
+	
+	for (size_t index = 0; index < hosts_offset; index++) {
+		if (strcmp(hosts[index]->name, name) == 0) {
+			host = hosts[index];
+			break;
+		}
+	}
+	
+	if (host == NULL) {
+		host = hosts_add(name);
+	}
+	
+	mutex_unlock(&hosts_lock);
+	
+	curl_free(name);
+	
+	return host;
+	
+}
+
+long host_get_ipresolve(struct Host* const host) {
+	/*
+	Returns the address family new connections to this host should use, or
+	CURL_IPRESOLVE_WHATEVER while it is still unknown (and not restricted by
+	curl_get_ipresolve()).
+	*/
+	
+	mutex_lock(&hosts_lock);
+	const long ipresolve = host->ipresolve;
+	mutex_unlock(&hosts_lock);
+	
+	return ipresolve;
+	
+}
+
+void host_set_primary_address(struct Host* const host, const char* const address) {
+	/*
+	Records the address a new connection to this host ended up using. The family
+	of the first one that wins the race (IPv4 or IPv6) is kept for the rest of
+	the run, so later connections skip the race altogether.
+	*/
+	
+	if (address == NULL || *address == '\0') {
+		return;
+	}
+	
+	mutex_lock(&hosts_lock);
+	
+	if (host->ipresolve == CURL_IPRESOLVE_WHATEVER) {
+		host->ipresolve = (strchr(address, ':') == NULL) ? CURL_IPRESOLVE_V4 : CURL_IPRESOLVE_V6;
+	}
+	
+	mutex_unlock(&hosts_lock);
+	
+}
+
+void host_record_transfer(struct Host* const host, const char* const address, const curl_off_t bytes, const curl_off_t speed, const curl_off_t latency) {
+	/*
+	Accounts a completed transfer to the address it came from: "bytes" received
+	at an average of "speed" bytes per second, with the first one arriving
+	"latency" microseconds after the request was sent.
+	*/
+	
+	if (address == NULL || *address == '\0' || speed <= 0) {
+		return;
+	}
+	
+	mutex_lock(&hosts_lock);
+	
+	struct HostAddress* item = host_find_address(host, address);
+	
+	if (item == NULL) {
+		item = host_add_address(host, address);
+	}
+	
+	if (item != NULL) {
+		const double milliseconds = (double) latency / 1000;
+		
+		if (item->samples == 0) {
+			item->throughput = (double) speed;
+			item->latency = milliseconds;
+		} else {
+			item->throughput += HOST_SAMPLE_WEIGHT * ((double) speed - item->throughput);
+			item->latency += HOST_SAMPLE_WEIGHT * (milliseconds - item->latency);
+		}
+		
+		item->samples++;
+	}
+	
+	host->size = (host->size == 0) ? (double) bytes : host->size + HOST_SAMPLE_WEIGHT * ((double) bytes - host->size);
+	
+	mutex_unlock(&hosts_lock);
+	
+}
+
+const struct HostAddress* host_get_address(struct Host* const host) {
+	/*
+	Returns the address of this host a new request should be steered to (through
+	its "connect_to" list), or NULL if the request should go wherever the DNS
+	sends it.
+	
+	Usually that is the address expected to serve it the fastest: the one with the
+	lowest latency plus time to receive a response of the usual size. Every
+	HOST_EXPLORE_PERIOD requests it is the least measured one instead, but only
+	once it is known which address family works for this host; until then, an
+	address nobody connected to yet might well be unreachable.
+	*/
+	
+	const struct HostAddress* best = NULL;
+	const struct HostAddress* unexplored = NULL;
+	
+	double estimate = 0;
+	size_t candidates = 0;
+	
+	mutex_lock(&hosts_lock);
+	
+	const long long now = get_monotonic_time();
+	
+	host->steered++;
+	
+	for (size_t index = 0; index < host->addresses_offset; index++) {
+		const struct HostAddress* const item = &host->addresses[index];
+		
+		/*
+		Only addresses of the family this host ended up with, if any, and none that
+		recently failed to connect.
+		*/
+		const long ipresolve = (strchr(item->address, ':') == NULL) ? CURL_IPRESOLVE_V4 : CURL_IPRESOLVE_V6;
+		
+		if (host->ipresolve != CURL_IPRESOLVE_WHATEVER && ipresolve != host->ipresolve) {
+			continue;
+		}
+		
+		if (item->demoted_until > now) {
+			continue;
+		}
+		
+		candidates++;
+		
+		if (unexplored == NULL || item->samples < unexplored->samples) {
+			unexplored = item;
+		}
+		
+		if (item->samples == 0) {
+			continue;
+		}
+		
+		const double time = item->latency / 1000 + host->size / item->throughput;
+		
+		if (best == NULL || time < estimate) {
+			best = item;
+			estimate = time;
+		}
+	}
+	
+	const int explore = (host->ipresolve != CURL_IPRESOLVE_WHATEVER && host->steered % HOST_EXPLORE_PERIOD == 0);
+	const struct HostAddress* const item = explore ? unexplored : best;
+	const struct HostAddress* const address = (candidates < 2) ? NULL : item;
+	
+	mutex_unlock(&hosts_lock);
+	
+	return address;
+	
+}
+
+void host_demote_address(struct Host* const host, const char* const address) {
+	/*
+	A connection to the given address of this host failed; stop steering requests
+	to it for a while.
+	*/
+	
+	if (address == NULL || *address == '\0') {
+		return;
+	}
+	
+	mutex_lock(&hosts_lock);
+	
+	struct HostAddress* const item = host_find_address(host, address);
+	
+	if (item != NULL) {
+		item->demoted_until = get_monotonic_time() + HOST_DEMOTE_TIME;
+	}
+	
+	mutex_unlock(&hosts_lock);
+	
+}
+
+long long host_acquire(struct Host* const host) {
+	/*
+	Takes one of the connections this host is currently allowed to use, along
+	with a token of its request rate limit.
+	
+	Returns (0) on success, or how many milliseconds to wait before trying again
+	if the host is paused, out of tokens or already at its connection limit.
+	*/
+	
+	mutex_lock(&hosts_lock);
+	
+	const long long now = get_monotonic_time();
+	long long wait = 0;
+	
+	if (host->rate_limit.rate > 0) {
+		host->tokens += (double) (now - host->refilled) * host->rate_limit.rate / 1000;
+		host->refilled = now;
+		
+		if (host->tokens > host->rate_limit.burst) {
+			host->tokens = host->rate_limit.burst;
+		}
+	}
+	
+	if (host->paused_until > now) {
+		wait = host->paused_until - now;
+	} else if (host->active >= host->limit) {
+		host->saturated = 1;
+		wait = HOST_BUSY_WAIT_TIME;
+	} else if (host->rate_limit.rate > 0 && host->tokens < 1) {
+		wait = (long long) ((1 - host->tokens) * 1000 / host->rate_limit.rate) + 1;
+	} else {
+		host->active++;
+		
+		if (host->rate_limit.rate > 0) {
+			host->tokens -= 1;
+		}
+		
+		if (host->active >= host->limit) {
+			host->saturated = 1;
+		}
+	}
+	
+	mutex_unlock(&hosts_lock);
+	
+	return wait;
+	
+}
+
+void host_release(struct Host* const host, const curl_off_t bytes) {
+	/*
+	Gives back a connection taken with host_acquire(), accounting the bytes it
+	received. At the end of each round the throughput of the host is compared to
+	the one of the previous round; the limit only grows (multiplicatively during
+	slow start, additively afterwards) if the host actually used all of its
+	connections and got faster because of that.
+	*/
+	
+	mutex_lock(&hosts_lock);
+	
+	host->active--;
+	host->bytes += bytes;
+	
+	const long long now = get_monotonic_time();
+	const long long elapsed = now - host->round;
+	
+	if (elapsed >= HOST_ROUND_TIME) {
+		const double throughput = (double) host->bytes / (double) elapsed;
+		
+		if (host->saturated && throughput > host->throughput * HOST_THROUGHPUT_GAIN) {
+			host->limit = host->slow_start ? host->limit * 2 : host->limit + 1;
+			
+			if (host->limit > HOST_MAX_LIMIT) {
+				host->limit = HOST_MAX_LIMIT;
+			}
+		} else if (host->saturated) {
+			host->slow_start = 0;
+		}
+		
+		host->throughput = throughput;
+		host->bytes = 0;
+		host->round = now;
+		host->saturated = (host->active >= host->limit);
+	}
+	
+	mutex_unlock(&hosts_lock);
+	
+}
+
+void host_congested(struct Host* const host) {
+	/*
+	The host answered with 429/503 or timed out: halve its limit and end its slow
+	start. Several failures in a row usually come from the same burst, so the
+	limit is cut at most once per round.
+	*/
+	
+	mutex_lock(&hosts_lock);
+	
+	const long long now = get_monotonic_time();
+	
+	host->slow_start = 0;
+	
+	if (now - host->decreased >= HOST_ROUND_TIME) {
+		host->limit = (host->limit > 1) ? host->limit / 2 : 1;
+		host->decreased = now;
+		
+		host->throughput = 0;
+		host->bytes = 0;
+		host->round = now;
+		host->saturated = 0;
+	}
+	
+	mutex_unlock(&hosts_lock);
+	
+}
+
+size_t host_get_limit(struct Host* const host) {
+	
+	mutex_lock(&hosts_lock);
+	const size_t limit = host->limit;
+	mutex_unlock(&hosts_lock);
+	
+	return limit;
+	
+}
+
+void host_pause(struct Host* const host, const long long milliseconds) {
+	/*
+	Stops new requests to this host for a while, e.g. because it answered with a
+	"Retry-After" header. Other hosts are not affected.
+	*/
+	
+	mutex_lock(&hosts_lock);
+	
+	const long long until = get_monotonic_time() + milliseconds;
+	
+	if (until > host->paused_until) {
+		host->paused_until = until;
+	}
+	
+	mutex_unlock(&hosts_lock);
+	
+}
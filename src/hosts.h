@@ -0,0 +1,75 @@
+#include <curl/curl.h>
+
+#include "threads.h"
+
+/*
+Request rate allowed per host: a token bucket refilled with "rate" tokens per
+second that holds at most "burst" of them. A rate of zero means no limit.
+*/
+struct HostRateLimit {
+	double rate;
+	double burst;
+};
+
+/*
+How one of the addresses of a host performed so far. "throughput" (bytes per
+second) and "latency" (time to first byte, in milliseconds) are moving averages
+updated as transfers from that address complete. "connect_to" is what makes
+curl connect to this address (see CURLOPT_CONNECT_TO). Requests are not steered
+to it before "demoted_until" (a monotonic time) after a connection failed.
+Addresses are never moved or freed before the process exits, and only their
+measurements change.
+*/
+struct HostAddress {
+	char* address;
+	struct curl_slist* connect_to;
+	double throughput;
+	double latency;
+	size_t samples;
+	long long demoted_until;
+};
+
+/*
+What we learned about a remote host so far. Hosts are created on first use and
+live until the process exits, so pointers to them can be freely kept around.
+*/
+struct Host {
+	char* name;
+	long ipresolve;
+	size_t limit;
+	int slow_start;
+	size_t active;
+	int saturated;
+	long long round;
+	long long decreased;
+	curl_off_t bytes;
+	double throughput;
+	struct HostRateLimit rate_limit;
+	double tokens;
+	long long refilled;
+	long long paused_until;
+	struct HostAddress* addresses;
+	size_t addresses_offset;
+	double size;
+	size_t steered;
+	struct Thread resolver;
+	int resolving;
+};
+
+int hosts_initialize(void);
+void hosts_set_rate_limit(const struct HostRateLimit* const rate_limit);
+struct Host* hosts_get(const char* const url);
+
+long host_get_ipresolve(struct Host* const host);
+void host_set_primary_address(struct Host* const host, const char* const address);
+void host_record_transfer(struct Host* const host, const char* const address, const curl_off_t bytes, const curl_off_t speed, const curl_off_t latency);
+const struct HostAddress* host_get_address(struct Host* const host);
+void host_demote_address(struct Host* const host, const char* const address);
+
+long long host_acquire(struct Host* const host);
+void host_release(struct Host* const host, const curl_off_t bytes);
+void host_congested(struct Host* const host);
+void host_pause(struct Host* const host, const long long milliseconds);
+size_t host_get_limit(struct Host* const host);
+
+#pragma once
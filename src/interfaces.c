@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+#include "interfaces.h"
+#include "threads.h"
+#include "errors.h"
+#include "os.h"
+
+/*
+Throughput of each interface is measured over rounds of INTERFACE_ROUND_TIME
+milliseconds and smoothed with a weight of INTERFACE_SAMPLE_WEIGHT for the
+newest round. No interface ever gets less than INTERFACE_MIN_SHARE of the
+requests, so a slow one keeps being measured and can win its share back.
+*/
+static const long long INTERFACE_ROUND_TIME = 1000;
+static const double INTERFACE_SAMPLE_WEIGHT = 0.3;
+static const double INTERFACE_MIN_SHARE = 0.1;
+
+static int INTERFACES_INITIALIZED = 0;
+
+static struct Interface* interfaces = NULL;
+static size_t interfaces_offset = 0;
+
+static struct Mutex interfaces_lock;
+
+static void interfaces_destroy(void) {
+	
+	for (size_t index = 0; index < interfaces_offset; index++) {
+		free(interfaces[index].name);
+	}
+	
+	free(interfaces);
+	interfaces = NULL;
+	
+	interfaces_offset = 0;
+	
+	mutex_destroy(&interfaces_lock);
+	
+}
+
+int interfaces_initialize(void) {
+	/*
+	Reads the comma separated list of interfaces from "SPARKLEC_INTERFACES".
+	Without it (or with a single interface) transfers are not spread at all.
+	
+	Must be called from the main thread before any transfer starts.
+	*/
+	
+	if (INTERFACES_INITIALIZED) {
+		return UERR_SUCCESS;
+	}
+	
+	if (!mutex_init(&interfaces_lock)) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	atexit(interfaces_destroy);
+	
+	INTERFACES_INITIALIZED = 1;
+	
+	const char* const value = getenv("SPARKLEC_INTERFACES");
+	
+	if (value == NULL || *value == '\0') {
+		return UERR_SUCCESS;
+	}
+	
+	size_t size = 1;
+	
+	for (const char* position = value; *position != '\0'; position++) {
+		size += (*position == ',');
+	}
+	
+	interfaces = calloc(size, sizeof(*interfaces));
+	
+	if (interfaces == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	const long long now = get_monotonic_time();
+	const char* start = value;
+	
+	while (1) {
+		const char* end = strchr(start, ',');
+		
+		if (end == NULL) {
+			end = strchr(start, '\0');
+		}
+		
+		const size_t length = (size_t) (end - start);
+		
+		if (length > 0) {
+			struct Interface* const interface = &interfaces[interfaces_offset];
+			
+			interface->name = malloc(length + 1);
+			
+			if (interface->name == NULL) {
+				return UERR_MEMORY_ALLOCATE_FAILURE;
+			}
+			
+			memcpy(interface->name, start, length);
+			interface->name[length] = '\0';
+			
+			interface->round = now;
+			
+			interfaces_offset++;
+		}
+		
+		if (*end == '\0') {
+			break;
+		}
+		
+		start = end + 1;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+struct Interface* interfaces_next(const struct Interface* const exclude) {
+	/*
+	Returns the interface the next request should go out through, or NULL if
+	requests should simply follow the default route.
+	
+	Requests are spread in proportion to the throughput of each interface, with
+	a smooth weighted round robin: every interface earns its weight on each call
+	and the one with the most credit is picked and pays for it. Interfaces not
+	measured yet are weighted like an average one. "exclude" (if not NULL) is
+	skipped, unless it is the only interface left.
+	*/
+	
+	if (interfaces_offset < 2) {
+		return NULL;
+	}
+	
+	mutex_lock(&interfaces_lock);
+	
+	double measured = 0;
+	size_t count = 0;
+	
+	for (size_t index = 0; index < interfaces_offset; index++) {
+		if (interfaces[index].throughput > 0) {
+			measured += interfaces[index].throughput;
+			count++;
+		}
+	}
+	
+	const double average = (count == 0) ? 1 : measured / (double) count;
+	
+	double weights[interfaces_offset];
+	double total = 0;
+	
+	for (size_t index = 0; index < interfaces_offset; index++) {
+		weights[index] = (interfaces[index].throughput > 0) ? interfaces[index].throughput : average;
+		total += weights[index];
+	}
+	
+	struct Interface* best = NULL;
+	double spent = 0;
+	
+	for (size_t index = 0; index < interfaces_offset; index++) {
+		struct Interface* const interface = &interfaces[index];
+		
+		double weight = weights[index];
+		
+		if (weight < total * INTERFACE_MIN_SHARE) {
+			weight = total * INTERFACE_MIN_SHARE;
+		}
+		
+		if (interface == exclude) {
+			continue;
+		}
+		
+		interface->current += weight;
+		spent += weight;
+		
+		if (best == NULL || interface->current > best->current) {
+			best = interface;
+		}
+	}
+	
+	best->current -= spent;
+	
+	mutex_unlock(&interfaces_lock);
+	
+	return best;
+	
+}
+
+void interface_record(struct Interface* const interface, const curl_off_t bytes) {
+	/*
+	Accounts the bytes received by a request that went out through the given
+	interface. At the end of each round the throughput of the interface is
+	updated with the bytes it received during that round.
+	*/
+	
+	mutex_lock(&interfaces_lock);
+	
+	interface->bytes += bytes;
+	
+	const long long now = get_monotonic_time();
+	const long long elapsed = now - interface->round;
+	
+	/*
+	The interface sat idle for a while (e.g. between two lectures); that says
+	nothing about how fast it is, so just start a new round.
+	*/
+	if (elapsed >= INTERFACE_ROUND_TIME * 10) {
+		interface->bytes = bytes;
+		interface->round = now;
+	} else if (elapsed >= INTERFACE_ROUND_TIME) {
+		const double throughput = (double) interface->bytes * 1000 / (double) elapsed;
+		
+		if (interface->throughput == 0) {
+			interface->throughput = throughput;
+		} else {
+			interface->throughput += INTERFACE_SAMPLE_WEIGHT * (throughput - interface->throughput);
+		}
+		
+		interface->bytes = 0;
+		interface->round = now;
+	}
+	
+	mutex_unlock(&interfaces_lock);
+	
+}
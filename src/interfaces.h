@@ -0,0 +1,20 @@
+#include <curl/curl.h>
+
+/*
+A local interface (or source address) bulk transfers may go out through, in
+any form CURLOPT_INTERFACE accepts ("eth1", "if!eth1", "host!192.168.0.2").
+"throughput" is a moving average of the bytes per second received through it.
+*/
+struct Interface {
+	char* name;
+	double throughput;
+	double current;
+	curl_off_t bytes;
+	long long round;
+};
+
+int interfaces_initialize(void);
+struct Interface* interfaces_next(const struct Interface* const exclude);
+void interface_record(struct Interface* const interface, const curl_off_t bytes);
+
+#pragma once
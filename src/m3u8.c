@@ -327,6 +327,9 @@ void m3u8_free(struct Tags* tags) {
 		free(tag->attributes.items);
 		tag->attributes.items = NULL;
 		
+		free(tag->value);
+		tag->value = NULL;
+		
 		if (tag->uri != NULL) {
 			free(tag->uri);
 			tag->uri = NULL;
@@ -31,6 +31,11 @@
 #include "sparklec.h"
 #include "cir.h"
 #include "terminal.h"
+#include "transfer.h"
+#include "aes.h"
+#include "remux.h"
+#include "spool.h"
+#include "merge.h"
 
 #if defined(_WIN32) && defined(_UNICODE)
 	#include "wio.h"
@@ -40,328 +45,1923 @@
 
 static const char LOCAL_ACCOUNTS_FILENAME[] = "accounts.json";
 
-static void curl_poll(struct Download* dqueue, const size_t dcount, size_t* total_done) {
+/*
+Single media files of at least RANGE_MIN_SIZE bytes whose server supports range
+requests are split into chunks downloaded over up to RANGE_CONNECTIONS
+connections at once, since CDNs usually throttle each connection rather than
+each client. Every connection gets a few chunks, so a slow one does not hold
+back the end, but no chunk is smaller than RANGE_MIN_CHUNK bytes.
+*/
+static const curl_off_t RANGE_MIN_SIZE = 4 * 1024 * 1024;
+static const curl_off_t RANGE_MIN_CHUNK = 1024 * 1024;
+static const size_t RANGE_CONNECTIONS = 8;
+static const size_t RANGE_CHUNKS_PER_CONNECTION = 4;
+
+/*
+Segments of a playlist are appended to a single file in playlist order as they
+complete. The ones that complete ahead of their turn are held in memory, up to
+M3U8_REORDER_MAX_BYTES in total; past that, they wait in a file of their own.
+*/
+static const size_t M3U8_REORDER_MAX_BYTES = 64 * 1024 * 1024;
+
+/*
+Segments piped into ffmpeg wait in memory for their turn and then for ffmpeg to
+catch up. Once more than M3U8_PIPE_MAX_BYTES are waiting, no new segments are
+started until some of them were written, so a slow muxer throttles the download
+instead of having it pile up.
+*/
+static const size_t M3U8_PIPE_MAX_BYTES = 16 * 1024 * 1024;
+
+/*
+An AES-128 key of an encrypted playlist. Each key is fetched once per URI and
+kept in memory for as long as the playlist is being downloaded.
+*/
+struct M3U8Key {
+	char* url;
+	unsigned char data[AES_BLOCK_SIZE];
+};
+
+enum M3U8SegmentState {
+	M3U8_SEGMENT_PENDING,
+	M3U8_SEGMENT_HELD,
+	M3U8_SEGMENT_PARKED
+};
+
+/*
+What a downloaded segment has to be decrypted with. "key" is NULL for segments
+that are not encrypted. A segment that completed ahead of its turn is either
+"held" in "data" or "parked" in a file of its own until it can be appended.
+*/
+struct M3U8Segment {
+	const struct M3U8Key* key;
+	unsigned char iv[AES_BLOCK_SIZE];
+	enum M3U8SegmentState state;
+	char* data;
+	size_t size;
+};
+
+/*
+"decrypt" is set when every key of the playlist can be handled natively: then
+segments are decrypted as they complete, and "key" and "iv" hold the key tag in
+effect for the next segment, whose media sequence number is "sequence".
+Otherwise keys are downloaded next to the segments and left to ffmpeg.
+
+"assemble" is set when segments can simply be concatenated: then they are
+received in memory and appended to "stream" in playlist order, "written" of
+them so far. "held" counts the bytes of the ones waiting for their turn.
+
+"remux" is set when the output is an MP4 file: then, if the first segment turns
+out to carry nothing but H.264 and AAC, segments are fed to "remuxer" instead
+("remuxing"), which writes the output itself. "duration" is the length of the
+playlist in seconds, used to size the room left for the index of the file.
+
+Segments that can not be remuxed natively are written through "spool" into the
+standard input of ffmpeg ("pipe"), which muxes them while the rest downloads.
+Only where that is not possible they go to "stream" and ffmpeg runs afterwards.
+*/
+struct M3U8Cursor {
+	const char* url;
+	const char* output;
+	struct Tags* tags;
+	CURLU* cu;
+	size_t index;
+	int segment_number;
+	int key_queued;
+	int decrypt;
+	struct M3U8Key* keys;
+	size_t keys_offset;
+	struct M3U8Segment* segments;
+	size_t segments_offset;
+	const struct M3U8Key* key;
+	const char* iv;
+	unsigned long long sequence;
+	int assemble;
+	struct FStream* stream;
+	const char* assembled_filename;
+	size_t written;
+	size_t held;
+	int remux;
+	int remuxing;
+	struct Remuxer remuxer;
+	double duration;
+	FILE* pipe;
+	struct Spool spool;
+};
+
+static void m3u8_cursor_free(struct M3U8Cursor* const cursor) {
+	
+	for (size_t index = 0; index < cursor->keys_offset; index++) {
+		free(cursor->keys[index].url);
+	}
+	
+	free(cursor->keys);
+	cursor->keys = NULL;
+	cursor->keys_offset = 0;
+	
+	if (cursor->segments != NULL) {
+		for (size_t index = 0; index < cursor->segments_offset; index++) {
+			free(cursor->segments[index].data);
+		}
+	}
+	
+	free(cursor->segments);
+	cursor->segments = NULL;
+	cursor->segments_offset = 0;
+	
+	if (cursor->stream != NULL) {
+		fstream_close(cursor->stream);
+		cursor->stream = NULL;
+	}
+	
+	if (cursor->remuxing) {
+		remux_free(&cursor->remuxer);
+		cursor->remuxing = 0;
+	}
+	
+	if (cursor->pipe != NULL) {
+		spool_close(&cursor->spool);
+		close_shell_command(cursor->pipe);
+		cursor->pipe = NULL;
+	}
+	
+}
+
+static char* m3u8_get_segment_filename(const char* const output, const int segment_number) {
+	
+	char value[intlen(segment_number) + 1];
+	snprintf(value, sizeof(value), "%i", segment_number);
+	
+	char* const filename = malloc(strlen(output) + strlen(DOT) + strlen(value) + strlen(DOT) + strlen(TS_FILE_EXTENSION) + 1);
+	
+	if (filename == NULL) {
+		return NULL;
+	}
+	
+	strcpy(filename, output);
+	strcat(filename, DOT);
+	strcat(filename, value);
+	strcat(filename, DOT);
+	strcat(filename, TS_FILE_EXTENSION);
+	
+	return filename;
+	
+}
+
+static char* m3u8_resolve_url(CURLU* const cu, const char* const base, const char* const uri) {
+	/*
+	Resolves a (possibly relative) playlist URI against the playlist URL.
+	
+	Returns a malloc()'ed string, or NULL on error.
+	*/
+	
+	if (curl_url_set(cu, CURLUPART_URL, base, 0) != CURLUE_OK) {
+		return NULL;
+	}
+	
+	if (curl_url_set(cu, CURLUPART_URL, uri, 0) != CURLUE_OK) {
+		return NULL;
+	}
+	
+	char* url __attribute__((__cleanup__(curlcharpp_free))) = NULL;
+	
+	if (curl_url_get(cu, CURLUPART_URL, &url, 0) != CURLUE_OK) {
+		return NULL;
+	}
+	
+	char* const value = malloc(strlen(url) + 1);
+	
+	if (value == NULL) {
+		return NULL;
+	}
+	
+	strcpy(value, url);
+	
+	return value;
+	
+}
+
+static const char* m3u8_iv_digits(const char* const value) {
+	/*
+	Returns the hexadecimal digits of an IV attribute (without its "0x" prefix),
+	or NULL if it is not a hexadecimal number of at most 128 bits.
+	*/
+	
+	const char* start = value;
+	
+	if (start[0] == '0' && (start[1] == 'x' || start[1] == 'X')) {
+		start += 2;
+	}
+	
+	const size_t digits = strlen(start);
+	
+	if (digits == 0 || digits > AES_BLOCK_SIZE * 2 || strspn(start, "0123456789abcdefABCDEF") != digits) {
+		return NULL;
+	}
+	
+	return start;
+	
+}
+
+static int m3u8_key_supported(const struct Tag* const tag) {
+	/*
+	Whether a key tag is either METHOD=NONE or a plain AES-128 key we can decrypt
+	with ourselves. A key with a malformed IV is left for FFmpeg to deal with.
+	*/
+	
+	const struct Attribute* const method = attributes_get(&tag->attributes, "METHOD");
+	
+	if (method == NULL || method->value == NULL) {
+		return 0;
+	}
+	
+	if (strcmp(method->value, "NONE") == 0) {
+		return 1;
+	}
+	
+	if (strcmp(method->value, "AES-128") != 0) {
+		return 0;
+	}
+	
+	const struct Attribute* const uri = attributes_get(&tag->attributes, "URI");
+	const struct Attribute* const format = attributes_get(&tag->attributes, "KEYFORMAT");
+	
+	const struct Attribute* const iv = attributes_get(&tag->attributes, "IV");
+	
+	if (uri == NULL || uri->value == NULL) {
+		return 0;
+	}
+	
+	if (iv != NULL && (iv->value == NULL || m3u8_iv_digits(iv->value) == NULL)) {
+		return 0;
+	}
+	
+	return format == NULL || format->value == NULL || strcmp(format->value, "identity") == 0;
+	
+}
+
+static const struct M3U8Key* m3u8_find_key(const struct M3U8Cursor* const cursor, const char* const url) {
+	
+	for (size_t index = 0; index < cursor->keys_offset; index++) {
+		const struct M3U8Key* const key = &cursor->keys[index];
+		
+		if (strcmp(key->url, url) == 0) {
+			return key;
+		}
+	}
+	
+	return NULL;
+	
+}
+
+static int m3u8_fetch_keys(struct M3U8Cursor* const cursor) {
+	/*
+	Fetches every distinct AES-128 key of the playlist into memory, if all of its
+	keys can be handled natively. Otherwise "decrypt" is left unset.
+	*/
+	
+	size_t size = 0;
+	
+	for (size_t index = 0; index < cursor->tags->offset; index++) {
+		const struct Tag* const tag = &cursor->tags->items[index];
+		
+		if (tag->type != EXT_X_KEY) {
+			continue;
+		}
+		
+		if (!m3u8_key_supported(tag)) {
+			return UERR_SUCCESS;
+		}
+		
+		size++;
+	}
+	
+	cursor->decrypt = 1;
+	
+	if (size == 0) {
+		return UERR_SUCCESS;
+	}
+	
+	cursor->keys = malloc(size * sizeof(*cursor->keys));
+	
+	if (cursor->keys == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	CURL* const curl_easy = get_global_curl_easy();
+	
+	for (size_t index = 0; index < cursor->tags->offset; index++) {
+		const struct Tag* const tag = &cursor->tags->items[index];
+		
+		if (tag->type != EXT_X_KEY) {
+			continue;
+		}
+		
+		const struct Attribute* const uri = attributes_get(&tag->attributes, "URI");
+		
+		if (uri == NULL || uri->value == NULL) {
+			continue;
+		}
+		
+		char* const url = m3u8_resolve_url(cursor->cu, cursor->url, uri->value);
+		
+		if (url == NULL) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		if (m3u8_find_key(cursor, url) != NULL) {
+			free(url);
+			continue;
+		}
+		
+		struct M3U8Key* const key = &cursor->keys[cursor->keys_offset++];
+		key->url = url;
+		
+		struct String string __attribute__((__cleanup__(string_free))) = {0};
+		
+		curl_easy_setopt(curl_easy, CURLOPT_URL, url);
+		curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, curl_write_string_cb);
+		curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, &string);
+		
+		const CURLcode code = curl_easy_perform_retry(curl_easy);
+		
+		curl_easy_setopt(curl_easy, CURLOPT_URL, NULL);
+		curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, NULL);
+		curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, NULL);
+		
+		if (code != CURLE_OK) {
+			return UERR_CURL_FAILURE;
+		}
+		
+		if (string.slength != sizeof(key->data)) {
+			return UERR_AES_INVALID_KEY;
+		}
+		
+		memcpy(key->data, string.s, sizeof(key->data));
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int m3u8_select_key(struct M3U8Cursor* const cursor, struct Tag* const tag) {
+	/*
+	Makes the given key tag the one in effect for the segments that follow it.
+	Since those segments are stored decrypted, the tag itself is rewritten to
+	METHOD=NONE.
+	*/
+	
+	cursor->key = NULL;
+	cursor->iv = NULL;
+	
+	const struct Attribute* const uri = attributes_get(&tag->attributes, "URI");
+	
+	if (uri != NULL && uri->value != NULL) {
+		char* const url = m3u8_resolve_url(cursor->cu, cursor->url, uri->value);
+		
+		if (url == NULL) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		cursor->key = m3u8_find_key(cursor, url);
+		
+		free(url);
+		
+		const struct Attribute* const iv = attributes_get(&tag->attributes, "IV");
+		
+		if (iv != NULL) {
+			cursor->iv = iv->value;
+		}
+	}
+	
+	if (!tag_set_value(tag, "METHOD=NONE")) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static void m3u8_get_iv(const struct M3U8Cursor* const cursor, unsigned char* const iv) {
+	/*
+	The IV of the next segment: the one given by its key tag (a hexadecimal
+	number), or else its media sequence number, both as a 128 bit big endian
+	integer.
+	*/
+	
+	memset(iv, 0, AES_BLOCK_SIZE);
+	
+	if (cursor->iv == NULL) {
+		unsigned long long sequence = cursor->sequence;
+		
+		for (size_t index = AES_BLOCK_SIZE; index > AES_BLOCK_SIZE - sizeof(sequence); index--) {
+			iv[index - 1] = (unsigned char) (sequence & 0xFF);
+			sequence >>= 8;
+		}
+		
+		return;
+	}
+	
+	/*
+	The IV was validated by m3u8_key_supported(). Digits are taken from the end,
+	so shorter values are zero padded on the left.
+	*/
+	const char* const start = m3u8_iv_digits(cursor->iv);
+	size_t digits = strlen(start);
+	
+	for (size_t index = 0; digits > 0; index++) {
+		const char ch = start[--digits];
+		
+		unsigned char value = 0;
+		
+		if (ch >= '0' && ch <= '9') {
+			value = (unsigned char) (ch - '0');
+		} else if (ch >= 'a' && ch <= 'f') {
+			value = (unsigned char) (ch - 'a' + 10);
+		} else {
+			value = (unsigned char) (ch - 'A' + 10);
+		}
+		
+		iv[AES_BLOCK_SIZE - 1 - index / 2] |= (unsigned char) ((index % 2 == 0) ? value : value << 4);
+	}
+	
+}
+
+static int m3u8_decrypt_segment(struct Download* const download, void* const userdata) {
+	/*
+	Decrypts a segment in place as soon as it has been downloaded, be it on disk or
+	in memory. Runs outside the transfer lock, so segments are decrypted
+	concurrently.
+	*/
+	
+	(void) userdata;
+	
+	const struct M3U8Segment* const segment = (const struct M3U8Segment*) download->userdata;
+	
+	if (segment == NULL || segment->key == NULL) {
+		return UERR_SUCCESS;
+	}
+	
+	if (download->filename == NULL) {
+		return aes_decrypt((unsigned char*) download->buffer.data, &download->buffer.offset, segment->key->data, segment->iv);
+	}
+	
+	return aes_decrypt_file(download->filename, segment->key->data, segment->iv);
+	
+}
+
+static int m3u8_open_output(struct M3U8Cursor* const cursor, const char* const data, const size_t size) {
+	/*
+	Opens where segments go, once the first one is there to tell whether it can be
+	remuxed natively. Otherwise they are piped into ffmpeg, or, where commands can
+	not be piped into, staged on disk for it.
+	*/
+	
+	if (cursor->remux && remux_probe((const unsigned char*) data, size) == UERR_SUCCESS) {
+		const int code = remux_open(&cursor->remuxer, cursor->output, remux_get_reserve(cursor->duration));
+		
+		cursor->remuxing = 1;
+		
+		if (code != UERR_SUCCESS) {
+			const struct SystemError error = get_system_error();
+			
+			erase_line();
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", cursor->output, error.message);
+		}
+		
+		return code;
+	}
+	
+	const char* const command = "ffmpeg -nostdin -nostats -loglevel error -i pipe:0 -c copy \"%s\"";
+	
+	const int length = snprintf(NULL, 0, command, cursor->output);
+	char shell_command[length + 1];
+	snprintf(shell_command, sizeof(shell_command), command, cursor->output);
+	
+	cursor->pipe = open_shell_command(shell_command);
+	
+	if (cursor->pipe != NULL) {
+		if (spool_open(&cursor->spool, cursor->pipe) == UERR_SUCCESS) {
+			return UERR_SUCCESS;
+		}
+		
+		close_shell_command(cursor->pipe);
+		cursor->pipe = NULL;
+	}
+	
+	cursor->stream = fstream_open(cursor->assembled_filename, "wb");
+	
+	if (cursor->stream == NULL) {
+		const struct SystemError error = get_system_error();
+		
+		erase_line();
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", cursor->assembled_filename, error.message);
+		
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int m3u8_append(struct M3U8Cursor* const cursor, const char* const data, const size_t size) {
+	
+	if (cursor->stream == NULL && !cursor->remuxing && cursor->pipe == NULL) {
+		const int code = m3u8_open_output(cursor, data, size);
+		
+		if (code != UERR_SUCCESS) {
+			return code;
+		}
+	}
+	
+	if (cursor->remuxing) {
+		return remux_push(&cursor->remuxer, (const unsigned char*) data, size);
+	}
+	
+	if (cursor->pipe != NULL) {
+		return spool_write(&cursor->spool, (const unsigned char*) data, size);
+	}
+	
+	return fstream_write(cursor->stream, data, size) ? UERR_SUCCESS : UERR_FSTREAM_FAILURE;
+	
+}
+
+static int m3u8_append_parked(struct M3U8Cursor* const cursor, const char* const filename) {
+	
+	struct FStream* const stream = fstream_open(filename, "rb");
+	
+	if (stream == NULL) {
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	char chunk[8192] = {'\0'};
+	
+	while (1) {
+		const ssize_t size = fstream_read(stream, chunk, sizeof(chunk));
+		
+		if (size == -1) {
+			fstream_close(stream);
+			return UERR_FSTREAM_FAILURE;
+		}
+		
+		if (size == 0) {
+			break;
+		}
+		
+		const int code = m3u8_append(cursor, chunk, (size_t) size);
+		
+		if (code != UERR_SUCCESS) {
+			fstream_close(stream);
+			return code;
+		}
+	}
+	
+	fstream_close(stream);
+	remove_file(filename);
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int m3u8_flush_segments(struct M3U8Cursor* const cursor) {
+	/*
+	Appends the segments that were waiting for the ones before them, for as long
+	as they are next in line.
+	*/
+	
+	while (cursor->written < cursor->segments_offset) {
+		struct M3U8Segment* const segment = &cursor->segments[cursor->written];
+		
+		if (segment->state == M3U8_SEGMENT_HELD) {
+			const int code = m3u8_append(cursor, segment->data, segment->size);
+			
+			if (code != UERR_SUCCESS) {
+				return code;
+			}
+			
+			free(segment->data);
+			segment->data = NULL;
+			
+			cursor->held -= segment->size;
+		} else if (segment->state == M3U8_SEGMENT_PARKED) {
+			char* const filename = m3u8_get_segment_filename(cursor->output, (int) cursor->written + 1);
+			
+			if (filename == NULL) {
+				return UERR_MEMORY_ALLOCATE_FAILURE;
+			}
+			
+			const int code = m3u8_append_parked(cursor, filename);
+			
+			free(filename);
+			
+			if (code != UERR_SUCCESS) {
+				return code;
+			}
+		} else {
+			break;
+		}
+		
+		segment->state = M3U8_SEGMENT_PENDING;
+		cursor->written++;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int m3u8_assemble_segment(const struct Download* const download, void* const userdata) {
+	/*
+	Appends a segment received in memory (and already decrypted by
+	m3u8_decrypt_segment()) to the output file, or keeps it aside until the
+	segments before it are there. Called with the transfer lock held, so segments
+	are never appended concurrently.
+	*/
+	
+	struct M3U8Cursor* const cursor = (struct M3U8Cursor*) userdata;
+	struct M3U8Segment* const segment = (struct M3U8Segment*) download->userdata;
+	
+	const char* const data = download->buffer.data;
+	const size_t size = download->buffer.offset;
+	
+	const size_t index = (size_t) (segment - cursor->segments);
+	
+	if (index == cursor->written) {
+		const int code = m3u8_append(cursor, data, size);
+		
+		if (code != UERR_SUCCESS) {
+			return code;
+		}
+		
+		cursor->written++;
+		
+		return m3u8_flush_segments(cursor);
+	}
+	
+	if (cursor->held + size <= M3U8_REORDER_MAX_BYTES) {
+		segment->data = malloc(size + 1);
+		
+		if (segment->data == NULL) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		memcpy(segment->data, data, size);
+		
+		segment->size = size;
+		segment->state = M3U8_SEGMENT_HELD;
+		
+		cursor->held += size;
+		
+		return UERR_SUCCESS;
+	}
+	
+	char* const filename = m3u8_get_segment_filename(cursor->output, (int) index + 1);
+	
+	if (filename == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	struct FStream* const stream = fstream_open(filename, "wb");
+	
+	if (stream == NULL) {
+		const struct SystemError error = get_system_error();
+		
+		erase_line();
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", filename, error.message);
+		
+		free(filename);
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	/*
+	Marked as parked right away, so the file is cleaned up should writing it fail.
+	*/
+	segment->state = M3U8_SEGMENT_PARKED;
+	
+	const int status = fstream_write(stream, data, size);
+	
+	fstream_close(stream);
+	free(filename);
+	
+	return status ? UERR_SUCCESS : UERR_FSTREAM_FAILURE;
+	
+}
+
+static int m3u8_next_download(struct Download* const download, void* const userdata) {
+	/*
+	Hands out the next key or media segment of the playlist to the transfer engine,
+	rewriting its URI in the playlist to point to the local file it will be saved to.
+	*/
+	
+	struct M3U8Cursor* const cursor = (struct M3U8Cursor*) userdata;
+	
+	if (cursor->pipe != NULL && cursor->index < cursor->tags->offset && cursor->held + spool_get_queued(&cursor->spool) >= M3U8_PIPE_MAX_BYTES) {
+		return TRANSFER_NEXT_LATER;
+	}
+	
+	while (cursor->index < cursor->tags->offset) {
+		struct Tag* const tag = &cursor->tags->items[cursor->index];
+		
+		if (tag->type == EXT_X_KEY && !cursor->key_queued && cursor->decrypt) {
+			cursor->key_queued = 1;
+			
+			const int code = m3u8_select_key(cursor, tag);
+			
+			if (code != UERR_SUCCESS) {
+				return code;
+			}
+		}
+		
+		if (tag->type == EXT_X_KEY && !cursor->key_queued) {
+			cursor->key_queued = 1;
+			
+			struct Attribute* const attribute = attributes_get(&tag->attributes, "URI");
+			
+			if (attribute != NULL && attribute->value != NULL) {
+				download->url = m3u8_resolve_url(cursor->cu, cursor->url, attribute->value);
+				download->filename = malloc(strlen(cursor->output) + strlen(DOT) + strlen(KEY_FILE_EXTENSION) + 1);
+				
+				if (download->url == NULL || download->filename == NULL) {
+					return UERR_MEMORY_ALLOCATE_FAILURE;
+				}
+				
+				strcpy(download->filename, cursor->output);
+				strcat(download->filename, DOT);
+				strcat(download->filename, KEY_FILE_EXTENSION);
+				
+				if (!attribute_set_value(attribute, download->filename)) {
+					return UERR_MEMORY_ALLOCATE_FAILURE;
+				}
+				
+				return 1;
+			}
+		}
+		
+		if ((tag->type == EXT_X_KEY || tag->type == EXTINF) && tag->uri != NULL) {
+			download->url = m3u8_resolve_url(cursor->cu, cursor->url, tag->uri);
+			
+			if (download->url == NULL) {
+				return UERR_MEMORY_ALLOCATE_FAILURE;
+			}
+			
+			/*
+			Segments assembled into a single file are received in memory instead.
+			*/
+			if (!cursor->assemble) {
+				download->filename = m3u8_get_segment_filename(cursor->output, cursor->segment_number);
+				
+				if (download->filename == NULL) {
+					return UERR_MEMORY_ALLOCATE_FAILURE;
+				}
+				
+				if (!tag_set_uri(tag, download->filename)) {
+					return UERR_MEMORY_ALLOCATE_FAILURE;
+				}
+			}
+			
+			if (cursor->segments != NULL) {
+				struct M3U8Segment* const segment = &cursor->segments[cursor->segment_number - 1];
+				
+				segment->key = cursor->key;
+				
+				if (cursor->key != NULL) {
+					m3u8_get_iv(cursor, segment->iv);
+				}
+				
+				download->userdata = segment;
+			}
+			
+			cursor->sequence++;
+			cursor->segment_number++;
+			cursor->index++;
+			cursor->key_queued = 0;
+			
+			return 1;
+		}
+		
+		cursor->index++;
+		cursor->key_queued = 0;
+	}
+	
+	return 0;
+	
+}
+
+static void m3u8_remove_downloads(const struct M3U8Cursor* const cursor) {
+	/*
+	Removes the local files of all keys and segments handed out so far.
+	*/
+	
+	if (cursor->assemble) {
+		for (size_t index = 0; index < cursor->segments_offset; index++) {
+			if (cursor->segments[index].state != M3U8_SEGMENT_PARKED) {
+				continue;
+			}
+			
+			char* const filename = m3u8_get_segment_filename(cursor->output, (int) index + 1);
+			
+			if (filename != NULL) {
+				remove_file(filename);
+				free(filename);
+			}
+		}
+		
+		return;
+	}
+	
+	for (size_t index = 0; index < cursor->index && index < cursor->tags->offset; index++) {
+		const struct Tag* const tag = &cursor->tags->items[index];
+		
+		/*
+		Keys decrypted natively never made it to disk.
+		*/
+		if (tag->type == EXT_X_KEY && !cursor->decrypt) {
+			const struct Attribute* const attribute = attributes_get(&tag->attributes, "URI");
+			
+			if (attribute != NULL && attribute->value != NULL) {
+				remove_file(attribute->value);
+			}
+		}
+		
+		if ((tag->type == EXT_X_KEY || tag->type == EXTINF) && tag->uri != NULL) {
+			remove_file(tag->uri);
+		}
+	}
+	
+}
+
+static int m3u8_download(const char* const url, const char* const output) {
+	
+	CURL* const curl_easy = get_global_curl_easy();
+	
+	struct String string __attribute__((__cleanup__(string_free))) = {0};
+	
+	curl_easy_setopt(curl_easy, CURLOPT_URL, url);
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, curl_write_string_cb);
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, &string);
+	
+	if (curl_easy_perform_retry(curl_easy) != CURLE_OK) {
+		return UERR_CURL_FAILURE;
+	}
+	
+	curl_easy_setopt(curl_easy, CURLOPT_URL, NULL);
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, NULL);
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, NULL);
+	
+	struct Tags tags = {0};
+	
+	if (m3u8_parse(&tags, string.s) != UERR_SUCCESS) {
+		fprintf(stderr, "- Ocorreu uma falha inesperada!\r\n");
+		return UERR_FAILURE;
+	}
+	
+	char playlist_filename[strlen(output) + strlen(DOT) + strlen(M3U8_FILE_EXTENSION) + 1];
+	strcpy(playlist_filename, output);
+	strcat(playlist_filename, DOT);
+	strcat(playlist_filename, M3U8_FILE_EXTENSION);
+	
+	CURLU* cu __attribute__((__cleanup__(curlupp_free))) = curl_url();
+	
+	struct M3U8Cursor cursor __attribute__((__cleanup__(m3u8_cursor_free))) = {
+		.url = url,
+		.output = output,
+		.tags = &tags,
+		.cu = cu,
+		.segment_number = 1
+	};
+	
+	int code = m3u8_fetch_keys(&cursor);
+	
+	if (code != UERR_SUCCESS) {
+		m3u8_free(&tags);
+		
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar obter as chaves de criptografia da mídia: %s\r\n", strurr(code));
+		return UERR_FAILURE;
+	}
+	
+	/*
+	Segments can be concatenated as they are unless they depend on an
+	initialization section, or are byte ranges of a single file.
+	*/
+	cursor.assemble = cursor.decrypt;
+	
+	struct Transfer transfer = {
+		.next = m3u8_next_download,
+		.received = m3u8_decrypt_segment,
+		.userdata = &cursor,
+		.priority = BANDWIDTH_CLASS_MEDIA
+	};
+	
+	size_t segments = 0;
+	
+	for (size_t index = 0; index < tags.offset; index++) {
+		const struct Tag* const tag = &tags.items[index];
+		
+		if (tag->type == EXT_X_KEY && attributes_get(&tag->attributes, "URI") != NULL && !cursor.decrypt) {
+			transfer.total++;
+		}
+		
+		if ((tag->type == EXT_X_KEY || tag->type == EXTINF) && tag->uri != NULL) {
+			transfer.total++;
+			segments++;
+		}
+		
+		if (tag->type == EXTINF && tag->value != NULL) {
+			cursor.duration += strtod(tag->value, NULL);
+		}
+		
+		if (tag->type == EXT_X_MAP || tag->type == EXT_X_BYTERANGE) {
+			cursor.assemble = 0;
+		}
+		
+		/*
+		Segments are numbered from here on, for IVs derived from it.
+		*/
+		if (tag->type == EXT_X_MEDIA_SEQUENCE && tag->value != NULL) {
+			cursor.sequence = strtoull(tag->value, NULL, 10);
+		}
+	}
+	
+	if (cursor.decrypt && (cursor.keys_offset > 0 || cursor.assemble)) {
+		cursor.segments = calloc(segments, sizeof(*cursor.segments));
+		
+		if (cursor.segments == NULL && segments > 0) {
+			m3u8_free(&tags);
+			
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar obter as chaves de criptografia da mídia: %s\r\n", strurr(UERR_MEMORY_ALLOCATE_FAILURE));
+			return UERR_FAILURE;
+		}
+		
+		cursor.segments_offset = segments;
+	}
+	
+	char assembled_filename[strlen(output) + strlen(DOT) + strlen(TS_FILE_EXTENSION) + 1];
+	strcpy(assembled_filename, output);
+	strcat(assembled_filename, DOT);
+	strcat(assembled_filename, TS_FILE_EXTENSION);
+	
+	/*
+	The output file is only opened once the first segment is in; see
+	m3u8_open_output().
+	*/
+	if (cursor.assemble) {
+		const char* const file_extension = get_file_extension(output);
+		
+		cursor.assembled_filename = assembled_filename;
+		cursor.remux = file_extension != NULL && strcmp(file_extension, MP4_FILE_EXTENSION) == 0;
+		
+		transfer.complete = m3u8_assemble_segment;
+	}
+	
+	code = transfer_perform(&transfer);
+	
+	erase_line();
+	transfer_print_statistics(&transfer);
+	
+	/*
+	A playlist without segments still makes for an (empty) file. There is nothing
+	to mux, so it is created right away rather than having ffmpeg choke on an empty
+	input.
+	*/
+	if (cursor.assemble && code == UERR_SUCCESS && cursor.stream == NULL && !cursor.remuxing && cursor.pipe == NULL) {
+		m3u8_remove_downloads(&cursor);
+		m3u8_free(&tags);
+		
+		struct FStream* const stream = fstream_open(output, "wb");
+		
+		if (stream == NULL || !fstream_close(stream)) {
+			const struct SystemError error = get_system_error();
+			
+			remove_file(output);
+			
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", output, error.message);
+			return UERR_FAILURE;
+		}
+		
+		return UERR_SUCCESS;
+	}
+	
+	const int remuxed = cursor.remuxing;
+	const int piped = cursor.pipe != NULL;
+	
+	if (piped) {
+		/*
+		Whatever was downloaded gets written out before ffmpeg is told the input is
+		over. A transfer that failed midway leaves a truncated output behind, which
+		is removed.
+		*/
+		const int status = spool_close(&cursor.spool);
+		const int exit_code = close_shell_command(cursor.pipe);
+		
+		cursor.pipe = NULL;
+		
+		if (exit_code != 0 || (code == UERR_SUCCESS && status != UERR_SUCCESS)) {
+			m3u8_remove_downloads(&cursor);
+			m3u8_free(&tags);
+			remove_file(output);
+			
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar processar a mídia!\r\n");
+			return UERR_FAILURE;
+		}
+		
+		if (code != UERR_SUCCESS) {
+			remove_file(output);
+		}
+	} else if (remuxed) {
+		if (code == UERR_SUCCESS) {
+			code = remux_close(&cursor.remuxer);
+		}
+		
+		remux_free(&cursor.remuxer);
+		cursor.remuxing = 0;
+		
+		if (code != UERR_SUCCESS) {
+			remove_file(output);
+		}
+	} else if (cursor.stream != NULL) {
+		const int ok = fstream_close(cursor.stream);
+		cursor.stream = NULL;
+		
+		if (code == UERR_SUCCESS && !ok) {
+			code = UERR_FSTREAM_FAILURE;
+		}
+		
+		if (code != UERR_SUCCESS) {
+			remove_file(assembled_filename);
+		}
+	}
+	
+	if (code != UERR_SUCCESS) {
+		m3u8_remove_downloads(&cursor);
+		m3u8_free(&tags);
+		
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar baixar os seguimentos de mídia: %s\r\n", strurr(code));
+		return UERR_FAILURE;
+	}
+	
+	/*
+	Remuxed natively (or muxed by ffmpeg as segments came in), there is nothing
+	left for ffmpeg to do.
+	*/
+	if (remuxed || piped) {
+		m3u8_remove_downloads(&cursor);
+		m3u8_free(&tags);
+		
+		return UERR_SUCCESS;
+	}
+	
+	const char* input = assembled_filename;
+	const char* command = "ffmpeg -nostdin -nostats -loglevel error -i \"%s\" -c copy \"%s\"";
+	
+	if (!cursor.assemble) {
+		printf("+ Exportando lista de reprodução M3U8 para '%s'\r\n", playlist_filename);
+		
+		struct FStream* const stream = fstream_open(playlist_filename, "wb");
+		
+		if (stream == NULL) {
+			const struct SystemError error = get_system_error();
+			
+			m3u8_remove_downloads(&cursor);
+			m3u8_free(&tags);
+			
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", playlist_filename, error.message);
+			return UERR_FAILURE;
+		}
+		
+		const int ok = tags_dumpf(&tags, stream);
+		
+		fstream_close(stream);
+		
+		if (!ok) {
+			const struct SystemError error = get_system_error();
+			
+			m3u8_remove_downloads(&cursor);
+			m3u8_free(&tags);
+			remove_file(playlist_filename);
+			
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar exportar a lista de reprodução para '%s': %s\r\n", playlist_filename, error.message);
+			return UERR_FAILURE;
+		}
+		
+		input = playlist_filename;
+		command = "ffmpeg -nostdin -nostats -loglevel error -allowed_extensions ALL -i \"%s\" -c copy \"%s\"";
+	}
+	
+	printf("+ Concatenando seguimentos de mídia baixados para um único arquivo em '%s'\r\n", output);
+	
+	const int size = snprintf(NULL, 0, command, input, output);
+	char shell_command[size + 1];
+	snprintf(shell_command, sizeof(shell_command), command, input, output);
+	
+	const int exit_code = execute_shell_command(shell_command);
+	
+	m3u8_remove_downloads(&cursor);
+	m3u8_free(&tags);
+	
+	remove_file(input);
+	
+	if (exit_code != 0) {
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar processar a mídia!\r\n");
+		return UERR_FAILURE;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+/*
+State of a media file being downloaded into a ".part" file. It is also kept in a
+sidecar file next to it, so that an interrupted download can be continued by the
+next run. "validator" is the ETag of the file (or its Last-Modified date, lacking
+one); the download is only continued while the server still reports the same
+one, and the same size. Files downloaded in chunks record which of them are
+complete in "done"; a single stream simply continues from the size of the
+".part" file.
+*/
+struct PartialDownload {
+	char* url;
+	char* validator;
+	curl_off_t size;
+	curl_off_t chunk;
+	size_t chunks;
+	unsigned char* done;
+};
+
+static void partial_download_free(struct PartialDownload* const partial) {
+	
+	free(partial->url);
+	partial->url = NULL;
+	
+	free(partial->validator);
+	partial->validator = NULL;
+	
+	free(partial->done);
+	partial->done = NULL;
+	
+	partial->size = 0;
+	partial->chunk = 0;
+	partial->chunks = 0;
+	
+}
+
+static int partial_download_load(struct PartialDownload* const partial, const char* const filename) {
+	/*
+	Loads the sidecar file of an interrupted download. Returns (1) on success, or
+	(0) if there is none or it can not be used.
+	*/
+	
+	struct FStream* const stream = fstream_open(filename, "rb");
+	
+	if (stream == NULL) {
+		return 0;
+	}
 	
-	CURLM* curl_multi = get_global_curl_multi();
+	json_auto_t* tree = json_load_callback(json_load_cb, (void*) stream, 0, NULL);
+	
+	fstream_close(stream);
+	
+	if (tree == NULL || !json_is_object(tree)) {
+		return 0;
+	}
+	
+	const json_t* const url = json_object_get(tree, "url");
+	const json_t* const validator = json_object_get(tree, "validator");
+	const json_t* const size = json_object_get(tree, "size");
+	const json_t* const chunk = json_object_get(tree, "chunk");
+	const json_t* const done = json_object_get(tree, "done");
+	
+	if (!json_is_string(url) || !json_is_string(validator) || !json_is_integer(size) || !json_is_integer(chunk) || !json_is_array(done)) {
+		return 0;
+	}
+	
+	partial->size = (curl_off_t) json_integer_value(size);
+	partial->chunk = (curl_off_t) json_integer_value(chunk);
+	
+	if (partial->size < 1 || partial->chunk < 0) {
+		return 0;
+	}
+	
+	partial->url = malloc(strlen(json_string_value(url)) + 1);
+	partial->validator = malloc(strlen(json_string_value(validator)) + 1);
+	
+	if (partial->url == NULL || partial->validator == NULL) {
+		return 0;
+	}
+	
+	strcpy(partial->url, json_string_value(url));
+	strcpy(partial->validator, json_string_value(validator));
+	
+	if (partial->chunk == 0) {
+		return 1;
+	}
 	
-	int still_running = 1;
+	partial->chunks = (size_t) ((partial->size + partial->chunk - 1) / partial->chunk);
+	partial->done = calloc(partial->chunks, sizeof(*partial->done));
 	
-	curl_progress_cb(NULL, (const curl_off_t) dcount, (const curl_off_t) *total_done, 0, 0);
+	if (partial->done == NULL) {
+		return 0;
+	}
 	
-	while (still_running) {
-		CURLMcode mc = curl_multi_perform(curl_multi, &still_running);
+	for (size_t index = 0; index < json_array_size(done); index++) {
+		const json_t* const item = json_array_get(done, index);
 		
-		if (still_running) {
-			mc = curl_multi_poll(curl_multi, NULL, 0, 1000, NULL);
+		if (!json_is_integer(item)) {
+			return 0;
 		}
-			
-		CURLMsg* msg = NULL;
-		int msgs_left = 0;
 		
-		int should_continue = 0;
+		const json_int_t value = json_integer_value(item);
 		
-		while ((msg = curl_multi_info_read(curl_multi, &msgs_left))) {
-			if (msg->msg == CURLMSG_DONE) {
-				struct Download* download = NULL;
-				
-				for (size_t index = 0; index < dcount; index++) {
-					struct Download* const subdownload = &dqueue[index];
-					
-					if (subdownload->handle == msg->easy_handle) {
-						download = subdownload;
-						break;
-					}
-				}
-				
-				curl_multi_remove_handle(curl_multi, msg->easy_handle);
+		if (value < 0 || (size_t) value >= partial->chunks) {
+			return 0;
+		}
+		
+		partial->done[value] = 1;
+	}
+	
+	return 1;
+	
+}
+
+static int partial_download_save(const struct PartialDownload* const partial, const char* const filename) {
+	/*
+	Writes the state of a partial download into "<filename>.part" and moves it over
+	the file, so that an interruption never leaves a truncated sidecar behind.
+	*/
+	
+	json_auto_t* tree = json_object();
+	json_t* done = json_array();
+	
+	json_object_set_new(tree, "url", json_string(partial->url));
+	json_object_set_new(tree, "validator", json_string(partial->validator));
+	json_object_set_new(tree, "size", json_integer((json_int_t) partial->size));
+	json_object_set_new(tree, "chunk", json_integer((json_int_t) partial->chunk));
+	
+	for (size_t index = 0; index < partial->chunks; index++) {
+		if (partial->done[index]) {
+			json_array_append_new(done, json_integer((json_int_t) index));
+		}
+	}
+	
+	json_object_set_new(tree, "done", done);
+	
+	char temporary[strlen(filename) + strlen(DOT) + strlen(PART_FILE_EXTENSION) + 1];
+	strcpy(temporary, filename);
+	strcat(temporary, DOT);
+	strcat(temporary, PART_FILE_EXTENSION);
+	
+	struct FStream* const stream = fstream_open(temporary, "wb");
+	
+	if (stream == NULL) {
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	const int code = json_dump_callback(tree, json_dump_cb, (void*) stream, JSON_COMPACT);
+	
+	if (!fstream_close(stream) || code != 0 || move_file(temporary, filename) == -1) {
+		remove_file(temporary);
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+struct RangeCursor {
+	struct PartialDownload* partial;
+	const char* output;
+	const char* sidecar;
+	size_t index;
+};
+
+static int range_next_download(struct Download* const download, void* const userdata) {
+	/*
+	Hands out the next chunk of a file downloaded through range requests that is
+	not complete yet. All of them are written straight into their place in the
+	same output file.
+	*/
+	
+	struct RangeCursor* const cursor = (struct RangeCursor*) userdata;
+	const struct PartialDownload* const partial = cursor->partial;
+	
+	while (cursor->index < partial->chunks) {
+		const size_t index = cursor->index++;
+		
+		if (partial->done[index]) {
+			continue;
+		}
+		
+		download->url = malloc(strlen(partial->url) + 1);
+		download->filename = malloc(strlen(cursor->output) + 1);
+		
+		if (download->url == NULL || download->filename == NULL) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		strcpy(download->url, partial->url);
+		strcpy(download->filename, cursor->output);
+		
+		const curl_off_t offset = (curl_off_t) index * partial->chunk;
+		const curl_off_t remaining = partial->size - offset;
+		
+		download->offset = offset;
+		download->length = (remaining < partial->chunk) ? remaining : partial->chunk;
+		
+		return 1;
+	}
+	
+	return 0;
+	
+}
+
+static int range_complete(const struct Download* const download, void* const userdata) {
+	/*
+	Records a complete chunk in the sidecar file. Failing to do so only means a
+	later run would download the chunk again.
+	*/
+	
+	const struct RangeCursor* const cursor = (const struct RangeCursor*) userdata;
+	struct PartialDownload* const partial = cursor->partial;
+	
+	partial->done[download->offset / partial->chunk] = 1;
+	
+	if (cursor->sidecar != NULL) {
+		partial_download_save(partial, cursor->sidecar);
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static void media_probe(const char* const url, struct PartialDownload* const partial) {
+	/*
+	Asks for the first byte of the given file to find out whether its server
+	supports range requests. If it does, fills in the size of the file, its
+	validator (if any) and the URL it was found at (after redirects).
+	
+	The size is left at 0 otherwise, or if the request failed for whatever reason;
+	the actual download reports the problem then.
+	*/
+	
+	CURL* const curl_easy = get_global_curl_easy();
+	
+	curl_easy_setopt(curl_easy, CURLOPT_URL, url);
+	curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl_easy, CURLOPT_RANGE, "0-0");
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, curl_discard_body_cb);
+	
+	/*
+	A server that ignores the range would send the whole file; give up as soon as
+	it says so.
+	*/
+	curl_easy_setopt(curl_easy, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) 1);
+	
+	if (curl_easy_perform_retry(curl_easy) == CURLE_OK) {
+		long status_code = 0;
+		struct curl_header* header = NULL;
+		
+		curl_easy_getinfo(curl_easy, CURLINFO_RESPONSE_CODE, &status_code);
+		
+		/*
+		"Content-Range: bytes 0-0/<size>"; the size is "*" if the server does not
+		know it.
+		*/
+		if (status_code == 206 && curl_easy_header(curl_easy, "Content-Range", 0, CURLH_HEADER, -1, &header) == CURLHE_OK) {
+			const char* const total = strchr(header->value, '/');
+			
+			if (total != NULL) {
+				char* end = NULL;
+				const long long value = strtoll(total + 1, &end, 10);
 				
-				if (msg->data.result == CURLE_OK) {
-					curl_easy_cleanup(msg->easy_handle);
-					fstream_close(download->stream);
-					
-					(*total_done)++;
-					curl_progress_cb(NULL, (const curl_off_t) dcount, (const curl_off_t) *total_done, 0, 0);
-				} else {
-					fstream_seek(download->stream, 0, FSTREAM_SEEK_BEGIN);
-					curl_multi_add_handle(curl_multi, msg->easy_handle);
-					
-					if (!should_continue) {
-						should_continue = 1;
-					}
+				if (end != total + 1 && value > 0) {
+					partial->size = (curl_off_t) value;
 				}
 			}
 		}
 		
-		if (should_continue) {
-			still_running = 1;
-			continue;
+		char* effective_url = NULL;
+		curl_easy_getinfo(curl_easy, CURLINFO_EFFECTIVE_URL, &effective_url);
+		
+		if (partial->size > 0 && effective_url != NULL) {
+			partial->url = malloc(strlen(effective_url) + 1);
+			
+			if (partial->url == NULL) {
+				partial->size = 0;
+			} else {
+				strcpy(partial->url, effective_url);
+			}
+		} else {
+			partial->size = 0;
 		}
 		
-		if (mc) {
-			break;
+		if (partial->size > 0 && (curl_easy_header(curl_easy, "ETag", 0, CURLH_HEADER, -1, &header) == CURLHE_OK || curl_easy_header(curl_easy, "Last-Modified", 0, CURLH_HEADER, -1, &header) == CURLHE_OK)) {
+			partial->validator = malloc(strlen(header->value) + 1);
+			
+			if (partial->validator != NULL) {
+				strcpy(partial->validator, header->value);
+			}
 		}
 	}
 	
+	curl_easy_setopt(curl_easy, CURLOPT_URL, NULL);
+	curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 0L);
+	curl_easy_setopt(curl_easy, CURLOPT_RANGE, NULL);
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, NULL);
+	curl_easy_setopt(curl_easy, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) 0);
+	
 }
 
-static int m3u8_download(const char* const url, const char* const output) {
+static int media_download_ranges(struct PartialDownload* const partial, const char* const output, const char* const sidecar, const enum BandwidthClass priority) {
+	/*
+	Fills the output file with the chunks that are not complete yet, downloaded in
+	parallel. A fresh download gets its output file preallocated first. A single
+	event loop is plenty for a handful of connections to the same host.
+	*/
+	
+	if (partial->done == NULL) {
+		partial->chunk = partial->size / (curl_off_t) (RANGE_CONNECTIONS * RANGE_CHUNKS_PER_CONNECTION);
+		
+		if (partial->chunk < RANGE_MIN_CHUNK) {
+			partial->chunk = RANGE_MIN_CHUNK;
+		}
+		
+		partial->chunks = (size_t) ((partial->size + partial->chunk - 1) / partial->chunk);
+		partial->done = calloc(partial->chunks, sizeof(*partial->done));
+		
+		if (partial->done == NULL) {
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar alocar memória do sistema!\r\n");
+			return UERR_FAILURE;
+		}
+		
+		struct FStream* const stream = fstream_open(output, "wb");
+		
+		if (stream == NULL) {
+			const struct SystemError error = get_system_error();
+			
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", output, error.message);
+			return UERR_FAILURE;
+		}
+		
+		const int allocated = fstream_allocate(stream, (long long) partial->size);
+		
+		fstream_close(stream);
+		
+		if (!allocated) {
+			const struct SystemError error = get_system_error();
+			
+			remove_file(output);
+			
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar reservar espaço para o arquivo em '%s': %s\r\n", output, error.message);
+			return UERR_FAILURE;
+		}
+		
+		if (sidecar != NULL) {
+			partial_download_save(partial, sidecar);
+		}
+	}
+	
+	struct RangeCursor cursor = {
+		.partial = partial,
+		.output = output,
+		.sidecar = sidecar
+	};
+	
+	struct Transfer transfer = {
+		.window = RANGE_CONNECTIONS,
+		.workers = 1,
+		.next = range_next_download,
+		.complete = range_complete,
+		.userdata = &cursor,
+		.priority = priority
+	};
+	
+	for (size_t index = 0; index < partial->chunks; index++) {
+		transfer.total += !partial->done[index];
+	}
+	
+	if (transfer.total < 1) {
+		return UERR_SUCCESS;
+	}
+	
+	const int code = transfer_perform(&transfer);
+	
+	erase_line();
+	transfer_print_statistics(&transfer);
+	
+	if (code != UERR_SUCCESS) {
+		/*
+		Whatever was downloaded so far is kept for the next run, as long as there is
+		a way to tell whether the file changed in the meantime.
+		*/
+		if (sidecar == NULL) {
+			remove_file(output);
+		}
+		
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar baixar o arquivo de mídia: %s\r\n", strurr(code));
+		return (code == UERR_TRANSFER_RANGE_MISMATCH) ? code : UERR_FAILURE;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+struct MediaStream {
+	struct FStream* stream;
+	const char* filename;
+	curl_off_t written;
+	int resumable;
+};
+
+static size_t media_write_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
+	
+	struct MediaStream* const media = (struct MediaStream*) userdata;
+	
+	const size_t chunk_size = curl_write_file_cb(ptr, size, nmemb, (void*) media->stream);
+	media->written += (curl_off_t) chunk_size;
+	
+	return chunk_size;
+	
+}
+
+static int media_rewind_cb(CURL* const curl, void* const userdata) {
+	/*
+	A retry continues right after the bytes the failed attempt wrote. Servers that
+	do not support range requests send the whole file again, so it is written
+	from scratch.
+	*/
+	
+	struct MediaStream* const media = (struct MediaStream*) userdata;
+	
+	if (!media->resumable) {
+		fstream_close(media->stream);
+		media->stream = fstream_open(media->filename, "wb");
+		
+		if (media->stream == NULL) {
+			return UERR_FSTREAM_FAILURE;
+		}
+		
+		media->written = 0;
+	}
+	
+	curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, media->written);
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int media_download_stream(const char* const url, const char* const output, const curl_off_t resumed, const int resumable, const enum BandwidthClass priority) {
+	/*
+	Downloads a media file as a single stream into "output", continuing after its
+	first "resumed" bytes.
+	*/
 	
-	CURLM* const curl_multi = get_global_curl_multi();
 	CURL* const curl_easy = get_global_curl_easy();
 	
-	struct String string __attribute__((__cleanup__(string_free))) = {0};
+	struct MediaStream media = {
+		.filename = output,
+		.written = resumed,
+		.resumable = resumable
+	};
+	
+	if (resumed > 0) {
+		media.stream = fstream_open(output, "r+b");
+		
+		if (media.stream != NULL && !fstream_seek(media.stream, (long long) resumed, FSTREAM_SEEK_BEGIN)) {
+			fstream_close(media.stream);
+			media.stream = NULL;
+		}
+	} else {
+		media.stream = fstream_open(output, "wb");
+	}
+	
+	if (media.stream == NULL) {
+		const struct SystemError error = get_system_error();
+		
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", output, error.message);
+		return UERR_FAILURE;
+	}
 	
+	curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 0L);
+	curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, curl_progress_cb);
+	curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, media_write_cb);
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, (void*) &media);
 	curl_easy_setopt(curl_easy, CURLOPT_URL, url);
-	curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, curl_write_string_cb);
-	curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, &string);
+	curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl_easy, CURLOPT_RESUME_FROM_LARGE, resumed);
+	
+	const CURLcode code = curl_easy_perform_resumable(curl_easy, priority, media_rewind_cb, (void*) &media);
+	
+	erase_line();
+	
+	if (media.stream != NULL) {
+		fstream_close(media.stream);
+	}
+	
+	curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, NULL);
+	curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 1L);
+	curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 60L);
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, NULL);
+	curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, NULL);
+	curl_easy_setopt(curl_easy, CURLOPT_URL, NULL);
+	curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 0L);
+	curl_easy_setopt(curl_easy, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+	
+	if (code != CURLE_OK) {
+		/*
+		The partial file is kept for the next run, unless there is no way to
+		continue it (or the server just refused to).
+		*/
+		if (!resumable || code == CURLE_RANGE_ERROR) {
+			remove_file(output);
+		}
+		
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar conectar com o servidor HTTP: %s\r\n", get_global_curl_error());
+		return (code == CURLE_RANGE_ERROR) ? UERR_TRANSFER_RANGE_MISMATCH : UERR_FAILURE;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int media_download_probed(const char* const url, const char* const output, struct PartialDownload* const remote, const enum BandwidthClass priority) {
+	/*
+	Downloads a single file whose server was already asked about range requests
+	with media_probe(), over several connections if the file is large enough and
+	the server supports them, or as a single stream otherwise.
+	
+	The file is downloaded into "<output>.part" first. If the server supports
+	range requests and tells which version of the file it serves, a download
+	interrupted by an earlier run is continued instead of started over.
+	*/
+	
+	char part[strlen(output) + strlen(DOT) + strlen(PART_FILE_EXTENSION) + 1];
+	strcpy(part, output);
+	strcat(part, DOT);
+	strcat(part, PART_FILE_EXTENSION);
+	
+	char sidecar[strlen(part) + strlen(DOT) + strlen(JSON_FILE_EXTENSION) + 1];
+	strcpy(sidecar, part);
+	strcat(sidecar, DOT);
+	strcat(sidecar, JSON_FILE_EXTENSION);
+	
+	struct PartialDownload local __attribute__((__cleanup__(partial_download_free))) = {0};
+	
+	const int ranges = (remote->size >= RANGE_MIN_SIZE);
+	const int resumable = (remote->size > 0 && remote->validator != NULL);
+	
+	long long resumed = 0;
+	
+	if (resumable && partial_download_load(&local, sidecar) && strcmp(local.validator, remote->validator) == 0 && local.size == remote->size && (local.chunk > 0) == ranges) {
+		resumed = get_file_size(part);
+		
+		if (ranges ? (resumed != remote->size) : (resumed > remote->size)) {
+			resumed = -1;
+		}
+	} else {
+		resumed = -1;
+	}
+	
+	if (resumed < 0) {
+		remove_file(part);
+		remove_file(sidecar);
+		
+		partial_download_free(&local);
+		resumed = 0;
+	} else {
+		printf("+ Continuando download interrompido anteriormente em '%s'\r\n", part);
+	}
+	
+	int code = UERR_SUCCESS;
+	
+	if (ranges) {
+		remote->chunk = local.chunk;
+		remote->chunks = local.chunks;
+		remote->done = local.done;
+		
+		local.done = NULL;
+		
+		code = media_download_ranges(remote, part, resumable ? sidecar : NULL, priority);
+	} else {
+		if (resumable) {
+			partial_download_save(remote, sidecar);
+		}
+		
+		/*
+		An earlier run may have got to download everything, but not to move the
+		file into place.
+		*/
+		if (resumed == 0 || resumed < remote->size) {
+			code = media_download_stream((remote->url == NULL) ? url : remote->url, part, (curl_off_t) resumed, resumable, priority);
+		}
+	}
+	
+	if (code != UERR_SUCCESS) {
+		if (code == UERR_TRANSFER_RANGE_MISMATCH) {
+			remove_file(sidecar);
+		}
+		
+		return code;
+	}
+	
+	remove_file(sidecar);
+	
+	if (move_file(part, output) != 0) {
+		const struct SystemError error = get_system_error();
+		
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar mover o arquivo de '%s' para '%s': %s\r\n", part, output, error.message);
+		return UERR_FAILURE;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int media_download(const char* const url, const char* const output) {
+	
+	struct PartialDownload remote __attribute__((__cleanup__(partial_download_free))) = {0};
+	
+	media_probe(url, &remote);
+	
+	return media_download_probed(url, output, &remote, BANDWIDTH_CLASS_MEDIA);
+	
+}
+
+struct AttachmentCursor {
+	struct Attachments* attachments;
+	const char* temporary_directory;
+	size_t index;
+};
+
+static int attachment_next_download(struct Download* const download, void* const userdata) {
+	/*
+	Hands out the next attachment that still needs to be downloaded. Each one is
+	saved to its own file inside the temporary directory, so that attachments
+	sharing the same name can be downloaded at the same time. Large ones are
+	declined as soon as their size is known; see attachments_download().
+	*/
+	
+	struct AttachmentCursor* const cursor = (struct AttachmentCursor*) userdata;
+	
+	while (cursor->index < cursor->attachments->offset) {
+		const int number = (int) cursor->index;
+		struct Attachment* const attachment = &cursor->attachments->items[cursor->index++];
+		
+		if (file_exists(attachment->path) != 0) {
+			continue;
+		}
+		
+		char value[intlen(number) + 1];
+		snprintf(value, sizeof(value), "%i", number);
+		
+		download->url = malloc(strlen(attachment->url) + 1);
+		download->filename = malloc(strlen(cursor->temporary_directory) + strlen(PATH_SEPARATOR) + strlen(value) + strlen(DOT) + strlen(attachment->short_filename) + 1);
+		
+		if (download->url == NULL || download->filename == NULL) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		strcpy(download->url, attachment->url);
+		
+		strcpy(download->filename, cursor->temporary_directory);
+		strcat(download->filename, PATH_SEPARATOR);
+		strcat(download->filename, value);
+		strcat(download->filename, DOT);
+		strcat(download->filename, attachment->short_filename);
+		
+		download->userdata = (void*) attachment;
+		download->max_size = RANGE_MIN_SIZE - 1;
+		
+		erase_line();
+		
+		fprintf(stderr, "- O arquivo '%s' não existe, ele será baixado\r\n", attachment->path);
+		printf("+ Baixando de '%s' para '%s'\r\n", attachment->url, download->filename);
+		
+		return 1;
+	}
+	
+	return 0;
+	
+}
+
+static int attachment_move(const struct Download* const download, void* const userdata) {
+	
+	(void) userdata;
+	
+	const struct Attachment* const attachment = (const struct Attachment*) download->userdata;
 	
-	if (curl_easy_perform_retry(curl_easy) != CURLE_OK) {
-		return UERR_CURL_FAILURE;
+	if (download->declined) {
+		remove_file(download->filename);
+		return UERR_SUCCESS;
 	}
 	
-	struct Tags tags = {0};
+	erase_line();
 	
-	if (m3u8_parse(&tags, string.s) != UERR_SUCCESS) {
-		fprintf(stderr, "- Ocorreu uma falha inesperada!\r\n");
+	printf("+ Movendo arquivo de '%s' para '%s'\r\n", download->filename, attachment->path);
+	
+	if (move_file(download->filename, attachment->path) == -1) {
+		const struct SystemError error = get_system_error();
+		
+		remove_file(download->filename);
+		
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar mover o arquivo de '%s' para '%s': %s\r\n", download->filename, attachment->path, error.message);
 		return UERR_FAILURE;
 	}
 	
-	int segment_number = 1;
-	
-	struct Download dl_queue[tags.offset];
-	size_t dl_total = 0;
-	size_t dl_done = 0;
+	return UERR_SUCCESS;
 	
-	char playlist_filename[strlen(output) + strlen(DOT) + strlen(M3U8_FILE_EXTENSION) + 1];
-	strcpy(playlist_filename, output);
-	strcat(playlist_filename, DOT);
-	strcat(playlist_filename, M3U8_FILE_EXTENSION);
+}
+
+static int attachments_download(struct Attachments* const attachments, const char* const directory, const char* const temporary_directory, const int kof) {
+	/*
+	Downloads all attachments that are not present in the given directory yet,
+	several of them at once.
+	*/
+	
+	struct AttachmentCursor cursor = {
+		.attachments = attachments,
+		.temporary_directory = temporary_directory
+	};
 	
-	CURLU* cu __attribute__((__cleanup__(curlupp_free))) = curl_url();
-	curl_url_set(cu, CURLUPART_URL, url, 0);
+	struct Transfer transfer = {
+		.next = attachment_next_download,
+		.complete = attachment_move,
+		.userdata = &cursor,
+		.priority = BANDWIDTH_CLASS_ATTACHMENT
+	};
 	
-	for (size_t index = 0; index < tags.offset; index++) {
-		struct Tag* const tag = &tags.items[index];
+	for (size_t index = 0; index < attachments->offset; index++) {
+		struct Attachment* const attachment = &attachments->items[index];
 		
-		if (tag->type == EXT_X_KEY) {
-			struct Attribute* const attribute = attributes_get(&tag->attributes, "URI");
-			
-			curl_url_set(cu, CURLUPART_URL, url, 0);
-			curl_url_set(cu, CURLUPART_URL, attribute->value, 0);
-			
-			char* key_url __attribute__((__cleanup__(curlcharpp_free))) = NULL;
-			curl_url_get(cu, CURLUPART_URL, &key_url, 0);
-			
-			char* filename = malloc(strlen(output) + strlen(DOT) + strlen(KEY_FILE_EXTENSION) + 1);
-			strcpy(filename, output);
-			strcat(filename, DOT);
-			strcat(filename, KEY_FILE_EXTENSION);
-			
-			attribute_set_value(attribute, filename);
-			
-			CURL* handle = curl_easy_new();
-			
-			if (handle == NULL) {
-				fprintf(stderr, "- Ocorreu uma falha inesperada!\r\n");
-				return UERR_FAILURE;
-			}
-			
-			curl_easy_setopt(handle, CURLOPT_URL, key_url);
-			
-			struct FStream* stream = fstream_open(filename, "wb");
-			
-			if (stream == NULL && errno == EMFILE) {
-				curl_poll(dl_queue, dl_total, &dl_done);
-				stream = fstream_open(filename, "wb");
-			}
-			
-			if (stream == NULL) {
-				const struct SystemError error = get_system_error();
-				
-				fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", filename, error.message);
-				return UERR_FAILURE;
-			}
-			
-			curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, curl_write_file_cb);
-			curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void*) stream);
-			curl_multi_add_handle(curl_multi, handle);
-			
-			struct Download download = {
-				.handle = handle,
-				.filename = filename,
-				.stream = stream
-			};
-			
-			dl_queue[dl_total++] = download;
-			
-			curl_url_set(cu, CURLUPART_URL, url, 0);
-			curl_url_set(cu, CURLUPART_URL, tag->uri, 0);
-			
-			char* segment_url __attribute__((__cleanup__(curlcharpp_free))) = NULL;
-			curl_url_get(cu, CURLUPART_URL, &segment_url, 0);
-			
-			handle = curl_easy_new();
-			
-			if (handle == NULL) {
-				fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar inicializar o cliente HTTP!\r\n");
-				return UERR_FAILURE;
-			}
-			
-			curl_easy_setopt(handle, CURLOPT_URL, segment_url);
-			
-			char value[intlen(segment_number) + 1];
-			snprintf(value, sizeof(value), "%i", segment_number);
-			
-			char* segment_filename = malloc(strlen(output) + strlen(DOT) + strlen(value) + strlen(DOT) + strlen(TS_FILE_EXTENSION) + 1);
-			strcpy(segment_filename, output);
-			strcat(segment_filename, DOT);
-			strcat(segment_filename, value);
-			strcat(segment_filename, DOT);
-			strcat(segment_filename, TS_FILE_EXTENSION);
-			
-			tag_set_uri(tag, segment_filename);
-			
-			stream = fstream_open(segment_filename, "wb");
-			
-			if (stream == NULL && errno == EMFILE) {
-				curl_poll(dl_queue, dl_total, &dl_done);
-				stream = fstream_open(segment_filename, "wb");
-			}
-			
-			if (stream == NULL) {
-				const struct SystemError error = get_system_error();
-				
-				fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", filename, error.message);
-				return UERR_FAILURE;
-			}
-			
-			curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, curl_write_file_cb);
-			curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void*) stream);
-			curl_multi_add_handle(curl_multi, handle);
-			
-			download = (struct Download) {
-				.handle = handle,
-				.filename = segment_filename,
-				.stream = stream
-			};
-			
-			dl_queue[dl_total++] = download;
-			
-			segment_number++;
-		} else if (tag->type == EXTINF && tag->uri != NULL) {
-			curl_url_set(cu, CURLUPART_URL, url, 0);
-			curl_url_set(cu, CURLUPART_URL, tag->uri, 0);
-			
-			char* segment_url __attribute__((__cleanup__(curlcharpp_free))) = NULL;
-			curl_url_get(cu, CURLUPART_URL, &segment_url, 0);
-			
-			char value[intlen(segment_number) + 1];
-			snprintf(value, sizeof(value), "%i", segment_number);
-			
-			char* filename = malloc(strlen(output) + strlen(DOT) + strlen(value) + strlen(DOT) + strlen(TS_FILE_EXTENSION) + 1);
-			strcpy(filename, output);
-			strcat(filename, DOT);
-			strcat(filename, value);
-			strcat(filename, DOT);
-			strcat(filename, TS_FILE_EXTENSION);
-			
-			tag_set_uri(tag, filename);
-			
-			CURL* handle = curl_easy_new();
-			
-			if (handle == NULL) {
-				fprintf(stderr, "- Ocorreu uma falha inesperada!\r\n");
-				return UERR_FAILURE;
+		attachment->path = malloc(strlen(directory) + strlen(PATH_SEPARATOR) + (kof ? strlen(attachment->filename) : strlen(attachment->short_filename)) + 1);
+		
+		if (attachment->path == NULL) {
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar alocar memória do sistema!\r\n");
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		strcpy(attachment->path, directory);
+		strcat(attachment->path, PATH_SEPARATOR);
+		strcat(attachment->path, kof ? attachment->filename : attachment->short_filename);
+		
+		switch (file_exists(attachment->path)) {
+			case 1: {
+				fprintf(stderr, "- O arquivo '%s' já foi previamente baixado, ele não sofrerá alterações\r\n", attachment->path);
+				break;
 			}
-			
-			curl_easy_setopt(handle, CURLOPT_URL, segment_url);
-			
-			struct FStream* stream = fstream_open(filename, "wb");
-			
-			if (stream == NULL && errno == EMFILE) {
-				curl_poll(dl_queue, dl_total, &dl_done);
-				stream = fstream_open(filename, "wb");
+			case 0: {
+				transfer.total++;
+				break;
 			}
-			
-			if (stream == NULL) {
+			case -1: {
 				const struct SystemError error = get_system_error();
 				
-				fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", filename, error.message);
+				fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar obter informações sobre o arquivo em '%s': %s\r\n", attachment->path, error.message);
 				return UERR_FAILURE;
 			}
-			
-			curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, curl_write_file_cb);
-			curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void*) stream);
-			curl_multi_add_handle(curl_multi, handle);
-			
-			struct Download download = {
-				.handle = handle,
-				.filename = filename,
-				.stream = stream
-			};
-			
-			dl_queue[dl_total++] = download;
-			
-			segment_number++;
 		}
-		
 	}
 	
-	curl_poll(dl_queue, dl_total, &dl_done);
+	if (transfer.total < 1) {
+		return UERR_SUCCESS;
+	}
 	
-	erase_line();
+	const int code = transfer_perform(&transfer);
 	
-	printf("+ Exportando lista de reprodução M3U8 para '%s'\r\n", playlist_filename);
-	 
-	struct FStream* const stream = fstream_open(playlist_filename, "wb");
+	erase_line();
+	transfer_print_statistics(&transfer);
 	
-	if (stream == NULL) {
-		const struct SystemError error = get_system_error();
+	if (code != UERR_SUCCESS) {
+		if (code != UERR_FAILURE) {
+			fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar baixar os anexos: %s\r\n", strurr(code));
+		}
 		
-		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", playlist_filename, error.message);
-		return UERR_FAILURE;
+		return code;
 	}
-			
-	const int ok = tags_dumpf(&tags, stream);
 	
-	fstream_close(stream);
-	m3u8_free(&tags);
-	
-	if (!ok) {
-		const struct SystemError error = get_system_error();
+	/*
+	Attachments the transfer declined for being too large are still missing. They
+	are downloaded one at a time the way single media files are (over several
+	connections and continuing interrupted downloads, whenever their server allows
+	it).
+	*/
+	for (size_t index = 0; index < attachments->offset; index++) {
+		const struct Attachment* const attachment = &attachments->items[index];
 		
-		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar exportar a lista de reprodução para '%s': %s\r\n", playlist_filename, error.message);
-		return UERR_FAILURE;
-	}
-	
-	printf("+ Concatenando seguimentos de mídia baixados para um único arquivo em '%s'\r\n", output);
-	
-	const char* const command = "ffmpeg -nostdin -nostats -loglevel error -allowed_extensions ALL -i \"%s\" -c copy \"%s\"";
-	
-	const int size = snprintf(NULL, 0, command, playlist_filename, output);
-	char shell_command[size + 1];
-	snprintf(shell_command, sizeof(shell_command), command, playlist_filename, output);
-	
-	const int exit_code = execute_shell_command(shell_command);
-	
-	for (size_t index = 0; index < dl_total; index++) {
-		struct Download* const download = &dl_queue[index];
+		if (file_exists(attachment->path) != 0) {
+			continue;
+		}
 		
-		remove_file(download->filename);
-		free(download->filename);
-	}
-	
-	remove_file(playlist_filename);
-	
-	if (exit_code != 0) {
-		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar processar a mídia!\r\n");
-		return UERR_FAILURE;
+		printf("+ Baixando de '%s' para '%s'\r\n", attachment->url, attachment->path);
+		
+		struct PartialDownload remote __attribute__((__cleanup__(partial_download_free))) = {0};
+		
+		media_probe(attachment->url, &remote);
+		
+		const int status = media_download_probed(attachment->url, attachment->path, &remote, BANDWIDTH_CLASS_ATTACHMENT);
+		
+		if (status != UERR_SUCCESS) {
+			return status;
+		}
 	}
 	
-	curl_easy_setopt(curl_easy, CURLOPT_URL, NULL);
-	curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, NULL);
-	curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, NULL);
-	
 	return UERR_SUCCESS;
 	
 }
@@ -408,6 +2008,13 @@ int main(void) {
 	const struct Provider provider = PROVIDERS[value - 1];
 	const struct ProviderMethods methods = provider.methods;
 	
+	if (hosts_initialize() != UERR_SUCCESS) {
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar alocar memória do sistema!\r\n");
+		return EXIT_FAILURE;
+	}
+	
+	hosts_set_rate_limit(&provider.rate_limit);
+	
 	char* directory = get_configuration_directory();
 	
 	if (directory == NULL) {
@@ -492,7 +2099,7 @@ int main(void) {
 	CURL* curl_easy = get_global_curl_easy();
 	CURLM* curl_multi = get_global_curl_multi();
 	
-	if (curl_multi == NULL || curl_multi == NULL) {
+	if (curl_easy == NULL || curl_multi == NULL) {
 		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar inicializar o cliente HTTP!\r\n");
 		return EXIT_FAILURE;
 	}
@@ -1182,97 +2789,10 @@ int main(void) {
 				}
 			}
 			
-			curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 0L);
-			curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, curl_progress_cb);
-			curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 0L);
-			curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 1L);
-			curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, curl_write_file_cb);
-			
-			for (size_t index = 0; index < module->attachments.offset; index++) {
-				struct Attachment* const attachment = &module->attachments.items[index];
-				
-				attachment->path = malloc(strlen(module->path) + strlen(PATH_SEPARATOR) + (kof ? strlen(attachment->filename) : strlen(attachment->short_filename)) + 1);
-				
-				if (attachment->path == NULL) {
-					fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar alocar memória do sistema!\r\n");
-					return EXIT_FAILURE;
-				}
-			
-				strcpy(attachment->path, module->path);
-				strcat(attachment->path, PATH_SEPARATOR);
-				strcat(attachment->path, kof ? attachment->filename : attachment->short_filename);
-				
-				switch (file_exists(attachment->path)) {
-					case 1: {
-						fprintf(stderr, "- O arquivo '%s' já foi previamente baixado, ele não sofrerá alterações\r\n", attachment->path);
-						break;
-					}
-					case 0: {
-						char download_location[strlen(temporary_directory) + strlen(PATH_SEPARATOR) + strlen(attachment->short_filename) + 1];
-						strcpy(download_location, temporary_directory);
-						strcat(download_location, PATH_SEPARATOR);
-						strcat(download_location, attachment->short_filename);
-						
-						fprintf(stderr, "- O arquivo '%s' não existe, ele será baixado\r\n", attachment->path);
-						printf("+ Baixando de '%s' para '%s'\r\n", attachment->url, download_location);
-						
-						struct FStream* const stream = fstream_open(download_location, "wb");
-						
-						if (stream == NULL) {
-							const struct SystemError error = get_system_error();
-							
-							fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", download_location, error.message);
-							return EXIT_FAILURE;
-						}
-						
-						curl_easy_setopt(curl_easy, CURLOPT_URL, attachment->url);
-						curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, (void*) stream);
-						
-						const CURLcode code = curl_easy_perform_retry(curl_easy);
-						
-						erase_line();
-						
-						fstream_close(stream);
-						
-						if (code != CURLE_OK) {
-							remove_file(download_location);
-							
-							fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar conectar com o servidor HTTP: %s\r\n", get_global_curl_error());
-							return EXIT_FAILURE;
-						}
-						
-						printf("+ Movendo arquivo de '%s' para '%s'\r\n", download_location, attachment->path);
-						
-						if (move_file(download_location, attachment->path) == -1) {
-							const struct SystemError error = get_system_error();
-							
-							remove_file(download_location);
-							
-							fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar mover o arquivo de '%s' para '%s': %s\r\n", download_location, attachment->path, error.message);
-							return EXIT_FAILURE;
-						}
-						
-						remove_file(download_location);
-						
-						break;
-					}
-					case -1: {
-						const struct SystemError error = get_system_error();
-						
-						fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar obter informações sobre o arquivo em '%s': %s\r\n", attachment->path, error.message);
-						return EXIT_FAILURE;
-					}
-				}
+			if (attachments_download(&module->attachments, module->path, temporary_directory, kof) != UERR_SUCCESS) {
+				return EXIT_FAILURE;
 			}
 			
-			curl_easy_setopt(curl_easy, CURLOPT_URL, NULL);
-			curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, NULL);
-			curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, NULL);
-			curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 1L);
-			curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 60L);
-			curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, NULL);
-			curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 0L);
-			
 			printf("+ Obtendo lista de páginas do módulo '%s'\r\n", module->name);
 			
 			for (size_t index = 0; index < module->pages.offset; index++) {
@@ -1462,41 +2982,7 @@ int main(void) {
 									case MEDIA_SINGLE: {
 										printf("+ Baixando arquivo de mídia de '%s' para '%s'\r\n", media->audio.url, audio_path);
 										
-										struct FStream* const stream = fstream_open(audio_path, "wb");
-										
-										if (stream == NULL) {
-											const struct SystemError error = get_system_error();
-											
-											fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n",  audio_path, error.message);
-											return EXIT_FAILURE;
-										}
-										
-										curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 0L);
-										curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, curl_progress_cb);
-										curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 0L);
-										curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, curl_write_file_cb);
-										curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, (void*) stream);
-										curl_easy_setopt(curl_easy, CURLOPT_URL, media->audio.url);
-										curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 1L);
-										
-										const CURLcode code = curl_easy_perform_retry(curl_easy);
-										
-										erase_line();
-										
-										fstream_close(stream);
-										
-										curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, NULL);
-										curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 1L);
-										curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 60L);
-										curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, NULL);
-										curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, NULL);
-										curl_easy_setopt(curl_easy, CURLOPT_URL, NULL);
-										curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 0L);
-										
-										if (code != CURLE_OK) {
-											remove_file(audio_path);
-											
-											fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar conectar com o servidor HTTP: %s\r\n", get_global_curl_error());
+										if (media_download(media->audio.url, audio_path) != UERR_SUCCESS) {
 											return EXIT_FAILURE;
 										}
 										
@@ -1530,41 +3016,7 @@ int main(void) {
 									case MEDIA_SINGLE: {
 										printf("+ Baixando arquivo de mídia de '%s' para '%s'\r\n", media->video.url, video_path);
 										
-										struct FStream* const stream = fstream_open(video_path, "wb");
-										
-										if (stream == NULL) {
-											const struct SystemError error = get_system_error();
-											
-											fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n",  video_path, error.message);
-											return EXIT_FAILURE;
-										}
-										
-										curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 0L);
-										curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, curl_progress_cb);
-										curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 0L);
-										curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, curl_write_file_cb);
-										curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, (void*) stream);
-										curl_easy_setopt(curl_easy, CURLOPT_URL, media->video.url);
-										curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 1L);
-										
-										const CURLcode code = curl_easy_perform_retry(curl_easy);
-										
-										erase_line();
-										
-										fstream_close(stream);
-										
-										curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, NULL);
-										curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 1L);
-										curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 60L);
-										curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, NULL);
-										curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, NULL);
-										curl_easy_setopt(curl_easy, CURLOPT_URL, NULL);
-										curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 0L);
-										
-										if (code != CURLE_OK) {
-											remove_file(video_path);
-											
-											fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar conectar com o servidor HTTP: %s\r\n", get_global_curl_error());
+										if (media_download(media->video.url, video_path) != UERR_SUCCESS) {
 											return EXIT_FAILURE;
 										}
 										
@@ -1584,15 +3036,27 @@ int main(void) {
 								strcat(temporary_file, DOT);
 								strcat(temporary_file, file_extension);
 								
-								const char* const command = "ffmpeg -nostdin -nostats -loglevel error -i \"%s\" -i \"%s\" -c copy -movflags +faststart -map_metadata -1 -map 0:v:0 -map 1:a:0 \"%s\"";
+								printf("+ Copiando canais de áudio e vídeo para uma única mídia em '%s'\r\n", temporary_file);
 								
-								const int size = snprintf(NULL, 0, command, video_path, audio_path, temporary_file);
-								char shell_command[size + 1];
-								snprintf(shell_command, sizeof(shell_command), command, video_path, audio_path, temporary_file);
+								int exit_code = 0;
 								
-								printf("+ Copiando canais de áudio e vídeo para uma única mídia em '%s'\r\n", temporary_file);
+								const int code = merge_tracks(video_path, audio_path, temporary_file);
 								
-								const int exit_code = execute_shell_command(shell_command);
+								/*
+								Tracks the native muxer can not read are left to ffmpeg.
+								*/
+								if (code == UERR_UNSUPPORTED) {
+									const char* const command = "ffmpeg -nostdin -nostats -loglevel error -i \"%s\" -i \"%s\" -c copy -movflags +faststart -map_metadata -1 -map 0:v:0 -map 1:a:0 \"%s\"";
+									
+									const int size = snprintf(NULL, 0, command, video_path, audio_path, temporary_file);
+									char shell_command[size + 1];
+									snprintf(shell_command, sizeof(shell_command), command, video_path, audio_path, temporary_file);
+									
+									exit_code = execute_shell_command(shell_command);
+								} else if (code != UERR_SUCCESS) {
+									remove_file(temporary_file);
+									exit_code = -1;
+								}
 								
 								remove_file(audio_path);
 								remove_file(video_path);
@@ -1638,94 +3102,9 @@ int main(void) {
 					}
 				}
 				
-				curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 0L);
-				curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, curl_progress_cb);
-				curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 0L);
-				curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 1L);
-				curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, curl_write_file_cb);
-				
-				for (size_t index = 0; index < page->attachments.offset; index++) {
-					struct Attachment* const attachment = &page->attachments.items[index];
-					
-					attachment->path = malloc(strlen(page->path) + strlen(PATH_SEPARATOR) + (kof ? strlen(attachment->filename) : strlen(attachment->short_filename)) + 1);
-					
-					if (attachment->path == NULL) {
-						fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar alocar memória do sistema!\r\n");
-						return EXIT_FAILURE;
-					}
-					
-					strcpy(attachment->path, page->path);
-					strcat(attachment->path, PATH_SEPARATOR);
-					strcat(attachment->path, kof ? attachment->filename : attachment->short_filename);
-					
-					switch (file_exists(attachment->path)) {
-						case 1: {
-							fprintf(stderr, "- O arquivo '%s' já foi previamente baixado, ele não sofrerá alterações\r\n", attachment->path);
-							break;
-						}
-						case 0: {
-							char download_location[strlen(temporary_directory) + strlen(PATH_SEPARATOR) + strlen(attachment->short_filename) + 1];
-							strcpy(download_location, temporary_directory);
-							strcat(download_location, PATH_SEPARATOR);
-							strcat(download_location, attachment->short_filename);
-							
-							fprintf(stderr, "- O arquivo '%s' não existe, ele será baixado\r\n", attachment->path);
-							printf("+ Baixando de '%s' para '%s'\r\n", attachment->url, download_location);
-							
-							struct FStream* const stream = fstream_open(download_location, "wb");
-							
-							if (stream == NULL) {
-								const struct SystemError error = get_system_error();
-								
-								fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", attachment->path, error.message);
-								return EXIT_FAILURE;
-							}
-							
-							curl_easy_setopt(curl_easy, CURLOPT_URL, attachment->url);
-							curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, (void*) stream);
-							
-							const CURLcode code = curl_easy_perform_retry(curl_easy);
-							
-							erase_line();
-							
-							fstream_close(stream);
-							
-							if (code != CURLE_OK) {
-								remove_file(download_location);
-								
-								fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar conectar com o servidor HTTP: %s\r\n", get_global_curl_error());
-								return EXIT_FAILURE;
-							}
-							
-							printf("+ Movendo arquivo de '%s' para '%s'\r\n", download_location, attachment->path);
-							
-							if (move_file(download_location, attachment->path) == -1) {
-								const struct SystemError error = get_system_error();
-								
-								remove_file(download_location);
-								
-								fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar mover o arquivo de '%s' para '%s': %s\r\n", download_location, attachment->path, error.message);
-								return EXIT_FAILURE;
-							}
-							
-							break;
-						}
-						case -1: {
-							const struct SystemError error = get_system_error();
-							
-							fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar obter informações sobre o arquivo em '%s': %s\r\n", attachment->path, error.message);
-							return EXIT_FAILURE;
-						}
-					}
+				if (attachments_download(&page->attachments, page->path, temporary_directory, kof) != UERR_SUCCESS) {
+					return EXIT_FAILURE;
 				}
-				
-				curl_easy_setopt(curl_easy, CURLOPT_URL, NULL);
-				curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, NULL);
-				curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, NULL);
-				curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, 1L);
-				curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, 60L);
-				curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, NULL);
-				curl_easy_setopt(curl_easy, CURLOPT_FOLLOWLOCATION, 0L);
 			}
 		}
 	}
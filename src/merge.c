@@ -0,0 +1,985 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "merge.h"
+#include "mp4.h"
+#include "adts.h"
+#include "fstream.h"
+#include "errors.h"
+
+/*
+ADTS files are scanned through a window of this size.
+*/
+#define MERGE_WINDOW_SIZE (64 * 1024)
+
+#define MERGE_ID3_HEADER_SIZE 10
+
+/*
+The "moov" box is read into memory; one larger than this is not believed.
+*/
+static const uint64_t MERGE_MOOV_MAX_SIZE = 256 * 1024 * 1024;
+
+struct MergeBox {
+	const unsigned char* type;
+	const unsigned char* data;
+	size_t size;
+};
+
+static uint16_t get_u16(const unsigned char* const data) {
+	
+	return (uint16_t) ((data[0] << 8) | data[1]);
+	
+}
+
+static uint32_t get_u32(const unsigned char* const data) {
+	
+	return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | (uint32_t) data[3];
+	
+}
+
+static uint64_t get_u64(const unsigned char* const data) {
+	
+	return ((uint64_t) get_u32(data) << 32) | get_u32(data + 4);
+	
+}
+
+static int merge_read(struct MergeInput* const input, unsigned char* const buffer, const size_t size) {
+	/*
+	Reads exactly "size" bytes. Returns (1) on success, or (0) on error or if the
+	file ends before that.
+	*/
+	
+	size_t offset = 0;
+	
+	while (offset < size) {
+		const ssize_t count = fstream_read(input->stream, (char*) buffer + offset, size - offset);
+		
+		if (count <= 0) {
+			return 0;
+		}
+		
+		offset += (size_t) count;
+	}
+	
+	input->position += size;
+	
+	return 1;
+	
+}
+
+static int merge_seek(struct MergeInput* const input, const uint64_t position) {
+	
+	if (input->position == position) {
+		return 1;
+	}
+	
+	if (!fstream_seek(input->stream, (long long) position, FSTREAM_SEEK_BEGIN)) {
+		return 0;
+	}
+	
+	input->position = position;
+	
+	return 1;
+	
+}
+
+static int merge_next_box(const struct MergeBox* const parent, size_t* const offset, struct MergeBox* const box) {
+	/*
+	Gets the box at "offset" among the children of "parent", and moves "offset"
+	past it. Returns (1) if there is one, or (0) otherwise.
+	*/
+	
+	if (*offset > parent->size || parent->size - *offset < 8) {
+		return 0;
+	}
+	
+	const size_t available = parent->size - *offset;
+	const unsigned char* const data = parent->data + *offset;
+	
+	uint64_t size = get_u32(data);
+	size_t header_size = 8;
+	
+	if (size == 1) {
+		if (available < 16) {
+			return 0;
+		}
+		
+		size = get_u64(data + 8);
+		header_size = 16;
+	} else if (size == 0) {
+		size = available;
+	}
+	
+	if (size < header_size || size > available) {
+		return 0;
+	}
+	
+	box->type = data + 4;
+	box->data = data + header_size;
+	box->size = (size_t) size - header_size;
+	
+	*offset += (size_t) size;
+	
+	return 1;
+	
+}
+
+static int merge_find_box(const struct MergeBox* const parent, const char* const type, struct MergeBox* const box) {
+	
+	size_t offset = 0;
+	
+	while (merge_next_box(parent, &offset, box)) {
+		if (memcmp(box->type, type, 4) == 0) {
+			return 1;
+		}
+	}
+	
+	return 0;
+	
+}
+
+static int merge_read_descriptor(const unsigned char** const data, size_t* const size, const unsigned char tag, size_t* const length) {
+	/*
+	Skips the header of an MPEG-4 descriptor, whose length takes up to 4 bytes of
+	7 bits each.
+	*/
+	
+	if (*size < 2 || **data != tag) {
+		return 0;
+	}
+	
+	size_t offset = 1;
+	size_t value = 0;
+	
+	for (int index = 0; index < 4; index++) {
+		if (offset >= *size) {
+			return 0;
+		}
+		
+		const unsigned char byte = (*data)[offset++];
+		
+		value = (value << 7) | (byte & 0x7F);
+		
+		if (!(byte & 0x80)) {
+			break;
+		}
+	}
+	
+	if (value > *size - offset) {
+		return 0;
+	}
+	
+	*data += offset;
+	*size -= offset;
+	*length = value;
+	
+	return 1;
+	
+}
+
+static int merge_set_config(struct MergeInput* const input, const unsigned char* const config, const size_t size) {
+	
+	input->config = malloc(size);
+	
+	if (input->config == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	memcpy(input->config, config, size);
+	input->config_size = size;
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int merge_load_esds(struct MergeInput* const input, const struct MergeBox* const esds) {
+	/*
+	Gets the AudioSpecificConfig out of the ES descriptor of an AAC track.
+	*/
+	
+	if (esds->size < 4) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	const unsigned char* data = esds->data + 4;
+	size_t size = esds->size - 4;
+	size_t length = 0;
+	
+	if (!merge_read_descriptor(&data, &size, 0x03, &length) || length < 3) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	const unsigned char flags = data[2];
+	size_t skip = 3;
+	
+	if (flags & 0x80) {
+		skip += 2;
+	}
+	
+	if ((flags & 0x40) && skip < length) {
+		skip += 1 + data[skip];
+	}
+	
+	if (flags & 0x20) {
+		skip += 2;
+	}
+	
+	if (skip > size) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	data += skip;
+	size -= skip;
+	
+	/*
+	The decoder configuration has to be of MPEG-4 audio.
+	*/
+	if (!merge_read_descriptor(&data, &size, 0x04, &length) || length < 13 || data[0] != 0x40) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	data += 13;
+	size -= 13;
+	
+	if (!merge_read_descriptor(&data, &size, 0x05, &length) || length == 0) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	return merge_set_config(input, data, length);
+	
+}
+
+static int merge_load_sample_entry(struct MergeInput* const input, const struct MergeBox* const stsd) {
+	
+	if (stsd->size < 8 || get_u32(stsd->data + 4) < 1) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	const struct MergeBox entries = {
+		.data = stsd->data + 8,
+		.size = stsd->size - 8
+	};
+	
+	size_t offset = 0;
+	struct MergeBox entry = {0};
+	
+	if (!merge_next_box(&entries, &offset, &entry)) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	struct MergeBox children = {0};
+	struct MergeBox box = {0};
+	
+	if (input->type == MP4_TRACK_VIDEO) {
+		if (memcmp(entry.type, "avc1", 4) != 0 || entry.size < 78) {
+			return UERR_UNSUPPORTED;
+		}
+		
+		input->width = get_u16(entry.data + 24);
+		input->height = get_u16(entry.data + 26);
+		
+		children.data = entry.data + 78;
+		children.size = entry.size - 78;
+		
+		if (!merge_find_box(&children, "avcC", &box)) {
+			return UERR_UNSUPPORTED;
+		}
+		
+		return merge_set_config(input, box.data, box.size);
+	}
+	
+	if (memcmp(entry.type, "mp4a", 4) != 0 || entry.size < 28) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	/*
+	QuickTime files may have a version 1 entry, with 16 more bytes.
+	*/
+	const uint16_t version = get_u16(entry.data + 8);
+	const size_t entry_size = (version == 0) ? 28 : 44;
+	
+	if (version > 1 || entry.size < entry_size) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	input->channels = get_u16(entry.data + 16);
+	input->sample_rate = get_u32(entry.data + 24) >> 16;
+	
+	children.data = entry.data + entry_size;
+	children.size = entry.size - entry_size;
+	
+	if (!merge_find_box(&children, "esds", &box)) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	return merge_load_esds(input, &box);
+	
+}
+
+static int merge_allocate_samples(struct MergeInput* const input, const size_t count) {
+	
+	struct MP4Sample* const samples = realloc(input->samples, count * sizeof(*samples));
+	
+	if (samples == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	input->samples = samples;
+	
+	uint64_t* const positions = realloc(input->positions, count * sizeof(*positions));
+	
+	if (positions == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	input->positions = positions;
+	input->samples_size = count;
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int merge_load_sample_table(struct MergeInput* const input, const struct MergeBox* const stbl) {
+	/*
+	Rebuilds the list of samples of a track out of its sample table.
+	*/
+	
+	struct MergeBox stsd = {0};
+	struct MergeBox stts = {0};
+	struct MergeBox ctts = {0};
+	struct MergeBox stss = {0};
+	struct MergeBox stsz = {0};
+	struct MergeBox stsc = {0};
+	struct MergeBox stco = {0};
+	
+	const int has_ctts = merge_find_box(stbl, "ctts", &ctts);
+	const int has_stss = merge_find_box(stbl, "stss", &stss);
+	const int wide = !merge_find_box(stbl, "stco", &stco);
+	
+	if (wide && !merge_find_box(stbl, "co64", &stco)) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	if (!merge_find_box(stbl, "stsd", &stsd) || !merge_find_box(stbl, "stts", &stts) || !merge_find_box(stbl, "stsz", &stsz) || !merge_find_box(stbl, "stsc", &stsc)) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	int code = merge_load_sample_entry(input, &stsd);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	if (stsz.size < 12 || stts.size < 8 || stsc.size < 8 || stco.size < 8) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	const uint32_t uniform_size = get_u32(stsz.data + 4);
+	const size_t count = get_u32(stsz.data + 8);
+	
+	/*
+	Fragmented files keep their samples elsewhere.
+	*/
+	if (count == 0 || (uniform_size == 0 && (stsz.size - 12) / 4 < count)) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	const size_t stts_entries = get_u32(stts.data + 4);
+	
+	if ((stts.size - 8) / 8 < stts_entries) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	/*
+	Checked before allocating, since "count" comes from the file.
+	*/
+	uint64_t total = 0;
+	
+	for (size_t index = 0; index < stts_entries; index++) {
+		total += get_u32(stts.data + 8 + index * 8);
+	}
+	
+	if (total != count) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	code = merge_allocate_samples(input, count);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	input->samples_offset = count;
+	
+	size_t sample = 0;
+	uint64_t dts = 0;
+	
+	for (size_t index = 0; index < stts_entries; index++) {
+		const uint32_t samples = get_u32(stts.data + 8 + index * 8);
+		const uint32_t delta = get_u32(stts.data + 8 + index * 8 + 4);
+		
+		for (uint32_t item = 0; item < samples; item++) {
+			struct MP4Sample* const destination = &input->samples[sample++];
+			
+			destination->dts = dts;
+			destination->composition = 0;
+			destination->size = (uniform_size == 0) ? get_u32(stsz.data + 12 + (sample - 1) * 4) : uniform_size;
+			destination->sync = !has_stss;
+			
+			dts += delta;
+		}
+	}
+	
+	if (has_ctts && ctts.size >= 8) {
+		const size_t entries = get_u32(ctts.data + 4);
+		
+		sample = 0;
+		
+		for (size_t index = 0; index < entries && (ctts.size - 8) / 8 > index; index++) {
+			const uint32_t samples = get_u32(ctts.data + 8 + index * 8);
+			const int32_t composition = (int32_t) get_u32(ctts.data + 8 + index * 8 + 4);
+			
+			for (uint32_t item = 0; item < samples && sample < count; item++) {
+				input->samples[sample++].composition = composition;
+			}
+		}
+	}
+	
+	if (has_stss && stss.size >= 8) {
+		const size_t entries = get_u32(stss.data + 4);
+		
+		for (size_t index = 0; index < entries && (stss.size - 8) / 4 > index; index++) {
+			const uint32_t number = get_u32(stss.data + 8 + index * 4);
+			
+			if (number >= 1 && number <= count) {
+				input->samples[number - 1].sync = 1;
+			}
+		}
+	}
+	
+	/*
+	Samples of a chunk are stored back to back from its offset on.
+	*/
+	const size_t chunks = get_u32(stco.data + 4);
+	const size_t chunk_entry_size = wide ? 8 : 4;
+	
+	if ((stco.size - 8) / chunk_entry_size < chunks) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	const size_t stsc_entries = get_u32(stsc.data + 4);
+	
+	if ((stsc.size - 8) / 12 < stsc_entries) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	sample = 0;
+	
+	for (size_t index = 0; index < stsc_entries; index++) {
+		const size_t first = get_u32(stsc.data + 8 + index * 12);
+		const uint32_t samples = get_u32(stsc.data + 8 + index * 12 + 4);
+		const size_t last = (index + 1 < stsc_entries) ? get_u32(stsc.data + 8 + (index + 1) * 12) - 1 : chunks;
+		
+		if (first == 0) {
+			return UERR_UNSUPPORTED;
+		}
+		
+		for (size_t chunk = first; chunk <= last && chunk <= chunks; chunk++) {
+			const unsigned char* const entry = stco.data + 8 + (chunk - 1) * chunk_entry_size;
+			uint64_t position = wide ? get_u64(entry) : get_u32(entry);
+			
+			for (uint32_t item = 0; item < samples && sample < count; item++) {
+				input->positions[sample] = position;
+				position += input->samples[sample].size;
+				sample++;
+			}
+		}
+	}
+	
+	if (sample != count) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int merge_load_mp4(struct MergeInput* const input) {
+	/*
+	Loads the first track of the wanted type out of an MP4 file, whose "moov" box
+	can be anywhere among the top level boxes.
+	*/
+	
+	uint64_t position = 0;
+	uint64_t size = 0;
+	unsigned char header[16];
+	
+	while (1) {
+		if (!merge_seek(input, position) || !merge_read(input, header, 8)) {
+			return UERR_UNSUPPORTED;
+		}
+		
+		size = get_u32(header);
+		size_t header_size = 8;
+		
+		if (size == 1) {
+			if (!merge_read(input, header + 8, 8)) {
+				return UERR_UNSUPPORTED;
+			}
+			
+			size = get_u64(header + 8);
+			header_size = 16;
+		}
+		
+		if (memcmp(header + 4, "moof", 4) == 0 || size < header_size) {
+			return UERR_UNSUPPORTED;
+		}
+		
+		if (memcmp(header + 4, "moov", 4) == 0) {
+			size -= header_size;
+			
+			if (size > MERGE_MOOV_MAX_SIZE) {
+				return UERR_UNSUPPORTED;
+			}
+			
+			break;
+		}
+		
+		position += size;
+	}
+	
+	unsigned char* const moov = malloc((size_t) size);
+	
+	if (moov == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	if (!merge_read(input, moov, (size_t) size)) {
+		free(moov);
+		return UERR_UNSUPPORTED;
+	}
+	
+	const struct MergeBox root = {
+		.data = moov,
+		.size = (size_t) size
+	};
+	
+	const char* const handler = (input->type == MP4_TRACK_VIDEO) ? "vide" : "soun";
+	
+	size_t offset = 0;
+	struct MergeBox trak = {0};
+	
+	int code = UERR_UNSUPPORTED;
+	
+	while (merge_next_box(&root, &offset, &trak)) {
+		struct MergeBox mdia = {0};
+		struct MergeBox hdlr = {0};
+		struct MergeBox mdhd = {0};
+		struct MergeBox minf = {0};
+		struct MergeBox stbl = {0};
+		
+		if (memcmp(trak.type, "trak", 4) != 0) {
+			continue;
+		}
+		
+		if (!merge_find_box(&trak, "mdia", &mdia) || !merge_find_box(&mdia, "hdlr", &hdlr) || !merge_find_box(&mdia, "mdhd", &mdhd)) {
+			continue;
+		}
+		
+		if (hdlr.size < 12 || memcmp(hdlr.data + 8, handler, 4) != 0) {
+			continue;
+		}
+		
+		if (!merge_find_box(&mdia, "minf", &minf) || !merge_find_box(&minf, "stbl", &stbl)) {
+			continue;
+		}
+		
+		/*
+		Version 1 of the header has 64 bit times before the timescale.
+		*/
+		const size_t timescale_offset = (mdhd.size > 0 && mdhd.data[0] == 1) ? 20 : 12;
+		
+		if (mdhd.size < timescale_offset + 4) {
+			break;
+		}
+		
+		input->timescale = get_u32(mdhd.data + timescale_offset);
+		
+		if (input->timescale == 0) {
+			break;
+		}
+		
+		code = merge_load_sample_table(input, &stbl);
+		
+		break;
+	}
+	
+	free(moov);
+	
+	return code;
+	
+}
+
+static int merge_load_adts(struct MergeInput* const input) {
+	/*
+	Indexes the AAC frames of an ADTS file. The ID3 tags packed audio carries its
+	timestamps in are skipped.
+	*/
+	
+	unsigned char window[MERGE_WINDOW_SIZE];
+	uint64_t window_start = 0;
+	size_t window_size = 0;
+	int eof = 0;
+	
+	uint64_t position = 0;
+	uint64_t frames = 0;
+	
+	while (1) {
+		if (!eof && position + MERGE_ID3_HEADER_SIZE > window_start + window_size) {
+			if (!merge_seek(input, position)) {
+				return UERR_FSTREAM_FAILURE;
+			}
+			
+			const ssize_t size = fstream_read(input->stream, (char*) window, sizeof(window));
+			
+			if (size == -1) {
+				return UERR_FSTREAM_FAILURE;
+			}
+			
+			input->position += (uint64_t) size;
+			
+			window_start = position;
+			window_size = (size_t) size;
+			eof = window_size < sizeof(window);
+		}
+		
+		if (position >= window_start + window_size) {
+			break;
+		}
+		
+		const unsigned char* const data = window + (position - window_start);
+		const size_t available = (size_t) (window_start + window_size - position);
+		
+		if (available >= MERGE_ID3_HEADER_SIZE && memcmp(data, "ID3", 3) == 0) {
+			const uint64_t size = ((uint64_t) (data[6] & 0x7F) << 21) | ((data[7] & 0x7F) << 14) | ((data[8] & 0x7F) << 7) | (data[9] & 0x7F);
+			
+			position += MERGE_ID3_HEADER_SIZE + size + ((data[5] & 0x10) ? MERGE_ID3_HEADER_SIZE : 0);
+			
+			continue;
+		}
+		
+		struct ADTSHeader header = {0};
+		
+		if (adts_parse_header(data, available, &header) != UERR_SUCCESS) {
+			position++;
+			continue;
+		}
+		
+		if (header.blocks != 1) {
+			return UERR_UNSUPPORTED;
+		}
+		
+		if (input->config == NULL) {
+			unsigned char config[ADTS_CONFIG_SIZE];
+			adts_get_config(&header, config);
+			
+			const int code = merge_set_config(input, config, sizeof(config));
+			
+			if (code != UERR_SUCCESS) {
+				return code;
+			}
+			
+			input->timescale = header.sample_rate;
+			input->sample_rate = header.sample_rate;
+			input->channels = (uint16_t) header.channels;
+		}
+		
+		if (input->samples_offset == input->samples_size) {
+			const int code = merge_allocate_samples(input, (input->samples_size == 0) ? 4096 : input->samples_size * 2);
+			
+			if (code != UERR_SUCCESS) {
+				return code;
+			}
+		}
+		
+		struct MP4Sample* const sample = &input->samples[input->samples_offset];
+		
+		sample->dts = frames * ADTS_FRAME_SAMPLES;
+		sample->composition = 0;
+		sample->size = (uint32_t) (header.frame_size - header.header_size);
+		sample->sync = 1;
+		
+		input->positions[input->samples_offset++] = position + header.header_size;
+		
+		frames++;
+		position += header.frame_size;
+	}
+	
+	/*
+	The last frame may have been cut short.
+	*/
+	const uint64_t end = window_start + window_size;
+	
+	while (input->samples_offset > 0 && input->positions[input->samples_offset - 1] + input->samples[input->samples_offset - 1].size > end) {
+		input->samples_offset--;
+	}
+	
+	if (input->samples_offset == 0) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int merge_load(struct MergeInput* const input, const char* const filename) {
+	
+	input->stream = fstream_open(filename, "rb");
+	
+	if (input->stream == NULL) {
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	unsigned char header[8];
+	
+	if (!merge_read(input, header, sizeof(header))) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	if (memcmp(header + 4, "ftyp", 4) == 0) {
+		return merge_load_mp4(input);
+	}
+	
+	if (input->type == MP4_TRACK_AUDIO) {
+		return merge_load_adts(input);
+	}
+	
+	return UERR_UNSUPPORTED;
+	
+}
+
+static void merge_input_free(struct MergeInput* const input) {
+	
+	if (input->stream != NULL) {
+		fstream_close(input->stream);
+		input->stream = NULL;
+	}
+	
+	free(input->config);
+	input->config = NULL;
+	
+	free(input->samples);
+	input->samples = NULL;
+	
+	free(input->positions);
+	input->positions = NULL;
+	
+	input->samples_offset = 0;
+	input->samples_size = 0;
+	
+}
+
+static int merge_write(struct MP4Muxer* const muxer, struct MP4Track** const tracks, struct MergeInput* const inputs, const size_t count) {
+	/*
+	Queues the samples of all inputs, interleaved by their decoding time. While
+	the file is only being planned, their data is not even read.
+	*/
+	
+	size_t next[MP4_MAX_TRACKS] = {0};
+	
+	unsigned char* buffer = NULL;
+	size_t buffer_size = 0;
+	
+	int code = UERR_SUCCESS;
+	
+	while (code == UERR_SUCCESS) {
+		size_t selected = count;
+		double earliest = 0;
+		
+		for (size_t index = 0; index < count; index++) {
+			const struct MergeInput* const input = &inputs[index];
+			
+			if (next[index] == input->samples_offset) {
+				continue;
+			}
+			
+			const double time = (double) input->samples[next[index]].dts / input->timescale;
+			
+			if (selected == count || time < earliest) {
+				selected = index;
+				earliest = time;
+			}
+		}
+		
+		if (selected == count) {
+			break;
+		}
+		
+		struct MergeInput* const input = &inputs[selected];
+		const struct MP4Sample* const sample = &input->samples[next[selected]];
+		
+		if (!muxer->planning) {
+			if (buffer_size < sample->size) {
+				unsigned char* const destination = realloc(buffer, sample->size);
+				
+				if (destination == NULL) {
+					code = UERR_MEMORY_ALLOCATE_FAILURE;
+					break;
+				}
+				
+				buffer = destination;
+				buffer_size = sample->size;
+			}
+			
+			if (!merge_seek(input, input->positions[next[selected]]) || !merge_read(input, buffer, sample->size)) {
+				code = UERR_FSTREAM_FAILURE;
+				break;
+			}
+		}
+		
+		code = mp4_write_sample(muxer, tracks[selected], buffer, sample->size, sample->dts, sample->composition, sample->sync);
+		
+		next[selected]++;
+	}
+	
+	free(buffer);
+	
+	return code;
+	
+}
+
+static long long merge_get_presentation_start(const struct MergeInput* const input) {
+	/*
+	How long after the first sample decoded the first one presented is, in
+	microseconds; with B-frames, they are not the same.
+	*/
+	
+	int64_t start = INT64_MAX;
+	
+	for (size_t index = 0; index < input->samples_offset; index++) {
+		const struct MP4Sample* const sample = &input->samples[index];
+		const int64_t presentation = (int64_t) (sample->dts - input->samples[0].dts) + sample->composition;
+		
+		if (presentation < start) {
+			start = presentation;
+		}
+	}
+	
+	if (start <= 0) {
+		return 0;
+	}
+	
+	const uint64_t value = (uint64_t) start;
+	
+	return (long long) ((value / input->timescale) * 1000000 + ((value % input->timescale) * 1000000) / input->timescale);
+	
+}
+
+static int merge_mux(struct MP4Muxer* const muxer, struct MergeInput* const inputs, const size_t count, const char* const output) {
+	
+	int code = mp4_open(muxer, NULL, 0);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	struct MP4Track* tracks[MP4_MAX_TRACKS] = {NULL};
+	
+	for (size_t index = 0; index < count; index++) {
+		const struct MergeInput* const input = &inputs[index];
+		struct MP4Track* const track = mp4_add_track(muxer, input->type, input->timescale);
+		
+		if (track == NULL) {
+			return UERR_UNSUPPORTED;
+		}
+		
+		code = mp4_set_config(track, input->config, input->config_size);
+		
+		if (code != UERR_SUCCESS) {
+			return code;
+		}
+		
+		track->width = input->width;
+		track->height = input->height;
+		track->channels = input->channels;
+		track->sample_rate = input->sample_rate;
+		
+		/*
+		The renditions are cut to start together: the first sample presented of each
+		one goes at the very start of the movie.
+		*/
+		track->start_time = -merge_get_presentation_start(input);
+		
+		tracks[index] = track;
+	}
+	
+	/*
+	The file is laid out once without writing anything, so that its "moov" box
+	can go first; then it is written for real, front to back.
+	*/
+	code = merge_write(muxer, tracks, inputs, count);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	code = mp4_write_index(muxer, output);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	code = merge_write(muxer, tracks, inputs, count);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	return mp4_close(muxer);
+	
+}
+
+int merge_tracks(const char* const video, const char* const audio, const char* const output) {
+	/*
+	Muxes the video track of "video" and the audio track of "audio" into a single
+	MP4 file at "output", written in a single sequential pass with its "moov" box
+	up front.
+	
+	Returns UERR_UNSUPPORTED, before creating anything, when either file can not
+	be read: the video has to be H.264 in an MP4 file, and the audio AAC in an
+	MP4 or ADTS file.
+	*/
+	
+	struct MergeInput inputs[] = {
+		{
+			.type = MP4_TRACK_VIDEO
+		},
+		{
+			.type = MP4_TRACK_AUDIO
+		}
+	};
+	
+	const char* const filenames[] = {video, audio};
+	
+	int code = UERR_SUCCESS;
+	
+	for (size_t index = 0; index < sizeof(inputs) / sizeof(*inputs) && code == UERR_SUCCESS; index++) {
+		code = merge_load(&inputs[index], filenames[index]);
+	}
+	
+	struct MP4Muxer muxer = {0};
+	
+	if (code == UERR_SUCCESS) {
+		code = merge_mux(&muxer, inputs, sizeof(inputs) / sizeof(*inputs), output);
+	}
+	
+	mp4_free(&muxer);
+	
+	for (size_t index = 0; index < sizeof(inputs) / sizeof(*inputs); index++) {
+		merge_input_free(&inputs[index]);
+	}
+	
+	return code;
+	
+}
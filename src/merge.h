@@ -0,0 +1,30 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "fstream.h"
+#include "mp4.h"
+
+/*
+A track read from an existing file. "positions" tells where in the file each of
+its samples is, and "position" is where "stream" is currently at.
+*/
+struct MergeInput {
+	struct FStream* stream;
+	enum MP4TrackType type;
+	uint32_t timescale;
+	uint16_t width;
+	uint16_t height;
+	uint16_t channels;
+	uint32_t sample_rate;
+	unsigned char* config;
+	size_t config_size;
+	struct MP4Sample* samples;
+	uint64_t* positions;
+	size_t samples_offset;
+	size_t samples_size;
+	uint64_t position;
+};
+
+int merge_tracks(const char* const video, const char* const audio, const char* const output);
+
+#pragma once
@@ -0,0 +1,1087 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mp4.h"
+#include "fstream.h"
+#include "errors.h"
+
+/*
+Samples queued across all tracks are written to the file once there are at
+least this many bytes of them, one chunk per track. This keeps the tracks
+interleaved closely enough for playback while the file is read, without a
+chunk table entry for every single sample.
+*/
+#define MP4_CHUNK_SIZE (1024 * 1024)
+
+/*
+Timescale of the movie header and edit lists (milliseconds).
+*/
+#define MP4_MOVIE_TIMESCALE 1000
+
+struct MP4Buffer {
+	unsigned char* data;
+	size_t offset;
+	size_t size;
+	int failed;
+};
+
+static const unsigned char MP4_MATRIX[36] = {
+	0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00
+};
+
+static void buffer_put(struct MP4Buffer* const buffer, const void* const data, const size_t size) {
+	
+	if (buffer->failed) {
+		return;
+	}
+	
+	if (buffer->size - buffer->offset < size) {
+		size_t capacity = (buffer->size == 0) ? 4096 : buffer->size;
+		
+		while (capacity - buffer->offset < size) {
+			capacity *= 2;
+		}
+		
+		unsigned char* const destination = realloc(buffer->data, capacity);
+		
+		if (destination == NULL) {
+			buffer->failed = 1;
+			return;
+		}
+		
+		buffer->data = destination;
+		buffer->size = capacity;
+	}
+	
+	if (data == NULL) {
+		memset(buffer->data + buffer->offset, 0, size);
+	} else {
+		memcpy(buffer->data + buffer->offset, data, size);
+	}
+	
+	buffer->offset += size;
+	
+}
+
+static void buffer_put_u8(struct MP4Buffer* const buffer, const uint8_t value) {
+	
+	buffer_put(buffer, &value, sizeof(value));
+	
+}
+
+static void buffer_put_u16(struct MP4Buffer* const buffer, const uint16_t value) {
+	
+	const unsigned char data[] = {
+		(unsigned char) (value >> 8),
+		(unsigned char) value
+	};
+	
+	buffer_put(buffer, data, sizeof(data));
+	
+}
+
+static void buffer_put_u32(struct MP4Buffer* const buffer, const uint32_t value) {
+	
+	const unsigned char data[] = {
+		(unsigned char) (value >> 24),
+		(unsigned char) (value >> 16),
+		(unsigned char) (value >> 8),
+		(unsigned char) value
+	};
+	
+	buffer_put(buffer, data, sizeof(data));
+	
+}
+
+static void buffer_put_u64(struct MP4Buffer* const buffer, const uint64_t value) {
+	
+	buffer_put_u32(buffer, (uint32_t) (value >> 32));
+	buffer_put_u32(buffer, (uint32_t) value);
+	
+}
+
+static void buffer_put_zeros(struct MP4Buffer* const buffer, const size_t size) {
+	
+	buffer_put(buffer, NULL, size);
+	
+}
+
+static size_t box_start(struct MP4Buffer* const buffer, const char* const type) {
+	/*
+	Starts a box whose size is only known once box_end() is called.
+	*/
+	
+	const size_t start = buffer->offset;
+	
+	buffer_put_u32(buffer, 0);
+	buffer_put(buffer, type, 4);
+	
+	return start;
+	
+}
+
+static size_t full_box_start(struct MP4Buffer* const buffer, const char* const type, const uint8_t version, const uint32_t flags) {
+	
+	const size_t start = box_start(buffer, type);
+	
+	buffer_put_u32(buffer, ((uint32_t) version << 24) | (flags & 0x00FFFFFF));
+	
+	return start;
+	
+}
+
+static void box_end(struct MP4Buffer* const buffer, const size_t start) {
+	
+	if (buffer->failed) {
+		return;
+	}
+	
+	const uint32_t size = (uint32_t) (buffer->offset - start);
+	
+	buffer->data[start + 0] = (unsigned char) (size >> 24);
+	buffer->data[start + 1] = (unsigned char) (size >> 16);
+	buffer->data[start + 2] = (unsigned char) (size >> 8);
+	buffer->data[start + 3] = (unsigned char) size;
+	
+}
+
+static int mp4_write(struct MP4Muxer* const muxer, const void* const data, const size_t size) {
+	
+	if (muxer->planning) {
+		muxer->position += size;
+		return UERR_SUCCESS;
+	}
+	
+	if (!fstream_write(muxer->stream, (const char*) data, size)) {
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	muxer->position += size;
+	
+	return UERR_SUCCESS;
+	
+}
+
+static uint32_t mp4_get_sample_duration(const struct MP4Track* const track, const size_t index) {
+	/*
+	The last sample lasts as long as the one before it.
+	*/
+	
+	if (track->samples_offset < 2) {
+		return 0;
+	}
+	
+	if (index + 1 < track->samples_offset) {
+		return (uint32_t) (track->samples[index + 1].dts - track->samples[index].dts);
+	}
+	
+	return mp4_get_sample_duration(track, index - 1);
+	
+}
+
+static uint64_t mp4_get_media_duration(const struct MP4Track* const track) {
+	
+	if (track->samples_offset == 0) {
+		return 0;
+	}
+	
+	const struct MP4Sample* const last = &track->samples[track->samples_offset - 1];
+	
+	return last->dts + mp4_get_sample_duration(track, track->samples_offset - 1) - track->samples[0].dts;
+	
+}
+
+static uint64_t mp4_get_media_end(const struct MP4Track* const track) {
+	/*
+	How far into the media the last presented sample ends; with B-frames, it is
+	not the last one decoded.
+	*/
+	
+	uint64_t end = 0;
+	
+	for (size_t index = 0; index < track->samples_offset; index++) {
+		const struct MP4Sample* const sample = &track->samples[index];
+		const int64_t presentation = (int64_t) (sample->dts - track->samples[0].dts) + sample->composition + mp4_get_sample_duration(track, index);
+		
+		if (presentation > 0 && (uint64_t) presentation > end) {
+			end = (uint64_t) presentation;
+		}
+	}
+	
+	return end;
+	
+}
+
+static uint64_t mp4_get_media_start(const struct MP4Track* const track) {
+	/*
+	How far into the media the first presented sample is; with B-frames, it is
+	not the first one decoded.
+	*/
+	
+	if (track->samples_offset == 0) {
+		return 0;
+	}
+	
+	int64_t start = INT64_MAX;
+	
+	for (size_t index = 0; index < track->samples_offset; index++) {
+		const struct MP4Sample* const sample = &track->samples[index];
+		const int64_t presentation = (int64_t) (sample->dts - track->samples[0].dts) + sample->composition;
+		
+		if (presentation < start) {
+			start = presentation;
+		}
+	}
+	
+	return (start < 0) ? 0 : (uint64_t) start;
+	
+}
+
+static uint64_t mp4_rescale(const uint64_t value, const uint32_t from, const uint32_t to) {
+	
+	return (value / from) * to + ((value % from) * to) / from;
+	
+}
+
+static void mp4_write_ftyp(struct MP4Buffer* const buffer) {
+	
+	const size_t box = box_start(buffer, "ftyp");
+	
+	buffer_put(buffer, "isom", 4);
+	buffer_put_u32(buffer, 0x200);
+	buffer_put(buffer, "isom", 4);
+	buffer_put(buffer, "iso2", 4);
+	buffer_put(buffer, "avc1", 4);
+	buffer_put(buffer, "mp41", 4);
+	
+	box_end(buffer, box);
+	
+}
+
+static void mp4_write_stsd(struct MP4Buffer* const buffer, const struct MP4Track* const track) {
+	
+	const size_t stsd = full_box_start(buffer, "stsd", 0, 0);
+	buffer_put_u32(buffer, 1);
+	
+	if (track->type == MP4_TRACK_VIDEO) {
+		const size_t avc1 = box_start(buffer, "avc1");
+		
+		buffer_put_zeros(buffer, 6);
+		buffer_put_u16(buffer, 1);
+		buffer_put_zeros(buffer, 16);
+		buffer_put_u16(buffer, track->width);
+		buffer_put_u16(buffer, track->height);
+		buffer_put_u32(buffer, 0x00480000);
+		buffer_put_u32(buffer, 0x00480000);
+		buffer_put_u32(buffer, 0);
+		buffer_put_u16(buffer, 1);
+		buffer_put_zeros(buffer, 32);
+		buffer_put_u16(buffer, 0x0018);
+		buffer_put_u16(buffer, 0xFFFF);
+		
+		const size_t avcc = box_start(buffer, "avcC");
+		buffer_put(buffer, track->config, track->config_size);
+		box_end(buffer, avcc);
+		
+		box_end(buffer, avc1);
+	} else {
+		const size_t mp4a = box_start(buffer, "mp4a");
+		
+		buffer_put_zeros(buffer, 6);
+		buffer_put_u16(buffer, 1);
+		buffer_put_zeros(buffer, 8);
+		buffer_put_u16(buffer, track->channels);
+		buffer_put_u16(buffer, 16);
+		buffer_put_zeros(buffer, 4);
+		buffer_put_u32(buffer, (track->sample_rate < 0x10000) ? track->sample_rate << 16 : 0);
+		
+		/*
+		An ES descriptor wrapping the decoder configuration; every descriptor here is
+		small enough for a single byte length.
+		*/
+		const size_t esds = full_box_start(buffer, "esds", 0, 0);
+		
+		const uint8_t decoder_specific_size = (uint8_t) track->config_size;
+		const uint8_t decoder_config_size = (uint8_t) (13 + 2 + decoder_specific_size);
+		const uint8_t es_size = (uint8_t) (3 + 2 + decoder_config_size + 2 + 1);
+		
+		buffer_put_u8(buffer, 0x03);
+		buffer_put_u8(buffer, es_size);
+		buffer_put_u16(buffer, 0);
+		buffer_put_u8(buffer, 0);
+		
+		buffer_put_u8(buffer, 0x04);
+		buffer_put_u8(buffer, decoder_config_size);
+		buffer_put_u8(buffer, 0x40);
+		buffer_put_u8(buffer, 0x15);
+		buffer_put_zeros(buffer, 3);
+		buffer_put_u32(buffer, 0);
+		buffer_put_u32(buffer, 0);
+		
+		buffer_put_u8(buffer, 0x05);
+		buffer_put_u8(buffer, decoder_specific_size);
+		buffer_put(buffer, track->config, track->config_size);
+		
+		buffer_put_u8(buffer, 0x06);
+		buffer_put_u8(buffer, 1);
+		buffer_put_u8(buffer, 0x02);
+		
+		box_end(buffer, esds);
+		
+		box_end(buffer, mp4a);
+	}
+	
+	box_end(buffer, stsd);
+	
+}
+
+static void mp4_write_stbl(struct MP4Buffer* const buffer, const struct MP4Track* const track) {
+	
+	const size_t stbl = box_start(buffer, "stbl");
+	
+	mp4_write_stsd(buffer, track);
+	
+	/*
+	Runs of samples with the same duration.
+	*/
+	size_t position = 0;
+	size_t entries = 0;
+	
+	const size_t stts = full_box_start(buffer, "stts", 0, 0);
+	
+	position = buffer->offset;
+	buffer_put_u32(buffer, 0);
+	
+	for (size_t index = 0; index < track->samples_offset;) {
+		const uint32_t duration = mp4_get_sample_duration(track, index);
+		
+		size_t count = 1;
+		
+		while (index + count < track->samples_offset && mp4_get_sample_duration(track, index + count) == duration) {
+			count++;
+		}
+		
+		buffer_put_u32(buffer, (uint32_t) count);
+		buffer_put_u32(buffer, duration);
+		
+		entries++;
+		index += count;
+	}
+	
+	if (!buffer->failed) {
+		const size_t end = buffer->offset;
+		
+		buffer->offset = position;
+		buffer_put_u32(buffer, (uint32_t) entries);
+		buffer->offset = end;
+	}
+	
+	box_end(buffer, stts);
+	
+	/*
+	Runs of samples with the same composition offset; only needed with B-frames.
+	*/
+	int reordered = 0;
+	int negative = 0;
+	
+	for (size_t index = 0; index < track->samples_offset; index++) {
+		reordered |= track->samples[index].composition != 0;
+		negative |= track->samples[index].composition < 0;
+	}
+	
+	if (reordered) {
+		const size_t ctts = full_box_start(buffer, "ctts", negative ? 1 : 0, 0);
+		
+		position = buffer->offset;
+		entries = 0;
+		
+		buffer_put_u32(buffer, 0);
+		
+		for (size_t index = 0; index < track->samples_offset;) {
+			const int32_t composition = track->samples[index].composition;
+			
+			size_t count = 1;
+			
+			while (index + count < track->samples_offset && track->samples[index + count].composition == composition) {
+				count++;
+			}
+			
+			buffer_put_u32(buffer, (uint32_t) count);
+			buffer_put_u32(buffer, (uint32_t) composition);
+			
+			entries++;
+			index += count;
+		}
+		
+		if (!buffer->failed) {
+			const size_t end = buffer->offset;
+			
+			buffer->offset = position;
+			buffer_put_u32(buffer, (uint32_t) entries);
+			buffer->offset = end;
+		}
+		
+		box_end(buffer, ctts);
+	}
+	
+	/*
+	Every sample is a sync sample unless told otherwise.
+	*/
+	if (track->type == MP4_TRACK_VIDEO) {
+		const size_t stss = full_box_start(buffer, "stss", 0, 0);
+		
+		position = buffer->offset;
+		entries = 0;
+		
+		buffer_put_u32(buffer, 0);
+		
+		for (size_t index = 0; index < track->samples_offset; index++) {
+			if (track->samples[index].sync) {
+				buffer_put_u32(buffer, (uint32_t) index + 1);
+				entries++;
+			}
+		}
+		
+		if (!buffer->failed) {
+			const size_t end = buffer->offset;
+			
+			buffer->offset = position;
+			buffer_put_u32(buffer, (uint32_t) entries);
+			buffer->offset = end;
+		}
+		
+		box_end(buffer, stss);
+	}
+	
+	/*
+	Runs of chunks with the same number of samples.
+	*/
+	const size_t stsc = full_box_start(buffer, "stsc", 0, 0);
+	
+	position = buffer->offset;
+	entries = 0;
+	
+	buffer_put_u32(buffer, 0);
+	
+	for (size_t index = 0; index < track->chunks_offset; index++) {
+		if (index > 0 && track->chunks[index].samples == track->chunks[index - 1].samples) {
+			continue;
+		}
+		
+		buffer_put_u32(buffer, (uint32_t) index + 1);
+		buffer_put_u32(buffer, track->chunks[index].samples);
+		buffer_put_u32(buffer, 1);
+		
+		entries++;
+	}
+	
+	if (!buffer->failed) {
+		const size_t end = buffer->offset;
+		
+		buffer->offset = position;
+		buffer_put_u32(buffer, (uint32_t) entries);
+		buffer->offset = end;
+	}
+	
+	box_end(buffer, stsc);
+	
+	const size_t stsz = full_box_start(buffer, "stsz", 0, 0);
+	
+	buffer_put_u32(buffer, 0);
+	buffer_put_u32(buffer, (uint32_t) track->samples_offset);
+	
+	for (size_t index = 0; index < track->samples_offset; index++) {
+		buffer_put_u32(buffer, track->samples[index].size);
+	}
+	
+	box_end(buffer, stsz);
+	
+	const size_t co64 = full_box_start(buffer, "co64", 0, 0);
+	
+	buffer_put_u32(buffer, (uint32_t) track->chunks_offset);
+	
+	for (size_t index = 0; index < track->chunks_offset; index++) {
+		buffer_put_u64(buffer, track->chunks[index].position);
+	}
+	
+	box_end(buffer, co64);
+	
+	box_end(buffer, stbl);
+	
+}
+
+static void mp4_write_trak(struct MP4Buffer* const buffer, const struct MP4Track* const track, const uint32_t id, const uint64_t delay) {
+	/*
+	"delay" is how long after the start of the movie the track starts, in the
+	movie timescale.
+	*/
+	
+	const uint64_t media_duration = mp4_get_media_duration(track);
+	const uint64_t media_start = mp4_get_media_start(track);
+	const uint64_t media_end = mp4_get_media_end(track);
+	const uint64_t duration = mp4_rescale(media_end - media_start, track->timescale, MP4_MOVIE_TIMESCALE);
+	
+	const size_t trak = box_start(buffer, "trak");
+	
+	const size_t tkhd = full_box_start(buffer, "tkhd", 0, 0x000003);
+	
+	buffer_put_u32(buffer, 0);
+	buffer_put_u32(buffer, 0);
+	buffer_put_u32(buffer, id);
+	buffer_put_u32(buffer, 0);
+	buffer_put_u32(buffer, (uint32_t) (delay + duration));
+	buffer_put_zeros(buffer, 8);
+	buffer_put_u16(buffer, 0);
+	buffer_put_u16(buffer, 0);
+	buffer_put_u16(buffer, (track->type == MP4_TRACK_AUDIO) ? 0x0100 : 0);
+	buffer_put_u16(buffer, 0);
+	buffer_put(buffer, MP4_MATRIX, sizeof(MP4_MATRIX));
+	buffer_put_u32(buffer, (uint32_t) track->width << 16);
+	buffer_put_u32(buffer, (uint32_t) track->height << 16);
+	
+	box_end(buffer, tkhd);
+	
+	/*
+	An empty edit for the time before the track starts, then one skipping to its
+	first presented sample.
+	*/
+	const size_t edts = box_start(buffer, "edts");
+	const size_t elst = full_box_start(buffer, "elst", 0, 0);
+	
+	buffer_put_u32(buffer, (delay > 0) ? 2 : 1);
+	
+	if (delay > 0) {
+		buffer_put_u32(buffer, (uint32_t) delay);
+		buffer_put_u32(buffer, UINT32_MAX);
+		buffer_put_u32(buffer, 0x00010000);
+	}
+	
+	buffer_put_u32(buffer, (uint32_t) duration);
+	buffer_put_u32(buffer, (uint32_t) media_start);
+	buffer_put_u32(buffer, 0x00010000);
+	
+	box_end(buffer, elst);
+	box_end(buffer, edts);
+	
+	const size_t mdia = box_start(buffer, "mdia");
+	
+	const size_t mdhd = full_box_start(buffer, "mdhd", 0, 0);
+	
+	buffer_put_u32(buffer, 0);
+	buffer_put_u32(buffer, 0);
+	buffer_put_u32(buffer, track->timescale);
+	buffer_put_u32(buffer, (uint32_t) media_duration);
+	buffer_put_u16(buffer, 0x55C4);
+	buffer_put_u16(buffer, 0);
+	
+	box_end(buffer, mdhd);
+	
+	const size_t hdlr = full_box_start(buffer, "hdlr", 0, 0);
+	
+	buffer_put_u32(buffer, 0);
+	
+	if (track->type == MP4_TRACK_VIDEO) {
+		buffer_put(buffer, "vide", 4);
+		buffer_put_zeros(buffer, 12);
+		buffer_put(buffer, "VideoHandler", sizeof("VideoHandler"));
+	} else {
+		buffer_put(buffer, "soun", 4);
+		buffer_put_zeros(buffer, 12);
+		buffer_put(buffer, "SoundHandler", sizeof("SoundHandler"));
+	}
+	
+	box_end(buffer, hdlr);
+	
+	const size_t minf = box_start(buffer, "minf");
+	
+	if (track->type == MP4_TRACK_VIDEO) {
+		const size_t vmhd = full_box_start(buffer, "vmhd", 0, 0x000001);
+		buffer_put_zeros(buffer, 8);
+		box_end(buffer, vmhd);
+	} else {
+		const size_t smhd = full_box_start(buffer, "smhd", 0, 0);
+		buffer_put_zeros(buffer, 4);
+		box_end(buffer, smhd);
+	}
+	
+	const size_t dinf = box_start(buffer, "dinf");
+	const size_t dref = full_box_start(buffer, "dref", 0, 0);
+	
+	buffer_put_u32(buffer, 1);
+	
+	const size_t url = full_box_start(buffer, "url ", 0, 0x000001);
+	box_end(buffer, url);
+	
+	box_end(buffer, dref);
+	box_end(buffer, dinf);
+	
+	mp4_write_stbl(buffer, track);
+	
+	box_end(buffer, minf);
+	box_end(buffer, mdia);
+	box_end(buffer, trak);
+	
+}
+
+static void mp4_write_moov(struct MP4Buffer* const buffer, const struct MP4Muxer* const muxer) {
+	
+	/*
+	Tracks are lined up by when their first sample is presented; the one that
+	starts first starts the movie.
+	*/
+	long long starts[MP4_MAX_TRACKS] = {0};
+	long long origin = 0;
+	int has_origin = 0;
+	
+	for (size_t index = 0; index < muxer->tracks_offset; index++) {
+		const struct MP4Track* const track = &muxer->tracks[index];
+		
+		if (track->samples_offset == 0) {
+			continue;
+		}
+		
+		starts[index] = track->start_time + (long long) mp4_rescale(mp4_get_media_start(track), track->timescale, 1000000);
+		
+		if (!has_origin || starts[index] < origin) {
+			origin = starts[index];
+			has_origin = 1;
+		}
+	}
+	
+	uint64_t duration = 0;
+	uint64_t delays[MP4_MAX_TRACKS] = {0};
+	
+	for (size_t index = 0; index < muxer->tracks_offset; index++) {
+		const struct MP4Track* const track = &muxer->tracks[index];
+		
+		if (track->samples_offset == 0) {
+			continue;
+		}
+		
+		delays[index] = (uint64_t) (starts[index] - origin) / (1000000 / MP4_MOVIE_TIMESCALE);
+		
+		const uint64_t end = delays[index] + mp4_rescale(mp4_get_media_end(track) - mp4_get_media_start(track), track->timescale, MP4_MOVIE_TIMESCALE);
+		
+		if (end > duration) {
+			duration = end;
+		}
+	}
+	
+	const size_t moov = box_start(buffer, "moov");
+	
+	const size_t mvhd = full_box_start(buffer, "mvhd", 0, 0);
+	
+	buffer_put_u32(buffer, 0);
+	buffer_put_u32(buffer, 0);
+	buffer_put_u32(buffer, MP4_MOVIE_TIMESCALE);
+	buffer_put_u32(buffer, (uint32_t) duration);
+	buffer_put_u32(buffer, 0x00010000);
+	buffer_put_u16(buffer, 0x0100);
+	buffer_put_zeros(buffer, 10);
+	buffer_put(buffer, MP4_MATRIX, sizeof(MP4_MATRIX));
+	buffer_put_zeros(buffer, 24);
+	buffer_put_u32(buffer, (uint32_t) muxer->tracks_offset + 1);
+	
+	box_end(buffer, mvhd);
+	
+	uint32_t id = 1;
+	
+	for (size_t index = 0; index < muxer->tracks_offset; index++) {
+		const struct MP4Track* const track = &muxer->tracks[index];
+		
+		if (track->samples_offset == 0) {
+			continue;
+		}
+		
+		mp4_write_trak(buffer, track, id++, delays[index]);
+	}
+	
+	box_end(buffer, moov);
+	
+}
+
+int mp4_open(struct MP4Muxer* const muxer, const char* const filename, const uint64_t reserve) {
+	/*
+	Creates the file, with "reserve" bytes set aside for the "moov" box (none if
+	zero). Without a filename, the file is only planned; see mp4_write_index().
+	*/
+	
+	if (filename == NULL) {
+		muxer->planning = 1;
+	} else {
+		muxer->stream = fstream_open(filename, "wb");
+		
+		if (muxer->stream == NULL) {
+			return UERR_FSTREAM_FAILURE;
+		}
+	}
+	
+	struct MP4Buffer buffer = {0};
+	
+	mp4_write_ftyp(&buffer);
+	
+	const size_t ftyp_size = buffer.offset;
+	
+	if (reserve >= 8 && reserve <= UINT32_MAX) {
+		buffer_put_u32(&buffer, (uint32_t) reserve);
+		buffer_put(&buffer, "free", 4);
+		buffer_put_zeros(&buffer, (size_t) reserve - 8);
+		
+		muxer->reserved = reserve;
+	}
+	
+	/*
+	The size of "mdat" is only known in the end; it is patched then.
+	*/
+	buffer_put_u32(&buffer, 1);
+	buffer_put(&buffer, "mdat", 4);
+	buffer_put_u64(&buffer, 0);
+	
+	if (buffer.failed) {
+		free(buffer.data);
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	muxer->mdat = ftyp_size + muxer->reserved;
+	
+	const int code = mp4_write(muxer, buffer.data, buffer.offset);
+	
+	free(buffer.data);
+	
+	return code;
+	
+}
+
+struct MP4Track* mp4_add_track(struct MP4Muxer* const muxer, const enum MP4TrackType type, const uint32_t timescale) {
+	
+	if (muxer->tracks_offset == MP4_MAX_TRACKS) {
+		return NULL;
+	}
+	
+	struct MP4Track* const track = &muxer->tracks[muxer->tracks_offset++];
+	
+	memset(track, 0, sizeof(*track));
+	
+	track->type = type;
+	track->timescale = timescale;
+	
+	return track;
+	
+}
+
+int mp4_set_config(struct MP4Track* const track, const unsigned char* const config, const size_t size) {
+	
+	unsigned char* const destination = realloc(track->config, size);
+	
+	if (destination == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	memcpy(destination, config, size);
+	
+	track->config = destination;
+	track->config_size = size;
+	
+	return UERR_SUCCESS;
+	
+}
+
+int mp4_write_sample(struct MP4Muxer* const muxer, struct MP4Track* const track, const unsigned char* const data, const size_t size, const uint64_t dts, const int32_t composition, const int sync) {
+	/*
+	Queues a sample of the track. Samples of a track must come in decoding order.
+	While planning, only the size of the sample matters ("data" may be NULL).
+	*/
+	
+	if (track->samples_offset == track->samples_size) {
+		const size_t capacity = (track->samples_size == 0) ? 1024 : track->samples_size * 2;
+		
+		struct MP4Sample* const samples = realloc(track->samples, capacity * sizeof(*samples));
+		
+		if (samples == NULL) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		track->samples = samples;
+		track->samples_size = capacity;
+	}
+	
+	if (!muxer->planning && track->pending_size - track->pending_offset < size) {
+		size_t capacity = (track->pending_size == 0) ? MP4_CHUNK_SIZE : track->pending_size;
+		
+		while (capacity - track->pending_offset < size) {
+			capacity *= 2;
+		}
+		
+		unsigned char* const pending = realloc(track->pending, capacity);
+		
+		if (pending == NULL) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		track->pending = pending;
+		track->pending_size = capacity;
+	}
+	
+	if (!muxer->planning) {
+		memcpy(track->pending + track->pending_offset, data, size);
+	}
+	
+	track->pending_offset += size;
+	track->pending_samples++;
+	
+	struct MP4Sample* const sample = &track->samples[track->samples_offset++];
+	
+	sample->dts = dts;
+	sample->composition = composition;
+	sample->size = (uint32_t) size;
+	sample->sync = sync;
+	
+	muxer->pending += size;
+	
+	if (muxer->pending >= MP4_CHUNK_SIZE) {
+		return mp4_flush(muxer);
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+int mp4_flush(struct MP4Muxer* const muxer) {
+	/*
+	Writes the queued samples of each track as a chunk.
+	*/
+	
+	for (size_t index = 0; index < muxer->tracks_offset; index++) {
+		struct MP4Track* const track = &muxer->tracks[index];
+		
+		if (track->pending_samples == 0) {
+			continue;
+		}
+		
+		if (track->chunks_offset == track->chunks_size) {
+			const size_t capacity = (track->chunks_size == 0) ? 256 : track->chunks_size * 2;
+			
+			struct MP4Chunk* const chunks = realloc(track->chunks, capacity * sizeof(*chunks));
+			
+			if (chunks == NULL) {
+				return UERR_MEMORY_ALLOCATE_FAILURE;
+			}
+			
+			track->chunks = chunks;
+			track->chunks_size = capacity;
+		}
+		
+		struct MP4Chunk* const chunk = &track->chunks[track->chunks_offset++];
+		
+		chunk->position = muxer->position;
+		chunk->samples = track->pending_samples;
+		
+		const int code = mp4_write(muxer, track->pending, track->pending_offset);
+		
+		if (code != UERR_SUCCESS) {
+			return code;
+		}
+		
+		track->pending_offset = 0;
+		track->pending_samples = 0;
+	}
+	
+	muxer->pending = 0;
+	
+	return UERR_SUCCESS;
+	
+}
+
+int mp4_write_index(struct MP4Muxer* const muxer, const char* const filename) {
+	/*
+	Ends the planning of the file: creates it with the "moov" box of the samples
+	queued so far, followed by the header of "mdat". The very same samples then
+	have to be written again, in the same order, before mp4_close().
+	*/
+	
+	int code = mp4_flush(muxer);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	struct MP4Buffer buffer = {0};
+	
+	mp4_write_ftyp(&buffer);
+	
+	const size_t ftyp_size = buffer.offset;
+	
+	mp4_write_moov(&buffer, muxer);
+	
+	const size_t moov_size = buffer.offset - ftyp_size;
+	
+	/*
+	Chunk offsets are always 64 bits wide, so moving the media after the box does
+	not change its size.
+	*/
+	for (size_t index = 0; index < muxer->tracks_offset; index++) {
+		struct MP4Track* const track = &muxer->tracks[index];
+		
+		for (size_t chunk = 0; chunk < track->chunks_offset; chunk++) {
+			track->chunks[chunk].position += moov_size;
+		}
+	}
+	
+	buffer.offset = ftyp_size;
+	
+	mp4_write_moov(&buffer, muxer);
+	
+	const uint64_t mdat_size = muxer->position - muxer->mdat;
+	
+	buffer_put_u32(&buffer, 1);
+	buffer_put(&buffer, "mdat", 4);
+	buffer_put_u64(&buffer, mdat_size);
+	
+	if (buffer.failed) {
+		free(buffer.data);
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	muxer->stream = fstream_open(filename, "wb");
+	
+	if (muxer->stream == NULL) {
+		free(buffer.data);
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	muxer->planning = 0;
+	muxer->position = 0;
+	muxer->mdat = ftyp_size + moov_size;
+	muxer->planned = muxer->mdat + mdat_size;
+	
+	/*
+	The samples are queued again as they are written.
+	*/
+	for (size_t index = 0; index < muxer->tracks_offset; index++) {
+		struct MP4Track* const track = &muxer->tracks[index];
+		
+		track->samples_offset = 0;
+		track->chunks_offset = 0;
+	}
+	
+	code = mp4_write(muxer, buffer.data, buffer.offset);
+	
+	free(buffer.data);
+	
+	return code;
+	
+}
+
+int mp4_close(struct MP4Muxer* const muxer) {
+	/*
+	Writes what is left of the samples and the "moov" box, and closes the file.
+	*/
+	
+	int code = mp4_flush(muxer);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	/*
+	The "moov" box is already there; the media just has to match it.
+	*/
+	if (muxer->planned > 0) {
+		const int status = fstream_close(muxer->stream);
+		muxer->stream = NULL;
+		
+		if (muxer->position != muxer->planned) {
+			return UERR_FAILURE;
+		}
+		
+		return status ? UERR_SUCCESS : UERR_FSTREAM_FAILURE;
+	}
+	
+	struct MP4Buffer buffer = {0};
+	
+	mp4_write_moov(&buffer, muxer);
+	
+	if (buffer.failed) {
+		free(buffer.data);
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	const uint64_t mdat_size = muxer->position - muxer->mdat;
+	
+	/*
+	What is left of the reserved space has to make up a "free" box of its own.
+	*/
+	const int fits = buffer.offset == muxer->reserved || buffer.offset + 8 <= muxer->reserved;
+	
+	if (fits) {
+		const uint64_t remainder = muxer->reserved - buffer.offset;
+		
+		if (remainder > 0) {
+			buffer_put_u32(&buffer, (uint32_t) remainder);
+			buffer_put(&buffer, "free", 4);
+		}
+		
+		if (buffer.failed || !fstream_seek(muxer->stream, (long long) (muxer->mdat - muxer->reserved), FSTREAM_SEEK_BEGIN)) {
+			code = buffer.failed ? UERR_MEMORY_ALLOCATE_FAILURE : UERR_FSTREAM_FAILURE;
+		}
+	}
+	
+	if (code == UERR_SUCCESS) {
+		code = mp4_write(muxer, buffer.data, buffer.offset);
+	}
+	
+	free(buffer.data);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	struct MP4Buffer header = {0};
+	buffer_put_u64(&header, mdat_size);
+	
+	if (header.failed) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	if (!fstream_seek(muxer->stream, (long long) (muxer->mdat + 8), FSTREAM_SEEK_BEGIN)) {
+		free(header.data);
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	code = mp4_write(muxer, header.data, header.offset);
+	
+	free(header.data);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	const int status = fstream_close(muxer->stream);
+	muxer->stream = NULL;
+	
+	return status ? UERR_SUCCESS : UERR_FSTREAM_FAILURE;
+	
+}
+
+void mp4_free(struct MP4Muxer* const muxer) {
+	
+	if (muxer->stream != NULL) {
+		fstream_close(muxer->stream);
+		muxer->stream = NULL;
+	}
+	
+	for (size_t index = 0; index < muxer->tracks_offset; index++) {
+		struct MP4Track* const track = &muxer->tracks[index];
+		
+		free(track->config);
+		free(track->samples);
+		free(track->chunks);
+		free(track->pending);
+	}
+	
+	memset(muxer, 0, sizeof(*muxer));
+	
+}
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "fstream.h"
+
+#define MP4_MAX_TRACKS 2
+
+enum MP4TrackType {
+	MP4_TRACK_VIDEO,
+	MP4_TRACK_AUDIO
+};
+
+/*
+"dts" is in units of the track's timescale, and "composition" is how much later
+than that the sample is presented.
+*/
+struct MP4Sample {
+	uint64_t dts;
+	int32_t composition;
+	uint32_t size;
+	int sync;
+};
+
+struct MP4Chunk {
+	uint64_t position;
+	uint32_t samples;
+};
+
+/*
+A track of the movie. "config" is its decoder configuration: the payload of an
+"avcC" box for H.264, or the AudioSpecificConfig for AAC. "start_time" is the
+decoding time of its first sample, in microseconds, on a clock shared by all
+tracks.
+
+Samples are queued in "pending" until they are written to the file as a chunk.
+*/
+struct MP4Track {
+	enum MP4TrackType type;
+	uint32_t timescale;
+	long long start_time;
+	uint16_t width;
+	uint16_t height;
+	uint16_t channels;
+	uint32_t sample_rate;
+	unsigned char* config;
+	size_t config_size;
+	struct MP4Sample* samples;
+	size_t samples_offset;
+	size_t samples_size;
+	struct MP4Chunk* chunks;
+	size_t chunks_offset;
+	size_t chunks_size;
+	unsigned char* pending;
+	size_t pending_offset;
+	size_t pending_size;
+	uint32_t pending_samples;
+};
+
+/*
+Writes an MP4 file in a single pass: samples go straight into the "mdat" box as
+they come, while the "moov" box, which can only be built once all of them are
+known, goes into the space "reserved" for it before "mdat" whenever it fits
+there (so players can start before the whole file is read), or after it
+otherwise.
+
+When all samples are known beforehand, the file can instead be "planning" first:
+samples are laid out without writing anything, so the "moov" box can be written
+right away, ahead of them. "planned" is then the size the file has to end up
+with.
+*/
+struct MP4Muxer {
+	struct FStream* stream;
+	struct MP4Track tracks[MP4_MAX_TRACKS];
+	size_t tracks_offset;
+	uint64_t reserved;
+	uint64_t mdat;
+	uint64_t position;
+	size_t pending;
+	int planning;
+	uint64_t planned;
+};
+
+int mp4_open(struct MP4Muxer* const muxer, const char* const filename, const uint64_t reserve);
+struct MP4Track* mp4_add_track(struct MP4Muxer* const muxer, const enum MP4TrackType type, const uint32_t timescale);
+int mp4_set_config(struct MP4Track* const track, const unsigned char* const config, const size_t size);
+int mp4_write_sample(struct MP4Muxer* const muxer, struct MP4Track* const track, const unsigned char* const data, const size_t size, const uint64_t dts, const int32_t composition, const int sync);
+int mp4_flush(struct MP4Muxer* const muxer);
+int mp4_write_index(struct MP4Muxer* const muxer, const char* const filename);
+int mp4_close(struct MP4Muxer* const muxer);
+void mp4_free(struct MP4Muxer* const muxer);
+
+#pragma once
@@ -1,10 +1,12 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 
 #ifdef _WIN32
 	#include <windows.h>
 #else
 	#include <unistd.h>
+	#include <time.h>
 	
 	#if defined(__AppleiOS__) || defined(__AppleTV__)
 		#include <spawn.h>
@@ -78,6 +80,73 @@ int execute_shell_command(const char* const command) {
 	
 }
 
+FILE* open_shell_command(const char* const command) {
+	/*
+	Starts a shell command with its standard input connected to the returned
+	stream.
+	
+	Returns NULL on error, or where spawning commands through a pipe is not
+	available.
+	*/
+	
+	#if defined(_WIN32) && defined(_UNICODE)
+		const int wcommands = MultiByteToWideChar(CP_UTF8, 0, command, -1, NULL, 0);
+		
+		if (wcommands == 0) {
+			return NULL;
+		}
+		
+		wchar_t wcommand[wcommands];
+		
+		if (MultiByteToWideChar(CP_UTF8, 0, command, -1, wcommand, wcommands) == 0) {
+			return NULL;
+		}
+		
+		return _wpopen(wcommand, L"wb");
+	#elif defined(_WIN32)
+		return _popen(command, "wb");
+	#elif defined(__AppleiOS__) || defined(__AppleTV__)
+		(void) command;
+		
+		return NULL;
+	#else
+		return popen(command, "w");
+	#endif
+	
+}
+
+int close_shell_command(FILE* const stream) {
+	/*
+	Closes the stream of a command started with open_shell_command() and waits for
+	the command to exit.
+	
+	Returns the exit code for the command, which is (0) on success.
+	*/
+	
+	#ifdef _WIN32
+		const int code = _pclose(stream);
+	#elif defined(__AppleiOS__) || defined(__AppleTV__)
+		(void) stream;
+		
+		const int code = -1;
+	#else
+		const int code = pclose(stream);
+	#endif
+	
+	if (code == -1) {
+		return -1;
+	}
+	
+	#ifndef _WIN32
+		const int exit_code = WIFSIGNALED(code) ? 128 + WTERMSIG(code) : WEXITSTATUS(code);
+	#else
+		const int exit_code = code;
+	#endif
+	
+	return exit_code;
+	
+}
+
 int is_administrator(void) {
 	/*
 	Returns whether the caller's process is a member of the Administrators local
@@ -320,3 +389,41 @@ char* get_temporary_directory(void) {
 	return temporary_directory;
 	
 }
+
+long long get_monotonic_time(void) {
+	/*
+	Returns the current value of a monotonic clock, in milliseconds.
+	
+	The returned value has no meaning by itself; it is only suitable for
+	measuring elapsed time.
+	*/
+	
+	#ifdef _WIN32
+		return (long long) GetTickCount64();
+	#else
+		struct timespec ts = {0};
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		
+		return (long long) ts.tv_sec * 1000 + (long long) (ts.tv_nsec / 1000000);
+	#endif
+	
+}
+
+int get_cpu_count(void) {
+	/*
+	Returns the number of processors currently online, or (1) if that
+	information is not available.
+	*/
+	
+	#ifdef _WIN32
+		SYSTEM_INFO info = {0};
+		GetSystemInfo(&info);
+		
+		const int count = (int) info.dwNumberOfProcessors;
+	#else
+		const int count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	#endif
+	
+	return (count < 1) ? 1 : count;
+	
+}
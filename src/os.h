@@ -1,4 +1,10 @@
+#include <stdio.h>
+
 int execute_shell_command(const char* const command);
+FILE* open_shell_command(const char* const command);
+int close_shell_command(FILE* const stream);
 int is_administrator(void);
 char* get_configuration_directory(void);
-char* get_temporary_directory(void);
\ No newline at end of file
+char* get_temporary_directory(void);
+long long get_monotonic_time(void);
+int get_cpu_count(void);
\ No newline at end of file
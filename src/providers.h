@@ -1,4 +1,5 @@
 #include "resources.h"
+#include "hosts.h"
 
 #ifndef SPARKLEC_DISABLE_HOTMART
 	#include "hotmart.h"
@@ -31,6 +32,7 @@ struct ProviderMethods {
 struct Provider {
 	const char* label;
 	const char* url;
+	struct HostRateLimit rate_limit;
 	struct ProviderMethods methods;
 };
 
@@ -39,6 +41,10 @@ static const struct Provider PROVIDERS[] = {
 	{
 		.label = "Hotmart",
 		.url = "https://hotmart.com",
+		.rate_limit = {
+			.rate = 8,
+			.burst = 16
+		},
 		.methods = {
 			.authorize = &hotmart_authorize,
 			.get_resources = &hotmart_get_resources,
@@ -52,6 +58,10 @@ static const struct Provider PROVIDERS[] = {
 	{
 		.label = "Estratégia Concursos",
 		.url = "https://www.estrategiaconcursos.com.br",
+		.rate_limit = {
+			.rate = 10,
+			.burst = 20
+		},
 		.methods = {
 			.authorize = &estrategia_authorize,
 			.get_resources = &estrategia_get_resources,
@@ -65,6 +75,10 @@ static const struct Provider PROVIDERS[] = {
 	{
 		.label = "CyberClass",
 		.url = "https://www.cyberclass.com.br",
+		.rate_limit = {
+			.rate = 10,
+			.burst = 20
+		},
 		.methods = {
 			.authorize = &cyberclass_authorize,
 			.get_resources = &cyberclass_get_resources,
@@ -78,6 +92,10 @@ static const struct Provider PROVIDERS[] = {
 	{
 		.label = "IA Expert Academy",
 		.url = "https://iaexpert.academy",
+		.rate_limit = {
+			.rate = 10,
+			.burst = 20
+		},
 		.methods = {
 			.authorize = &iaexpert_authorize,
 			.get_resources = &iaexpert_get_resources,
@@ -91,6 +109,10 @@ static const struct Provider PROVIDERS[] = {
 	{
 		.label = "QConcursos",
 		.url = "https://www.qconcursos.com",
+		.rate_limit = {
+			.rate = 10,
+			.burst = 20
+		},
 		.methods = {
 			.authorize = &qconcursos_authorize,
 			.get_resources = &qconcursos_get_resources,
@@ -0,0 +1,683 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "remux.h"
+#include "ts.h"
+#include "mp4.h"
+#include "adts.h"
+#include "errors.h"
+
+/*
+Clock of MPEG-TS timestamps.
+*/
+#define REMUX_TIMESCALE 90000
+#define REMUX_TIMESTAMP_BITS 33
+
+/*
+A video timestamp going backwards, or forwards by more than this, is taken for a
+discontinuity (e.g. an ad break spliced into the playlist); the video continues
+right where it stopped instead.
+*/
+#define REMUX_MAX_GAP (10 * REMUX_TIMESCALE)
+
+#define H264_NAL_IDR 5
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+#define H264_NAL_AUD 9
+
+/*
+Space set aside in front of the media for the "moov" box: a fixed part, plus
+about what the sample tables of a second of media take with 60 video frames
+(size and composition offset of each) and 50 AAC frames (size of each). When it
+turns out larger, the box is written after the media instead.
+*/
+static const uint64_t REMUX_MOOV_BASE_SIZE = 64 * 1024;
+static const uint64_t REMUX_MOOV_SIZE_PER_SECOND = 1024;
+
+struct RemuxBits {
+	const unsigned char* data;
+	size_t size;
+	size_t position;
+};
+
+static unsigned int bits_read(struct RemuxBits* const bits, const int count) {
+	/*
+	Reading past the end yields zeros.
+	*/
+	
+	unsigned int value = 0;
+	
+	for (int index = 0; index < count; index++) {
+		const size_t byte = bits->position / 8;
+		const unsigned int bit = (byte < bits->size) ? (bits->data[byte] >> (7 - bits->position % 8)) & 1 : 0;
+		
+		value = (value << 1) | bit;
+		bits->position++;
+	}
+	
+	return value;
+	
+}
+
+static unsigned int bits_read_ue(struct RemuxBits* const bits) {
+	/*
+	Unsigned Exp-Golomb code.
+	*/
+	
+	int zeros = 0;
+	
+	while (bits_read(bits, 1) == 0 && zeros < 31) {
+		zeros++;
+	}
+	
+	return ((1U << zeros) - 1) + bits_read(bits, zeros);
+	
+}
+
+static int bits_read_se(struct RemuxBits* const bits) {
+	/*
+	Signed Exp-Golomb code.
+	*/
+	
+	const unsigned int value = bits_read_ue(bits);
+	
+	return (value & 1) ? (int) ((value + 1) / 2) : -(int) (value / 2);
+	
+}
+
+static long long remux_clock_update(struct RemuxClock* const clock, const long long timestamp) {
+	/*
+	Picks, out of all the values the 33 bit timestamp could stand for, the closest
+	one to the last timestamp.
+	*/
+	
+	const long long period = 1LL << REMUX_TIMESTAMP_BITS;
+	
+	if (clock->last < 0) {
+		clock->last = timestamp;
+		return timestamp + clock->offset;
+	}
+	
+	long long value = (clock->last & ~(period - 1)) | timestamp;
+	
+	if (value < clock->last - period / 2) {
+		value += period;
+	} else if (value > clock->last + period / 2) {
+		value -= period;
+	}
+	
+	clock->last = value;
+	
+	return value + clock->offset;
+	
+}
+
+static long long remux_to_microseconds(const long long timestamp) {
+	
+	return (timestamp * 100) / 9;
+	
+}
+
+static size_t h264_find_start_code(const unsigned char* const data, const size_t size, size_t offset) {
+	/*
+	Returns where the next 00 00 01 start code is, or "size" if there is none.
+	*/
+	
+	while (offset + 2 < size) {
+		if (data[offset + 2] > 1) {
+			offset += 3;
+		} else if (data[offset] == 0 && data[offset + 1] == 0 && data[offset + 2] == 1) {
+			return offset;
+		} else {
+			offset++;
+		}
+	}
+	
+	return size;
+	
+}
+
+static int h264_parse_sps(const unsigned char* const sps, const size_t size, struct MP4Track* const track, unsigned char* const extension) {
+	/*
+	Gets the picture size out of a sequence parameter set, and sets "extension" to
+	the trailing fields of the "avcC" box that the high profiles require.
+	
+	Returns 1 if the profile requires them, 0 otherwise.
+	*/
+	
+	unsigned char* const rbsp = malloc(size);
+	
+	if (rbsp == NULL) {
+		return 0;
+	}
+	
+	/*
+	Drop the emulation prevention bytes (00 00 03).
+	*/
+	size_t rbsp_size = 0;
+	size_t zeros = 0;
+	
+	for (size_t index = 1; index < size; index++) {
+		if (zeros >= 2 && sps[index] == 0x03) {
+			zeros = 0;
+			continue;
+		}
+		
+		zeros = (sps[index] == 0x00) ? zeros + 1 : 0;
+		rbsp[rbsp_size++] = sps[index];
+	}
+	
+	struct RemuxBits bits = {
+		.data = rbsp,
+		.size = rbsp_size
+	};
+	
+	const unsigned int profile = bits_read(&bits, 8);
+	
+	bits_read(&bits, 16);
+	bits_read_ue(&bits);
+	
+	unsigned int chroma_format = 1;
+	unsigned int separate_colour_plane = 0;
+	unsigned int bit_depth_luma = 0;
+	unsigned int bit_depth_chroma = 0;
+	
+	const int high = (
+		profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+		profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+		profile == 139 || profile == 134 || profile == 135 || profile == 144
+	);
+	
+	if (high) {
+		chroma_format = bits_read_ue(&bits);
+		
+		if (chroma_format == 3) {
+			separate_colour_plane = bits_read(&bits, 1);
+		}
+		
+		bit_depth_luma = bits_read_ue(&bits);
+		bit_depth_chroma = bits_read_ue(&bits);
+		
+		bits_read(&bits, 1);
+		
+		if (bits_read(&bits, 1)) {
+			const int lists = (chroma_format != 3) ? 8 : 12;
+			
+			for (int list = 0; list < lists; list++) {
+				if (!bits_read(&bits, 1)) {
+					continue;
+				}
+				
+				const int count = (list < 6) ? 16 : 64;
+				int last_scale = 8;
+				int next_scale = 8;
+				
+				for (int index = 0; index < count && next_scale != 0; index++) {
+					next_scale = (last_scale + bits_read_se(&bits) + 256) % 256;
+					last_scale = (next_scale == 0) ? last_scale : next_scale;
+				}
+			}
+		}
+	}
+	
+	bits_read_ue(&bits);
+	
+	const unsigned int pic_order_cnt_type = bits_read_ue(&bits);
+	
+	if (pic_order_cnt_type == 0) {
+		bits_read_ue(&bits);
+	} else if (pic_order_cnt_type == 1) {
+		bits_read(&bits, 1);
+		bits_read_se(&bits);
+		bits_read_se(&bits);
+		
+		const unsigned int cycle = bits_read_ue(&bits);
+		
+		for (unsigned int index = 0; index < cycle && index < 256; index++) {
+			bits_read_se(&bits);
+		}
+	}
+	
+	bits_read_ue(&bits);
+	bits_read(&bits, 1);
+	
+	const unsigned int width_in_mbs = bits_read_ue(&bits) + 1;
+	const unsigned int height_in_map_units = bits_read_ue(&bits) + 1;
+	const unsigned int frame_mbs_only = bits_read(&bits, 1);
+	
+	if (!frame_mbs_only) {
+		bits_read(&bits, 1);
+	}
+	
+	bits_read(&bits, 1);
+	
+	unsigned int crop_left = 0;
+	unsigned int crop_right = 0;
+	unsigned int crop_top = 0;
+	unsigned int crop_bottom = 0;
+	
+	if (bits_read(&bits, 1)) {
+		crop_left = bits_read_ue(&bits);
+		crop_right = bits_read_ue(&bits);
+		crop_top = bits_read_ue(&bits);
+		crop_bottom = bits_read_ue(&bits);
+	}
+	
+	free(rbsp);
+	
+	unsigned int crop_unit_x = 1;
+	unsigned int crop_unit_y = 2 - frame_mbs_only;
+	
+	if (chroma_format == 1 && !separate_colour_plane) {
+		crop_unit_x = 2;
+		crop_unit_y *= 2;
+	} else if (chroma_format == 2 && !separate_colour_plane) {
+		crop_unit_x = 2;
+	}
+	
+	track->width = (uint16_t) (width_in_mbs * 16 - crop_unit_x * (crop_left + crop_right));
+	track->height = (uint16_t) ((2 - frame_mbs_only) * height_in_map_units * 16 - crop_unit_y * (crop_top + crop_bottom));
+	
+	extension[0] = (unsigned char) (0xFC | (chroma_format & 0x03));
+	extension[1] = (unsigned char) (0xF8 | (bit_depth_luma & 0x07));
+	extension[2] = (unsigned char) (0xF8 | (bit_depth_chroma & 0x07));
+	extension[3] = 0;
+	
+	/*
+	Only these profiles carry the extension in "avcC".
+	*/
+	return profile == 100 || profile == 110 || profile == 122 || profile == 144;
+	
+}
+
+static int remux_save_parameter_set(unsigned char** const destination, size_t* const destination_size, const unsigned char* const data, const size_t size) {
+	/*
+	Only the first parameter sets are kept for the "avcC" box; later ones stay in
+	the samples, where decoders pick them up.
+	*/
+	
+	if (*destination != NULL) {
+		return UERR_SUCCESS;
+	}
+	
+	*destination = malloc(size);
+	
+	if (*destination == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	memcpy(*destination, data, size);
+	*destination_size = size;
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int remux_add_video(struct Remuxer* const remuxer, const long long dts) {
+	
+	struct MP4Track* const track = mp4_add_track(&remuxer->muxer, MP4_TRACK_VIDEO, REMUX_TIMESCALE);
+	
+	if (track == NULL) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	unsigned char extension[4];
+	const int high = h264_parse_sps(remuxer->sps, remuxer->sps_size, track, extension);
+	
+	const size_t size = 6 + 2 + remuxer->sps_size + 1 + 2 + remuxer->pps_size + (high ? sizeof(extension) : 0);
+	
+	unsigned char config[size];
+	size_t offset = 0;
+	
+	config[offset++] = 1;
+	config[offset++] = remuxer->sps[1];
+	config[offset++] = remuxer->sps[2];
+	config[offset++] = remuxer->sps[3];
+	config[offset++] = 0xFF;
+	config[offset++] = 0xE1;
+	config[offset++] = (unsigned char) (remuxer->sps_size >> 8);
+	config[offset++] = (unsigned char) remuxer->sps_size;
+	
+	memcpy(config + offset, remuxer->sps, remuxer->sps_size);
+	offset += remuxer->sps_size;
+	
+	config[offset++] = 1;
+	config[offset++] = (unsigned char) (remuxer->pps_size >> 8);
+	config[offset++] = (unsigned char) remuxer->pps_size;
+	
+	memcpy(config + offset, remuxer->pps, remuxer->pps_size);
+	offset += remuxer->pps_size;
+	
+	if (high) {
+		memcpy(config + offset, extension, sizeof(extension));
+	}
+	
+	remuxer->video = track;
+	remuxer->video_origin = dts;
+	
+	track->start_time = remux_to_microseconds(dts);
+	
+	return mp4_set_config(track, config, size);
+	
+}
+
+static int remux_video(struct Remuxer* const remuxer, const struct TSStream* const stream, const unsigned char* const data, const size_t size) {
+	/*
+	Turns an access unit from an Annex B byte stream (NAL units separated by start
+	codes) into an MP4 sample (NAL units prefixed with their size).
+	*/
+	
+	if (stream->dts < 0) {
+		return UERR_SUCCESS;
+	}
+	
+	const size_t capacity = size + size / 4 + 4;
+	
+	if (remuxer->sample_size < capacity) {
+		unsigned char* const sample = realloc(remuxer->sample, capacity);
+		
+		if (sample == NULL) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		remuxer->sample = sample;
+		remuxer->sample_size = capacity;
+	}
+	
+	size_t sample_size = 0;
+	int sync = 0;
+	
+	size_t position = h264_find_start_code(data, size, 0);
+	
+	while (position < size) {
+		const size_t start = position + 3;
+		
+		position = h264_find_start_code(data, size, start);
+		
+		/*
+		The leading zero of a 4 byte start code is not part of the unit before it.
+		*/
+		size_t end = position;
+		
+		while (end > start && data[end - 1] == 0x00) {
+			end--;
+		}
+		
+		if (end == start) {
+			continue;
+		}
+		
+		const unsigned char* const unit = data + start;
+		const size_t unit_size = end - start;
+		
+		int code = UERR_SUCCESS;
+		
+		switch (unit[0] & 0x1F) {
+			case H264_NAL_AUD:
+				continue;
+			case H264_NAL_IDR:
+				sync = 1;
+				break;
+			case H264_NAL_SPS:
+				if (unit_size >= 4) {
+					code = remux_save_parameter_set(&remuxer->sps, &remuxer->sps_size, unit, unit_size);
+				}
+				
+				break;
+			case H264_NAL_PPS:
+				code = remux_save_parameter_set(&remuxer->pps, &remuxer->pps_size, unit, unit_size);
+				break;
+		}
+		
+		if (code != UERR_SUCCESS) {
+			return code;
+		}
+		
+		remuxer->sample[sample_size++] = (unsigned char) (unit_size >> 24);
+		remuxer->sample[sample_size++] = (unsigned char) (unit_size >> 16);
+		remuxer->sample[sample_size++] = (unsigned char) (unit_size >> 8);
+		remuxer->sample[sample_size++] = (unsigned char) unit_size;
+		
+		memcpy(remuxer->sample + sample_size, unit, unit_size);
+		sample_size += unit_size;
+	}
+	
+	long long dts = remux_clock_update(&remuxer->clock, stream->dts);
+	
+	/*
+	The PTS is never far from the DTS, even across a wraparound.
+	*/
+	long long composition = stream->pts - stream->dts;
+	
+	if (stream->pts < 0 || composition < -(1LL << (REMUX_TIMESTAMP_BITS - 1))) {
+		composition = (stream->pts < 0) ? 0 : composition + (1LL << REMUX_TIMESTAMP_BITS);
+	}
+	
+	/*
+	Whatever comes before the first keyframe can not be decoded anyway.
+	*/
+	if (remuxer->video == NULL) {
+		if (!sync || remuxer->sps == NULL || remuxer->pps == NULL) {
+			return UERR_SUCCESS;
+		}
+		
+		const int code = remux_add_video(remuxer, dts);
+		
+		if (code != UERR_SUCCESS) {
+			return code;
+		}
+	}
+	
+	struct MP4Track* const track = remuxer->video;
+	
+	if (track->samples_offset > 0) {
+		const uint64_t last = track->samples[track->samples_offset - 1].dts;
+		const long long previous = remuxer->video_origin + (long long) last;
+		
+		if (dts <= previous || dts - previous > REMUX_MAX_GAP) {
+			const long long duration = (track->samples_offset > 1) ? (long long) (last - track->samples[track->samples_offset - 2].dts) : REMUX_TIMESCALE / 30;
+			const long long shift = previous + duration - dts;
+			
+			remuxer->clock.offset += shift;
+			dts += shift;
+		}
+	}
+	
+	return mp4_write_sample(&remuxer->muxer, track, remuxer->sample, sample_size, (uint64_t) (dts - remuxer->video_origin), (int32_t) composition, sync);
+	
+}
+
+static int remux_audio(struct Remuxer* const remuxer, const struct TSStream* const stream, const unsigned char* const data, const size_t size) {
+	/*
+	Strips the ADTS headers off the AAC frames of a PES packet. Frames are laid out
+	back to back, 1024 samples each, starting from the PTS of the first one.
+	*/
+	
+	size_t offset = 0;
+	
+	while (offset < size) {
+		struct ADTSHeader header = {0};
+		
+		if (adts_parse_header(data + offset, size - offset, &header) != UERR_SUCCESS) {
+			offset++;
+			continue;
+		}
+		
+		if (offset + header.frame_size > size) {
+			break;
+		}
+		
+		if (header.blocks != 1) {
+			return UERR_UNSUPPORTED;
+		}
+		
+		if (remuxer->audio == NULL) {
+			if (stream->pts < 0) {
+				return UERR_SUCCESS;
+			}
+			
+			struct MP4Track* const track = mp4_add_track(&remuxer->muxer, MP4_TRACK_AUDIO, header.sample_rate);
+			
+			if (track == NULL) {
+				return UERR_UNSUPPORTED;
+			}
+			
+			unsigned char config[ADTS_CONFIG_SIZE];
+			adts_get_config(&header, config);
+			
+			const int code = mp4_set_config(track, config, sizeof(config));
+			
+			if (code != UERR_SUCCESS) {
+				return code;
+			}
+			
+			track->sample_rate = header.sample_rate;
+			track->channels = (uint16_t) header.channels;
+			track->start_time = remux_to_microseconds(remux_clock_update(&remuxer->clock, stream->pts));
+			
+			remuxer->audio = track;
+		}
+		
+		const int code = mp4_write_sample(&remuxer->muxer, remuxer->audio, data + offset + header.header_size, header.frame_size - header.header_size, remuxer->audio_frames * ADTS_FRAME_SAMPLES, 0, 1);
+		
+		if (code != UERR_SUCCESS) {
+			return code;
+		}
+		
+		remuxer->audio_frames++;
+		offset += header.frame_size;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int remux_pes_cb(const struct TSStream* const stream, const unsigned char* const data, const size_t size, void* const userdata) {
+	
+	struct Remuxer* const remuxer = (struct Remuxer*) userdata;
+	
+	switch (stream->type) {
+		case TS_STREAM_H264:
+			return remux_video(remuxer, stream, data, size);
+		case TS_STREAM_AAC:
+			return remux_audio(remuxer, stream, data, size);
+		default:
+			return UERR_SUCCESS;
+	}
+	
+}
+
+int remux_probe(const unsigned char* const data, const size_t size) {
+	/*
+	Tells whether the start of an MPEG-TS byte stream announces streams that can
+	all be remuxed: at most one H.264 video and one AAC audio stream, besides
+	timed metadata and splice information.
+	
+	Returns UERR_SUCCESS if so, or UERR_UNSUPPORTED otherwise.
+	*/
+	
+	struct TSDemuxer demuxer = {0};
+	
+	ts_demuxer_push(&demuxer, data, size);
+	
+	size_t video = 0;
+	size_t audio = 0;
+	int supported = demuxer.pmt_parsed;
+	
+	for (size_t index = 0; index < demuxer.streams_offset; index++) {
+		switch (demuxer.streams[index].type) {
+			case TS_STREAM_H264:
+				video++;
+				break;
+			case TS_STREAM_AAC:
+				audio++;
+				break;
+			case TS_STREAM_METADATA:
+			case TS_STREAM_SCTE35:
+				break;
+			default:
+				supported = 0;
+				break;
+		}
+	}
+	
+	ts_demuxer_free(&demuxer);
+	
+	if (!supported || video > 1 || audio > 1 || video + audio == 0) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+uint64_t remux_get_reserve(const double duration) {
+	/*
+	How much room to leave for the "moov" box of a media "duration" seconds long.
+	*/
+	
+	if (duration <= 0) {
+		return REMUX_MOOV_BASE_SIZE;
+	}
+	
+	return REMUX_MOOV_BASE_SIZE + (uint64_t) (duration * (double) REMUX_MOOV_SIZE_PER_SECOND);
+	
+}
+
+int remux_open(struct Remuxer* const remuxer, const char* const filename, const uint64_t reserve) {
+	
+	memset(remuxer, 0, sizeof(*remuxer));
+	
+	remuxer->clock.last = -1;
+	remuxer->demuxer.callback = remux_pes_cb;
+	remuxer->demuxer.userdata = remuxer;
+	
+	return mp4_open(&remuxer->muxer, filename, reserve);
+	
+}
+
+int remux_push(struct Remuxer* const remuxer, const unsigned char* const data, const size_t size) {
+	
+	return ts_demuxer_push(&remuxer->demuxer, data, size);
+	
+}
+
+int remux_close(struct Remuxer* const remuxer) {
+	/*
+	Finishes the MP4 file once the whole byte stream was pushed.
+	*/
+	
+	const int code = ts_demuxer_flush(&remuxer->demuxer);
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	if (remuxer->video == NULL && remuxer->audio == NULL) {
+		return UERR_UNSUPPORTED;
+	}
+	
+	return mp4_close(&remuxer->muxer);
+	
+}
+
+void remux_free(struct Remuxer* const remuxer) {
+	
+	ts_demuxer_free(&remuxer->demuxer);
+	mp4_free(&remuxer->muxer);
+	
+	free(remuxer->sample);
+	free(remuxer->sps);
+	free(remuxer->pps);
+	
+	remuxer->video = NULL;
+	remuxer->audio = NULL;
+	remuxer->sample = NULL;
+	remuxer->sample_size = 0;
+	remuxer->sps = NULL;
+	remuxer->sps_size = 0;
+	remuxer->pps = NULL;
+	remuxer->pps_size = 0;
+	
+}
@@ -0,0 +1,44 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ts.h"
+#include "mp4.h"
+
+/*
+Keeps the timestamps of a stream going up across 33 bit wraparounds and the
+jumps of playlist discontinuities. "last" is the last timestamp seen, unwrapped
+(or -1), and "offset" is what is added to timestamps to skip over the jumps.
+*/
+struct RemuxClock {
+	long long last;
+	long long offset;
+};
+
+/*
+Rewraps the H.264 video and AAC audio of an MPEG-TS byte stream into an MP4
+file, without decoding anything, as the stream is pushed.
+*/
+struct Remuxer {
+	struct TSDemuxer demuxer;
+	struct MP4Muxer muxer;
+	struct MP4Track* video;
+	struct MP4Track* audio;
+	struct RemuxClock clock;
+	long long video_origin;
+	uint64_t audio_frames;
+	unsigned char* sample;
+	size_t sample_size;
+	unsigned char* sps;
+	size_t sps_size;
+	unsigned char* pps;
+	size_t pps_size;
+};
+
+int remux_probe(const unsigned char* const data, const size_t size);
+uint64_t remux_get_reserve(const double duration);
+int remux_open(struct Remuxer* const remuxer, const char* const filename, const uint64_t reserve);
+int remux_push(struct Remuxer* const remuxer, const unsigned char* const data, const size_t size);
+int remux_close(struct Remuxer* const remuxer);
+void remux_free(struct Remuxer* const remuxer);
+
+#pragma once
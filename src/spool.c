@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+	#include <signal.h>
+#endif
+
+#include "spool.h"
+#include "errors.h"
+
+static int spool_run(void* const argument) {
+	/*
+	Writes the queued chunks in order until the spool is closed and everything
+	got written. After a write error the remaining chunks are dropped; the error
+	is reported back by spool_write() and spool_close().
+	*/
+	
+	struct Spool* const spool = (struct Spool*) argument;
+	
+	/*
+	A reader that goes away early makes writes fail with EPIPE, instead of having
+	SIGPIPE kill the whole process. Only this thread blocks it, so commands we
+	start later do not inherit anything unusual.
+	*/
+	#ifndef _WIN32
+		sigset_t set;
+		
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+	#endif
+	
+	mutex_lock(&spool->lock);
+	
+	while (1) {
+		while (spool->head == spool->offset && !spool->closed) {
+			condition_wait(&spool->condition, &spool->lock);
+		}
+		
+		if (spool->head == spool->offset) {
+			break;
+		}
+		
+		const struct SpoolChunk chunk = spool->chunks[spool->head++];
+		const int failed = spool->code != UERR_SUCCESS;
+		
+		mutex_unlock(&spool->lock);
+		
+		int code = UERR_SUCCESS;
+		
+		if (!failed && fwrite(chunk.data, sizeof(*chunk.data), chunk.size, spool->stream) != chunk.size) {
+			code = UERR_FWRITE_FAILURE;
+		}
+		
+		free(chunk.data);
+		
+		mutex_lock(&spool->lock);
+		
+		if (code != UERR_SUCCESS) {
+			spool->code = code;
+		}
+		
+		spool->queued -= chunk.size;
+		
+		/*
+		Reuse the array from the start once it has been drained.
+		*/
+		if (spool->head == spool->offset) {
+			spool->head = 0;
+			spool->offset = 0;
+		}
+		
+		condition_signal(&spool->condition);
+	}
+	
+	if (spool->code == UERR_SUCCESS && fflush(spool->stream) != 0) {
+		spool->code = UERR_FWRITE_FAILURE;
+	}
+	
+	const int code = spool->code;
+	
+	mutex_unlock(&spool->lock);
+	
+	return code;
+	
+}
+
+int spool_open(struct Spool* const spool, FILE* const stream) {
+	
+	memset(spool, 0, sizeof(*spool));
+	
+	spool->stream = stream;
+	
+	if (!mutex_init(&spool->lock)) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	if (!condition_init(&spool->condition)) {
+		mutex_destroy(&spool->lock);
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	if (!thread_create(&spool->thread, spool_run, (void*) spool)) {
+		condition_destroy(&spool->condition);
+		mutex_destroy(&spool->lock);
+		
+		return UERR_FAILURE;
+	}
+	
+	spool->started = 1;
+	
+	return UERR_SUCCESS;
+	
+}
+
+int spool_write(struct Spool* const spool, const unsigned char* const data, const size_t size) {
+	/*
+	Queues a copy of the data to be written. Returns the error of an earlier write,
+	if any, so the caller can stop early.
+	*/
+	
+	if (size == 0) {
+		return UERR_SUCCESS;
+	}
+	
+	unsigned char* const copy = malloc(size);
+	
+	if (copy == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	memcpy(copy, data, size);
+	
+	mutex_lock(&spool->lock);
+	
+	if (spool->code != UERR_SUCCESS) {
+		const int code = spool->code;
+		
+		mutex_unlock(&spool->lock);
+		free(copy);
+		
+		return code;
+	}
+	
+	if (spool->offset == spool->size) {
+		const size_t capacity = (spool->size == 0) ? 16 : spool->size * 2;
+		struct SpoolChunk* const chunks = realloc(spool->chunks, capacity * sizeof(*chunks));
+		
+		if (chunks == NULL) {
+			mutex_unlock(&spool->lock);
+			free(copy);
+			
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		spool->chunks = chunks;
+		spool->size = capacity;
+	}
+	
+	spool->chunks[spool->offset++] = (struct SpoolChunk) {
+		.data = copy,
+		.size = size
+	};
+	
+	spool->queued += size;
+	
+	condition_signal(&spool->condition);
+	mutex_unlock(&spool->lock);
+	
+	return UERR_SUCCESS;
+	
+}
+
+size_t spool_get_queued(struct Spool* const spool) {
+	
+	mutex_lock(&spool->lock);
+	const size_t queued = spool->queued;
+	mutex_unlock(&spool->lock);
+	
+	return queued;
+	
+}
+
+int spool_close(struct Spool* const spool) {
+	/*
+	Waits for everything queued to be written and stops the writer thread. The
+	stream itself is left open.
+	
+	Returns the first error that happened while writing, if any.
+	*/
+	
+	if (!spool->started) {
+		return UERR_SUCCESS;
+	}
+	
+	mutex_lock(&spool->lock);
+	
+	spool->closed = 1;
+	
+	condition_signal(&spool->condition);
+	mutex_unlock(&spool->lock);
+	
+	thread_join(&spool->thread);
+	
+	spool->started = 0;
+	
+	for (size_t index = spool->head; index < spool->offset; index++) {
+		free(spool->chunks[index].data);
+	}
+	
+	free(spool->chunks);
+	spool->chunks = NULL;
+	
+	condition_destroy(&spool->condition);
+	mutex_destroy(&spool->lock);
+	
+	return spool->code;
+	
+}
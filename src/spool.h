@@ -0,0 +1,37 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "threads.h"
+
+struct SpoolChunk {
+	unsigned char* data;
+	size_t size;
+};
+
+/*
+Writes data into a stream (usually the pipe of another process) from a thread of
+its own, so a slow reader on the other end does not block whoever produces the
+data. "queued" is how many bytes were handed over but not written yet; callers
+use it to hold off producing more.
+*/
+struct Spool {
+	FILE* stream;
+	struct Thread thread;
+	struct Mutex lock;
+	struct Condition condition;
+	struct SpoolChunk* chunks;
+	size_t head;
+	size_t offset;
+	size_t size;
+	size_t queued;
+	int closed;
+	int code;
+	int started;
+};
+
+int spool_open(struct Spool* const spool, FILE* const stream);
+int spool_write(struct Spool* const spool, const unsigned char* const data, const size_t size);
+size_t spool_get_queued(struct Spool* const spool);
+int spool_close(struct Spool* const spool);
+
+#pragma once
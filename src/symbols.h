@@ -34,6 +34,7 @@ static const char JSON_FILE_EXTENSION[] = "json";
 static const char PDF_FILE_EXTENSION[] = "pdf";
 static const char MP3_FILE_EXTENSION[] = "mp3";
 static const char TXT_FILE_EXTENSION[] = "txt";
+static const char PART_FILE_EXTENSION[] = "part";
 
 static const char HTML_HEADER_START[] = 
 	"<!DOCTYPE html>"
@@ -0,0 +1,172 @@
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <pthread.h>
+#endif
+
+#include "threads.h"
+
+#ifdef _WIN32
+	static DWORD WINAPI thread_start(LPVOID parameter) {
+		
+		struct Thread* const thread = (struct Thread*) parameter;
+		thread->result = (*thread->routine)(thread->argument);
+		
+		return 0;
+		
+	}
+#else
+	static void* thread_start(void* parameter) {
+		
+		struct Thread* const thread = (struct Thread*) parameter;
+		thread->result = (*thread->routine)(thread->argument);
+		
+		return NULL;
+		
+	}
+#endif
+
+int thread_create(struct Thread* const thread, const thread_routine_t routine, void* const argument) {
+	/*
+	Starts a new thread running "routine(argument)". The return value of the
+	routine is stored in the "result" field once the thread is joined.
+	
+	Returns (1) on success, (0) on error.
+	*/
+	
+	thread->routine = routine;
+	thread->argument = argument;
+	thread->result = 0;
+	
+	#ifdef _WIN32
+		thread->handle = CreateThread(NULL, 0, thread_start, (LPVOID) thread, 0, NULL);
+		
+		if (thread->handle == NULL) {
+			return 0;
+		}
+	#else
+		if (pthread_create(&thread->handle, NULL, thread_start, (void*) thread) != 0) {
+			return 0;
+		}
+	#endif
+	
+	return 1;
+	
+}
+
+int thread_join(struct Thread* const thread) {
+	/*
+	Waits for a thread started with thread_create() to finish.
+	
+	Returns (1) on success, (0) on error.
+	*/
+	
+	#ifdef _WIN32
+		if (WaitForSingleObject(thread->handle, INFINITE) == WAIT_FAILED) {
+			return 0;
+		}
+		
+		CloseHandle(thread->handle);
+		thread->handle = NULL;
+	#else
+		if (pthread_join(thread->handle, NULL) != 0) {
+			return 0;
+		}
+	#endif
+	
+	return 1;
+	
+}
+
+int mutex_init(struct Mutex* const mutex) {
+	
+	#ifdef _WIN32
+		InitializeCriticalSection(&mutex->section);
+	#else
+		if (pthread_mutex_init(&mutex->mutex, NULL) != 0) {
+			return 0;
+		}
+	#endif
+	
+	return 1;
+	
+}
+
+void mutex_lock(struct Mutex* const mutex) {
+	
+	#ifdef _WIN32
+		EnterCriticalSection(&mutex->section);
+	#else
+		pthread_mutex_lock(&mutex->mutex);
+	#endif
+	
+}
+
+void mutex_unlock(struct Mutex* const mutex) {
+	
+	#ifdef _WIN32
+		LeaveCriticalSection(&mutex->section);
+	#else
+		pthread_mutex_unlock(&mutex->mutex);
+	#endif
+	
+}
+
+void mutex_destroy(struct Mutex* const mutex) {
+	
+	#ifdef _WIN32
+		DeleteCriticalSection(&mutex->section);
+	#else
+		pthread_mutex_destroy(&mutex->mutex);
+	#endif
+	
+}
+
+int condition_init(struct Condition* const condition) {
+	
+	#ifdef _WIN32
+		InitializeConditionVariable(&condition->variable);
+	#else
+		if (pthread_cond_init(&condition->variable, NULL) != 0) {
+			return 0;
+		}
+	#endif
+	
+	return 1;
+	
+}
+
+void condition_wait(struct Condition* const condition, struct Mutex* const mutex) {
+	/*
+	Releases the (locked) mutex and sleeps until the condition is signaled, then
+	locks the mutex again. Wakeups may be spurious; callers check their predicate
+	in a loop.
+	*/
+	
+	#ifdef _WIN32
+		SleepConditionVariableCS(&condition->variable, &mutex->section, INFINITE);
+	#else
+		pthread_cond_wait(&condition->variable, &mutex->mutex);
+	#endif
+	
+}
+
+void condition_signal(struct Condition* const condition) {
+	
+	#ifdef _WIN32
+		WakeAllConditionVariable(&condition->variable);
+	#else
+		pthread_cond_broadcast(&condition->variable);
+	#endif
+	
+}
+
+void condition_destroy(struct Condition* const condition) {
+	
+	#ifdef _WIN32
+		(void) condition;
+	#else
+		pthread_cond_destroy(&condition->variable);
+	#endif
+	
+}
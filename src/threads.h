@@ -0,0 +1,49 @@
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <pthread.h>
+#endif
+
+typedef int (*thread_routine_t)(void* const argument);
+
+struct Thread {
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+	thread_routine_t routine;
+	void* argument;
+	int result;
+};
+
+struct Mutex {
+#ifdef _WIN32
+	CRITICAL_SECTION section;
+#else
+	pthread_mutex_t mutex;
+#endif
+};
+
+struct Condition {
+#ifdef _WIN32
+	CONDITION_VARIABLE variable;
+#else
+	pthread_cond_t variable;
+#endif
+};
+
+int thread_create(struct Thread* const thread, const thread_routine_t routine, void* const argument);
+int thread_join(struct Thread* const thread);
+
+int mutex_init(struct Mutex* const mutex);
+void mutex_lock(struct Mutex* const mutex);
+void mutex_unlock(struct Mutex* const mutex);
+void mutex_destroy(struct Mutex* const mutex);
+
+int condition_init(struct Condition* const condition);
+void condition_wait(struct Condition* const condition, struct Mutex* const mutex);
+void condition_signal(struct Condition* const condition);
+void condition_destroy(struct Condition* const condition);
+
+#pragma once
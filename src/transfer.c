@@ -0,0 +1,1727 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+	#include <unistd.h>
+	#include <sys/epoll.h>
+	
+	#define TRANSFER_HAVE_EPOLL
+#endif
+
+#include <curl/curl.h>
+
+#include "transfer.h"
+#include "curl.h"
+#include "callbacks.h"
+#include "fstream.h"
+#include "errors.h"
+#include "os.h"
+#include "threads.h"
+#include "filesystem.h"
+#include "hosts.h"
+#include "terminal.h"
+#include "bandwidth.h"
+#include "interfaces.h"
+
+/*
+Upper bound of transfers in flight; how many of them a single host actually
+gets is decided by its own concurrency controller (see hosts.c).
+*/
+static const size_t TRANSFER_DEFAULT_WINDOW = 64;
+static const size_t TRANSFER_MAX_WORKERS = 4;
+
+static const int TRANSFER_WAIT_TIME = 1000;
+static const int TRANSFER_BLOCKED_WAIT_TIME = 50;
+
+/*
+How long a shard waits before asking the producer again after it asked to hold
+off (see TRANSFER_NEXT_LATER).
+*/
+static const int TRANSFER_HOLD_WAIT_TIME = 50;
+
+/*
+Once the producer is exhausted and no more than TRANSFER_HEDGE_DOWNLOADS
+downloads are left, a download that has been running for TRANSFER_HEDGE_FACTOR
+times as long as the average one (and at least TRANSFER_HEDGE_MIN_DELAY
+milliseconds) gets a duplicate request. Whichever finishes first wins and the
+other one is cancelled, so a single slow server does not hold back the end of
+the whole transfer.
+*/
+static const size_t TRANSFER_HEDGE_DOWNLOADS = 4;
+static const long long TRANSFER_HEDGE_FACTOR = 2;
+static const long long TRANSFER_HEDGE_MIN_DELAY = 2000;
+
+static const char TRANSFER_HEDGE_EXTENSION[] = ".hedge";
+
+#ifdef TRANSFER_HAVE_EPOLL
+	#define TRANSFER_MAX_EVENTS 64
+#endif
+
+/*
+Drives the I/O of a multi handle. On Linux this is an epoll instance fed by
+libcurl's socket and timer callbacks, so we only ever wake up for sockets that
+actually have something to do. Elsewhere we fall back to curl_multi_poll().
+*/
+struct TransferLoop {
+	CURLM* multi;
+#ifdef TRANSFER_HAVE_EPOLL
+	int epoll;
+	long long deadline;
+#endif
+};
+
+#ifdef TRANSFER_HAVE_EPOLL
+	static int transfer_socket_cb(CURL* const easy, const curl_socket_t socket, const int what, void* const userp, void* const socketp) {
+		
+		(void) easy;
+		
+		struct TransferLoop* const loop = (struct TransferLoop*) userp;
+		
+		if (loop == NULL) {
+			return 0;
+		}
+		
+		if (what == CURL_POLL_REMOVE) {
+			epoll_ctl(loop->epoll, EPOLL_CTL_DEL, socket, NULL);
+			curl_multi_assign(loop->multi, socket, NULL);
+			
+			return 0;
+		}
+		
+		struct epoll_event event = {
+			.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0),
+			.data.fd = socket
+		};
+		
+		if (socketp == NULL) {
+			const int status = epoll_ctl(loop->epoll, EPOLL_CTL_ADD, socket, &event);
+			
+			if (status == -1 && errno != EEXIST) {
+				return -1;
+			}
+			
+			curl_multi_assign(loop->multi, socket, (void*) loop);
+			
+			if (status == 0) {
+				return 0;
+			}
+		}
+		
+		if (epoll_ctl(loop->epoll, EPOLL_CTL_MOD, socket, &event) == -1) {
+			return -1;
+		}
+		
+		return 0;
+		
+	}
+	
+	static int transfer_timer_cb(CURLM* const multi, const long timeout, void* const userp) {
+		
+		(void) multi;
+		
+		struct TransferLoop* const loop = (struct TransferLoop*) userp;
+		
+		if (loop == NULL) {
+			return 0;
+		}
+		
+		loop->deadline = (timeout < 0) ? -1 : get_monotonic_time() + timeout;
+		
+		return 0;
+		
+	}
+#endif
+
+static int transfer_loop_init(struct TransferLoop* const loop, CURLM* const multi) {
+	
+	loop->multi = multi;
+	
+	#ifdef TRANSFER_HAVE_EPOLL
+		loop->deadline = -1;
+		loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+		
+		if (loop->epoll == -1) {
+			return UERR_TRANSFER_LOOP_FAILURE;
+		}
+		
+		curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, transfer_socket_cb);
+		curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, (void*) loop);
+		curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, transfer_timer_cb);
+		curl_multi_setopt(multi, CURLMOPT_TIMERDATA, (void*) loop);
+	#endif
+	
+	return UERR_SUCCESS;
+	
+}
+
+static void transfer_loop_free(struct TransferLoop* const loop) {
+	
+	#ifdef TRANSFER_HAVE_EPOLL
+		curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, NULL);
+		curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, NULL);
+		
+		if (loop->epoll != -1) {
+			close(loop->epoll);
+			loop->epoll = -1;
+		}
+	#endif
+	
+	loop->multi = NULL;
+	
+}
+
+static int transfer_loop_wait(struct TransferLoop* const loop, const int timeout_max) {
+	/*
+	Waits (at most "timeout_max" milliseconds) for network activity or a libcurl
+	timeout and lets libcurl act on it. Completed transfers are then available
+	through curl_multi_info_read().
+	*/
+	
+	int running = 0;
+	
+	#ifdef TRANSFER_HAVE_EPOLL
+		int timeout = timeout_max;
+		
+		if (loop->deadline != -1) {
+			const long long remaining = loop->deadline - get_monotonic_time();
+			
+			if (remaining < timeout) {
+				timeout = (remaining < 0) ? 0 : (int) remaining;
+			}
+		}
+		
+		struct epoll_event events[TRANSFER_MAX_EVENTS];
+		
+		const int count = epoll_wait(loop->epoll, events, TRANSFER_MAX_EVENTS, timeout);
+		
+		if (count == -1 && errno != EINTR) {
+			return UERR_TRANSFER_LOOP_FAILURE;
+		}
+		
+		for (int index = 0; index < count; index++) {
+			const struct epoll_event* const event = &events[index];
+			
+			int mask = 0;
+			
+			if (event->events & (EPOLLIN | EPOLLHUP)) {
+				mask |= CURL_CSELECT_IN;
+			}
+			
+			if (event->events & EPOLLOUT) {
+				mask |= CURL_CSELECT_OUT;
+			}
+			
+			if (event->events & EPOLLERR) {
+				mask |= CURL_CSELECT_ERR;
+			}
+			
+			if (curl_multi_socket_action(loop->multi, event->data.fd, mask, &running) != CURLM_OK) {
+				return UERR_CURLM_FAILURE;
+			}
+		}
+		
+		if (loop->deadline != -1 && get_monotonic_time() >= loop->deadline) {
+			loop->deadline = -1;
+			
+			if (curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running) != CURLM_OK) {
+				return UERR_CURLM_FAILURE;
+			}
+		}
+	#else
+		if (curl_multi_perform(loop->multi, &running) != CURLM_OK) {
+			return UERR_CURLM_FAILURE;
+		}
+		
+		if (curl_multi_poll(loop->multi, NULL, 0, timeout_max, NULL) != CURLM_OK) {
+			return UERR_CURLM_FAILURE;
+		}
+	#endif
+	
+	return UERR_SUCCESS;
+	
+}
+
+/*
+A worker of the transfer engine. Each shard owns a multi handle (driven only by
+its own thread), a share of the transfer window and a queue of downloads that
+were already handed out by the producer but not started yet.
+
+Shards refill their queue in batches from the producer; a shard whose queue ran
+dry while the producer is exhausted steals half of the queue of another shard,
+so no worker idles while there is still work left somewhere else.
+*/
+struct TransferShard {
+	struct Transfer* transfer;
+	struct TransferShard* shards;
+	size_t count;
+	size_t index;
+	CURLM* multi;
+	struct TransferLoop loop;
+	size_t window;
+	size_t capacity;
+	struct Download* slots;
+	struct Download** timers;
+	size_t timers_offset;
+	struct Mutex lock;
+	struct Download* queue;
+	size_t head;
+	size_t queued;
+	struct Thread thread;
+	int started;
+	int holding;
+	size_t shaped;
+	unsigned long shaping;
+};
+
+static void transfer_queue_push(struct TransferShard* const shard, const struct Download* const download) {
+	
+	shard->queue[(shard->head + shard->queued) % shard->capacity] = *download;
+	shard->queued++;
+	
+}
+
+static void transfer_queue_pop_front(struct TransferShard* const shard, struct Download* const download) {
+	
+	*download = shard->queue[shard->head];
+	
+	shard->head = (shard->head + 1) % shard->capacity;
+	shard->queued--;
+	
+}
+
+static void transfer_queue_pop_back(struct TransferShard* const shard, struct Download* const download) {
+	
+	shard->queued--;
+	*download = shard->queue[(shard->head + shard->queued) % shard->capacity];
+	
+}
+
+/*
+Downloads waiting to be retried are kept in a binary min-heap ordered by the
+time they are due, one per shard. A waiting download keeps its slot and easy
+handle, but is not attached to the multi handle and gives its host connection
+back until it is started again.
+*/
+static void transfer_timers_push(struct TransferShard* const shard, struct Download* const download) {
+	
+	size_t index = shard->timers_offset++;
+	
+	while (index > 0) {
+		const size_t parent = (index - 1) / 2;
+		
+		if (shard->timers[parent]->retry_at <= download->retry_at) {
+			break;
+		}
+		
+		shard->timers[index] = shard->timers[parent];
+		index = parent;
+	}
+	
+	shard->timers[index] = download;
+	
+}
+
+static struct Download* transfer_timers_pop(struct TransferShard* const shard) {
+	
+	struct Download* const top = shard->timers[0];
+	struct Download* const last = shard->timers[--shard->timers_offset];
+	
+	size_t index = 0;
+	
+	while (1) {
+		size_t child = index * 2 + 1;
+		
+		if (child >= shard->timers_offset) {
+			break;
+		}
+		
+		if (child + 1 < shard->timers_offset && shard->timers[child + 1]->retry_at < shard->timers[child]->retry_at) {
+			child++;
+		}
+		
+		if (last->retry_at <= shard->timers[child]->retry_at) {
+			break;
+		}
+		
+		shard->timers[index] = shard->timers[child];
+		index = child;
+	}
+	
+	if (shard->timers_offset > 0) {
+		shard->timers[index] = last;
+	}
+	
+	return top;
+	
+}
+
+static int transfer_get_code(struct Transfer* const transfer) {
+	
+	mutex_lock(&transfer->lock);
+	const int code = transfer->code;
+	mutex_unlock(&transfer->lock);
+	
+	return code;
+	
+}
+
+static void transfer_set_code(struct Transfer* const transfer, const int code) {
+	
+	mutex_lock(&transfer->lock);
+	
+	if (transfer->code == UERR_SUCCESS) {
+		transfer->code = code;
+	}
+	
+	mutex_unlock(&transfer->lock);
+	
+}
+
+static int transfer_shard_next(struct TransferShard* const shard, struct Download* const download) {
+	/*
+	Hands out the next download this shard should start. Downloads come from the
+	shard's own queue first, then from the producer and, as a last resort, from
+	the queue of another shard.
+	
+	Returns (1) if a download was handed out, (0) if there is nothing left to do
+	right now, or one of the UERR_* codes on error. "holding" is set when the
+	producer asked to be asked again later.
+	*/
+	
+	struct Transfer* const transfer = shard->transfer;
+	
+	shard->holding = 0;
+	
+	mutex_lock(&shard->lock);
+	
+	if (shard->queued > 0) {
+		transfer_queue_pop_front(shard, download);
+		mutex_unlock(&shard->lock);
+		
+		return 1;
+	}
+	
+	mutex_unlock(&shard->lock);
+	
+	/*
+	Ask the producer for up to a whole window worth of downloads at once. The first
+	one is started right away; the rest stays in our queue where it can be stolen.
+	
+	Lock order is always transfer then shard; stealing only ever holds the lock of
+	the victim, so this can not deadlock.
+	*/
+	size_t produced = 0;
+	
+	mutex_lock(&transfer->lock);
+	
+	while (transfer->code == UERR_SUCCESS && !transfer->exhausted && produced < shard->window) {
+		struct Download item = {0};
+		
+		const int status = (*transfer->next)(&item, transfer->userdata);
+		
+		if (status == 0) {
+			transfer->exhausted = 1;
+			break;
+		}
+		
+		if (status == TRANSFER_NEXT_LATER) {
+			shard->holding = 1;
+			break;
+		}
+		
+		if (status < 0) {
+			free(item.url);
+			free(item.filename);
+			
+			transfer->code = status;
+			break;
+		}
+		
+		transfer->produced++;
+		
+		if (produced == 0) {
+			*download = item;
+		} else {
+			mutex_lock(&shard->lock);
+			transfer_queue_push(shard, &item);
+			mutex_unlock(&shard->lock);
+		}
+		
+		produced++;
+	}
+	
+	const int code = transfer->code;
+	
+	mutex_unlock(&transfer->lock);
+	
+	if (produced > 0) {
+		return 1;
+	}
+	
+	if (code != UERR_SUCCESS) {
+		return code;
+	}
+	
+	for (size_t offset = 1; offset < shard->count; offset++) {
+		struct TransferShard* const victim = &shard->shards[(shard->index + offset) % shard->count];
+		
+		mutex_lock(&victim->lock);
+		
+		const size_t stolen = (victim->queued + 1) / 2;
+		
+		if (stolen == 0) {
+			mutex_unlock(&victim->lock);
+			continue;
+		}
+		
+		/*
+		Our own queue is empty (and only we ever push to it), so everything we take
+		fits. The items are taken from the back of the victim's queue, the part it
+		would have got to last.
+		*/
+		struct Download items[stolen];
+		
+		for (size_t index = 0; index < stolen; index++) {
+			transfer_queue_pop_back(victim, &items[index]);
+		}
+		
+		mutex_unlock(&victim->lock);
+		
+		*download = items[stolen - 1];
+		
+		mutex_lock(&shard->lock);
+		
+		for (size_t index = stolen - 1; index-- > 0;) {
+			transfer_queue_push(shard, &items[index]);
+		}
+		
+		mutex_unlock(&shard->lock);
+		
+		return 1;
+	}
+	
+	return 0;
+	
+}
+
+static void download_free(struct Download* const download) {
+	
+	if (download->handle != NULL) {
+		curl_easy_release(download->handle);
+		download->handle = NULL;
+	}
+	
+	if (download->stream != NULL) {
+		fstream_close(download->stream);
+		download->stream = NULL;
+	}
+	
+	free(download->buffer.data);
+	memset(&download->buffer, 0, sizeof(download->buffer));
+	
+	free(download->url);
+	download->url = NULL;
+	
+	free(download->filename);
+	download->filename = NULL;
+	
+}
+
+static void download_get_hedge_filename(const struct Download* const download, char* const filename) {
+	/*
+	"filename" must fit strlen(download->filename) + sizeof(TRANSFER_HEDGE_EXTENSION) bytes.
+	*/
+	
+	strcpy(filename, download->filename);
+	strcat(filename, TRANSFER_HEDGE_EXTENSION);
+	
+}
+
+static struct FStream* download_open(const struct Download* const download, const char* const filename, const curl_off_t resumed) {
+	/*
+	Opens the output file of a download, ready to receive its response after the
+	first "resumed" bytes: a whole file is truncated if there are none, anything
+	else is written in place.
+	*/
+	
+	if (download->length == 0 && resumed == 0) {
+		return fstream_open(filename, "wb");
+	}
+	
+	struct FStream* const stream = fstream_open(filename, "r+b");
+	
+	if (stream == NULL) {
+		return NULL;
+	}
+	
+	if (!fstream_seek(stream, (long long) (download->offset + resumed), FSTREAM_SEEK_BEGIN)) {
+		fstream_close(stream);
+		return NULL;
+	}
+	
+	return stream;
+	
+}
+
+static void download_set_range(const struct Download* const download, CURL* const handle, const curl_off_t resumed) {
+	/*
+	Makes the request of a download skip the first "resumed" bytes of its response.
+	*/
+	
+	if (download->length > 0) {
+		char range[64];
+		snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T, download->offset + resumed, download->offset + download->length - 1);
+		
+		curl_easy_setopt(handle, CURLOPT_RANGE, range);
+		
+		/*
+		A server that ignores the range would send the whole file over the bytes of
+		other ranges; make the request fail as soon as it says so instead.
+		*/
+		curl_easy_setopt(handle, CURLOPT_MAXFILESIZE_LARGE, download->length - resumed);
+	} else {
+		/*
+		Should the server not honour this, curl fails with CURLE_RANGE_ERROR.
+		*/
+		curl_easy_setopt(handle, CURLOPT_RESUME_FROM_LARGE, resumed);
+	}
+	
+}
+
+static void download_set_output(const struct Download* const download, CURL* const handle, struct FStream* const stream, struct DownloadBuffer* const buffer) {
+	
+	if (download->filename == NULL) {
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, curl_write_buffer_cb);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void*) buffer);
+	} else {
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, curl_write_file_cb);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void*) stream);
+	}
+	
+}
+
+static void download_set_route(struct Download* const download, CURL* const handle) {
+	/*
+	Picks the address family and address of its host a request of a download goes
+	to, and the interface it goes out through. Whatever an earlier attempt (or a
+	hedged request) used is replaced. The address the original request was steered
+	to is remembered, since libcurl does not tell which one it failed to connect to.
+	*/
+	
+	if (download->host != NULL) {
+		const long ipresolve = host_get_ipresolve(download->host);
+		const struct HostAddress* const address = host_get_address(download->host);
+		
+		curl_easy_setopt(handle, CURLOPT_IPRESOLVE, (ipresolve == CURL_IPRESOLVE_WHATEVER) ? curl_get_ipresolve() : ipresolve);
+		curl_easy_setopt(handle, CURLOPT_CONNECT_TO, (address == NULL) ? NULL : address->connect_to);
+		
+		if (handle == download->handle) {
+			download->address = address;
+		}
+	}
+	
+	curl_easy_setopt(handle, CURLOPT_INTERFACE, (download->interface == NULL) ? NULL : download->interface->name);
+	
+}
+
+static int download_start(struct Download* const download, const char* const filename, const curl_off_t resumed, CURL** const handle, struct FStream** const stream, struct DownloadBuffer* const buffer) {
+	/*
+	Opens "filename" and sets up a new transfer of the download writing into it.
+	The original request of a download writes into the download's own output file
+	(continuing after the bytes "resumed" from earlier attempts); a hedged one into
+	a sibling file, from scratch, until it is known which of them wins. Downloads
+	without an output file are received into "buffer" the same way.
+	
+	Returns UERR_SUCCESS on success, UERR_TRANSFER_TOO_MANY_FILES if the process
+	ran out of file descriptors, or another UERR_* code on error.
+	*/
+	
+	if (filename == NULL) {
+		buffer->offset = (size_t) resumed;
+	} else {
+		*stream = download_open(download, filename, resumed);
+	}
+	
+	if (filename != NULL && *stream == NULL) {
+		if (errno == EMFILE) {
+			return UERR_TRANSFER_TOO_MANY_FILES;
+		}
+		
+		const struct SystemError error = get_system_error();
+		
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", filename, error.message);
+		return UERR_FSTREAM_FAILURE;
+	}
+	
+	*handle = curl_easy_acquire();
+	
+	if (*handle == NULL) {
+		return UERR_CURL_FAILURE;
+	}
+	
+	curl_easy_setopt(*handle, CURLOPT_PRIVATE, (void*) download);
+	curl_easy_setopt(*handle, CURLOPT_URL, download->url);
+	curl_easy_setopt(*handle, CURLOPT_FOLLOWLOCATION, 1L);
+	
+	download_set_range(download, *handle, resumed);
+	
+	if (download->max_size > 0) {
+		curl_easy_setopt(*handle, CURLOPT_MAXFILESIZE_LARGE, download->max_size);
+	}
+	
+	download_set_route(download, *handle);
+	download_set_output(download, *handle, *stream, buffer);
+	
+	return UERR_SUCCESS;
+	
+}
+
+static void download_discard_hedge(struct Download* const download) {
+	/*
+	Drops the hedged request of a download (which must not be attached to a multi
+	handle anymore) along with whatever it wrote so far.
+	*/
+	
+	if (download->hedge != NULL) {
+		curl_easy_release(download->hedge);
+		download->hedge = NULL;
+	}
+	
+	if (download->hedge_stream != NULL) {
+		fstream_close(download->hedge_stream);
+		download->hedge_stream = NULL;
+		
+		char filename[strlen(download->filename) + sizeof(TRANSFER_HEDGE_EXTENSION)];
+		download_get_hedge_filename(download, filename);
+		
+		remove_file(filename);
+	}
+	
+	free(download->hedge_buffer.data);
+	memset(&download->hedge_buffer, 0, sizeof(download->hedge_buffer));
+	
+}
+
+static void transfer_record_resolve(struct TransferStatistics* const statistics, const curl_off_t microseconds) {
+	
+	size_t bucket = 0;
+	curl_off_t limit = 1000;
+	
+	while (bucket < TRANSFER_RESOLVE_BUCKETS - 1 && microseconds >= limit) {
+		bucket++;
+		limit *= 2;
+	}
+	
+	statistics->resolves++;
+	statistics->resolve_times[bucket]++;
+	
+}
+
+static void transfer_print_progress(const struct Transfer* const transfer) {
+	
+	const size_t progress = (transfer->total < 1) ? 0 : (transfer->done * 100) / transfer->total;
+	
+	if (transfer->concurrency < 1) {
+		printf("\r+ Atualmente em progresso: %zu%% / 100%%\r", progress);
+	} else {
+		printf("\r+ Atualmente em progresso: %zu%% / 100%% (limite de %zu conexões)  \r", progress, transfer->concurrency);
+	}
+	
+	fflush(stdout);
+	
+}
+
+static int transfer_is_congested(CURL* const handle, const CURLcode result) {
+	/*
+	Whether a failed transfer means the server (or the path to it) is overloaded.
+	*/
+	
+	if (result == CURLE_OPERATION_TIMEDOUT) {
+		return 1;
+	}
+	
+	if (result != CURLE_HTTP_RETURNED_ERROR) {
+		return 0;
+	}
+	
+	long status_code = 0;
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status_code);
+	
+	return status_code == 429 || status_code == 503;
+	
+}
+
+static int transfer_is_unreachable(CURL* const handle, const CURLcode result) {
+	/*
+	Whether a failed transfer never got connected to the address it tried.
+	*/
+	
+	if (result == CURLE_COULDNT_CONNECT) {
+		return 1;
+	}
+	
+	if (result != CURLE_OPERATION_TIMEDOUT) {
+		return 0;
+	}
+	
+	curl_off_t connect_time = 0;
+	curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect_time);
+	
+	return connect_time == 0;
+	
+}
+
+static int transfer_shard_attach(struct TransferShard* const shard, CURL* const handle) {
+	/*
+	Adds a transfer to the shard's multi handle, limited to the share of the
+	global bandwidth budget its priority class is entitled to.
+	*/
+	
+	const enum BandwidthClass priority = shard->transfer->priority;
+	
+	bandwidth_acquire(priority);
+	shard->shaped++;
+	
+	curl_easy_setopt(handle, CURLOPT_MAX_RECV_SPEED_LARGE, bandwidth_get_share(priority));
+	
+	if (curl_multi_add_handle(shard->multi, handle) != CURLM_OK) {
+		return UERR_CURLM_FAILURE;
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static void transfer_shard_detach(struct TransferShard* const shard, CURL* const handle) {
+	
+	curl_multi_remove_handle(shard->multi, handle);
+	
+	bandwidth_release(shard->transfer->priority, 1);
+	shard->shaped--;
+	
+}
+
+static void transfer_shard_reshape(struct TransferShard* const shard) {
+	/*
+	Applies the current bandwidth share to the transfers of this shard whenever
+	transfers of any shard (or metadata requests) started or stopped since the
+	last time.
+	*/
+	
+	const unsigned long generation = bandwidth_get_generation();
+	
+	if (generation == shard->shaping) {
+		return;
+	}
+	
+	shard->shaping = generation;
+	
+	const curl_off_t share = bandwidth_get_share(shard->transfer->priority);
+	
+	for (size_t index = 0; index < shard->capacity; index++) {
+		struct Download* const download = &shard->slots[index];
+		
+		if (download->handle != NULL) {
+			curl_easy_setopt(download->handle, CURLOPT_MAX_RECV_SPEED_LARGE, share);
+		}
+		
+		if (download->hedge != NULL) {
+			curl_easy_setopt(download->hedge, CURLOPT_MAX_RECV_SPEED_LARGE, share);
+		}
+	}
+	
+}
+
+static int transfer_shard_start(struct TransferShard* const shard, struct Download* const download) {
+	/*
+	Starts a download, unless its host can not take another request right now
+	(it is paused, rate limited or at its connection limit). In that case the
+	download is parked in the timer heap until the host is expected to be ready,
+	without holding back downloads from other hosts.
+	
+	Returns UERR_SUCCESS if the download was either started or parked, or one of
+	the UERR_* codes of download_start() on error.
+	*/
+	
+	if (download->host == NULL) {
+		download->host = hosts_get(download->url);
+	}
+	
+	const long long wait = (download->host == NULL) ? 0 : host_acquire(download->host);
+	
+	if (wait > 0) {
+		download->retry_at = get_monotonic_time() + wait;
+		transfer_timers_push(shard, download);
+		
+		return UERR_SUCCESS;
+	}
+	
+	download->interface = interfaces_next(NULL);
+	
+	int status = download_start(download, download->filename, download->resumed, &download->handle, &download->stream, &download->buffer);
+	
+	if (status == UERR_SUCCESS) {
+		status = transfer_shard_attach(shard, download->handle);
+		download->started_at = get_monotonic_time();
+	}
+	
+	if (status != UERR_SUCCESS) {
+		if (download->host != NULL) {
+			host_release(download->host, 0);
+		}
+		
+		if (download->handle != NULL) {
+			curl_easy_release(download->handle);
+			download->handle = NULL;
+		}
+	}
+	
+	return status;
+	
+}
+
+static int transfer_shard_resume(struct TransferShard* const shard) {
+	/*
+	Starts the parked downloads that are due, and attaches again the ones whose
+	retry is due. The latter continue right after the bytes their earlier attempts
+	already wrote. Either way, they wait some more if their host can not take
+	another request right now (see transfer_shard_start()).
+	*/
+	
+	const long long now = get_monotonic_time();
+	
+	while (shard->timers_offset > 0 && shard->timers[0]->retry_at <= now) {
+		struct Download* const download = transfer_timers_pop(shard);
+		
+		if (download->handle == NULL) {
+			const int status = transfer_shard_start(shard, download);
+			
+			if (status == UERR_TRANSFER_TOO_MANY_FILES) {
+				download->retry_at = now + TRANSFER_BLOCKED_WAIT_TIME;
+				transfer_timers_push(shard, download);
+				
+				continue;
+			}
+			
+			if (status != UERR_SUCCESS) {
+				return status;
+			}
+			
+			continue;
+		}
+		
+		const long long wait = (download->host == NULL) ? 0 : host_acquire(download->host);
+		
+		if (wait > 0) {
+			download->retry_at = now + wait;
+			transfer_timers_push(shard, download);
+			
+			continue;
+		}
+		
+		if (download->stream != NULL) {
+			fstream_close(download->stream);
+			download->stream = NULL;
+		}
+		
+		if (download->filename == NULL) {
+			download->buffer.offset = (size_t) download->resumed;
+		} else {
+			download->stream = download_open(download, download->filename, download->resumed);
+			
+			if (download->stream == NULL) {
+				const struct SystemError error = get_system_error();
+				
+				if (download->host != NULL) {
+					host_release(download->host, 0);
+				}
+				
+				fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar criar o arquivo em '%s': %s\r\n", download->filename, error.message);
+				return UERR_FSTREAM_FAILURE;
+			}
+		}
+		
+		/*
+		The handle may be the one of a failed hedged request, which wrote somewhere
+		else. The retry gets a route of its own, rather than going back to the
+		address and interface that just failed.
+		*/
+		download->interface = interfaces_next(download->interface);
+		
+		download_set_output(download, download->handle, download->stream, &download->buffer);
+		download_set_range(download, download->handle, download->resumed);
+		download_set_route(download, download->handle);
+		
+		const int status = transfer_shard_attach(shard, download->handle);
+		
+		download->started_at = get_monotonic_time();
+		
+		if (status != UERR_SUCCESS) {
+			return status;
+		}
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int transfer_shard_hedge(struct TransferShard* const shard) {
+	/*
+	Fires a duplicate request for each straggler of this shard once the transfer
+	is about to finish (see TRANSFER_HEDGE_DOWNLOADS). Each download is hedged at
+	most once, and only if its host can take another request right away.
+	
+	Returns UERR_SUCCESS, or one of the UERR_* codes of download_start() on error.
+	*/
+	
+	struct Transfer* const transfer = shard->transfer;
+	
+	mutex_lock(&transfer->lock);
+	
+	const int finishing = transfer->exhausted && transfer->produced - transfer->done <= TRANSFER_HEDGE_DOWNLOADS;
+	const long long average = (transfer->done == 0) ? 0 : transfer->elapsed / (long long) transfer->done;
+	
+	mutex_unlock(&transfer->lock);
+	
+	if (!finishing) {
+		return UERR_SUCCESS;
+	}
+	
+	long long delay = average * TRANSFER_HEDGE_FACTOR;
+	
+	if (delay < TRANSFER_HEDGE_MIN_DELAY) {
+		delay = TRANSFER_HEDGE_MIN_DELAY;
+	}
+	
+	const long long now = get_monotonic_time();
+	
+	for (size_t index = 0; index < shard->capacity; index++) {
+		struct Download* const download = &shard->slots[index];
+		
+		/*
+		Only downloads that are actually in flight; not the ones waiting for a
+		retry or for their host.
+		*/
+		if (download->handle == NULL || download->started_at == 0 || download->hedged) {
+			continue;
+		}
+		
+		/*
+		Byte ranges are written in place, so there is no output file of their own a
+		duplicate could race into.
+		*/
+		if (download->length > 0) {
+			continue;
+		}
+		
+		if (now - download->started_at < delay) {
+			continue;
+		}
+		
+		if (download->host != NULL && host_acquire(download->host) > 0) {
+			continue;
+		}
+		
+		int status = UERR_SUCCESS;
+		
+		if (download->filename == NULL) {
+			status = download_start(download, NULL, 0, &download->hedge, &download->hedge_stream, &download->hedge_buffer);
+		} else {
+			char filename[strlen(download->filename) + sizeof(TRANSFER_HEDGE_EXTENSION)];
+			download_get_hedge_filename(download, filename);
+			
+			status = download_start(download, filename, 0, &download->hedge, &download->hedge_stream, &download->hedge_buffer);
+		}
+		
+		if (status == UERR_SUCCESS) {
+			/*
+			A duplicate multiplexed over the same (possibly slow) connection, or sent
+			to the same (possibly slow) address, as the original request would not
+			help much.
+			*/
+			curl_easy_setopt(download->hedge, CURLOPT_FRESH_CONNECT, 1L);
+			curl_easy_setopt(download->hedge, CURLOPT_CONNECT_TO, NULL);
+			
+			const struct Interface* const interface = interfaces_next(download->interface);
+			
+			if (interface != NULL) {
+				curl_easy_setopt(download->hedge, CURLOPT_INTERFACE, interface->name);
+			}
+			
+			status = transfer_shard_attach(shard, download->hedge);
+		}
+		
+		if (status != UERR_SUCCESS) {
+			if (download->host != NULL) {
+				host_release(download->host, 0);
+			}
+			
+			download_discard_hedge(download);
+			
+			/*
+			Hedging is only an optimization; running out of file descriptors just
+			means we do not get to do it right now.
+			*/
+			if (status == UERR_TRANSFER_TOO_MANY_FILES) {
+				return UERR_SUCCESS;
+			}
+			
+			return status;
+		}
+		
+		download->hedged = 1;
+		
+		mutex_lock(&transfer->lock);
+		transfer->statistics.hedges++;
+		mutex_unlock(&transfer->lock);
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+static void transfer_report_failure(const struct Download* const download, const CURLcode result) {
+	
+	erase_line();
+	
+	if (result == CURLE_HTTP_RETURNED_ERROR) {
+		long status_code = 0;
+		curl_easy_getinfo(download->handle, CURLINFO_RESPONSE_CODE, &status_code);
+		
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar baixar de '%s' (%zu tentativas): o servidor respondeu com o código HTTP %li\r\n", download->url, download->retries + 1, status_code);
+	} else {
+		fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar baixar de '%s' (%zu tentativas): %s\r\n", download->url, download->retries + 1, curl_easy_strerror(result));
+	}
+	
+}
+
+static int transfer_shard_run(void* const argument) {
+	/*
+	Event loop of a single shard, keeping at most "window" transfers in flight on
+	the shard's multi handle. A new download is only requested after another one
+	completes, so resource usage does not grow with the number of downloads.
+	*/
+	
+	struct TransferShard* const shard = (struct TransferShard*) argument;
+	struct Transfer* const transfer = shard->transfer;
+	
+	int code = transfer_loop_init(&shard->loop, shard->multi);
+	
+	if (code != UERR_SUCCESS) {
+		transfer_set_code(transfer, code);
+		return code;
+	}
+	
+	/*
+	Downloads occupying a slot: in flight, waiting for a retry or parked until
+	their host is ready.
+	*/
+	size_t running = 0;
+	
+	while (1) {
+		code = transfer_shard_resume(shard);
+		
+		if (code != UERR_SUCCESS) {
+			break;
+		}
+		
+		while (running < shard->window) {
+			struct Download* download = NULL;
+			
+			for (size_t index = 0; index < shard->capacity; index++) {
+				struct Download* const subdownload = &shard->slots[index];
+				
+				if (subdownload->handle == NULL && subdownload->url == NULL) {
+					download = subdownload;
+					break;
+				}
+			}
+			
+			const int next = transfer_shard_next(shard, download);
+			
+			if (next == 0) {
+				break;
+			}
+			
+			if (next < 0) {
+				code = next;
+				break;
+			}
+			
+			const int status = transfer_shard_start(shard, download);
+			
+			if (status == UERR_TRANSFER_TOO_MANY_FILES && running > 0) {
+				/*
+				Shrink the window to whatever is currently in flight; this download
+				is parked for a little while and started once some file descriptor
+				got freed. The window grows back as later starts succeed.
+				*/
+				download->retry_at = get_monotonic_time() + TRANSFER_BLOCKED_WAIT_TIME;
+				transfer_timers_push(shard, download);
+				
+				running++;
+				shard->window = running;
+				
+				break;
+			}
+			
+			if (status != UERR_SUCCESS) {
+				code = status;
+				break;
+			}
+			
+			running++;
+			
+			/*
+			Starts succeed again; win back the window lost to running out of file
+			descriptors, one download at a time.
+			*/
+			if (shard->window < shard->capacity && running == shard->window) {
+				shard->window++;
+			}
+		}
+		
+		/*
+		A shard with nothing running keeps going while the producer is only holding
+		off; it is asked again once the wait below times out.
+		*/
+		if (code != UERR_SUCCESS || (running == 0 && !shard->holding)) {
+			break;
+		}
+		
+		code = transfer_shard_hedge(shard);
+		
+		if (code != UERR_SUCCESS) {
+			break;
+		}
+		
+		int timeout = shard->holding ? TRANSFER_HOLD_WAIT_TIME : TRANSFER_WAIT_TIME;
+		
+		if (shard->timers_offset > 0) {
+			const long long remaining = shard->timers[0]->retry_at - get_monotonic_time();
+			
+			if (remaining < timeout) {
+				timeout = (remaining < 0) ? 0 : (int) remaining;
+			}
+		}
+		
+		transfer_shard_reshape(shard);
+		
+		code = transfer_loop_wait(&shard->loop, timeout);
+		
+		if (code != UERR_SUCCESS) {
+			break;
+		}
+		
+		CURLMsg* msg = NULL;
+		int msgs_left = 0;
+		
+		while ((msg = curl_multi_info_read(shard->multi, &msgs_left))) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			
+			struct Download* download = NULL;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &download);
+			
+			transfer_shard_detach(shard, msg->easy_handle);
+			
+			const int hedge = (msg->easy_handle == download->hedge);
+			
+			/*
+			A response larger than the download allows is not a failure; it is
+			completed as it is and left for the caller to fetch some other way.
+			*/
+			download->declined = (msg->data.result == CURLE_FILESIZE_EXCEEDED && download->max_size > 0 && download->length == 0);
+			
+			if (msg->data.result != CURLE_OK && !download->declined) {
+				/*
+				Whatever the original request received made it to the output file; a
+				retry continues from there.
+				*/
+				if (!hedge) {
+					curl_off_t bytes = 0;
+					curl_easy_getinfo(msg->easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+					
+					download->resumed += bytes;
+				}
+				
+				if (download->host != NULL && transfer_is_unreachable(msg->easy_handle, msg->data.result)) {
+					char* address = NULL;
+					curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIMARY_IP, &address);
+					
+					if ((address == NULL || *address == '\0') && !hedge && download->address != NULL) {
+						address = download->address->address;
+					}
+					
+					host_demote_address(download->host, address);
+				}
+				
+				if (download->host != NULL && transfer_is_congested(msg->easy_handle, msg->data.result)) {
+					host_congested(download->host);
+					
+					const long long retry_after = curl_get_retry_after(msg->easy_handle);
+					
+					if (retry_after > 0) {
+						host_pause(download->host, retry_after);
+					}
+				}
+				
+				/*
+				One of the two requests of a hedged download failed; as long as the
+				other one is still in flight, simply drop this one.
+				*/
+				if (download->hedge != NULL && download->handle != NULL) {
+					if (hedge) {
+						download_discard_hedge(download);
+					} else {
+						curl_easy_release(download->handle);
+						download->handle = NULL;
+						
+						if (download->stream != NULL) {
+							fstream_close(download->stream);
+							download->stream = NULL;
+						}
+					}
+					
+					if (download->host != NULL) {
+						host_release(download->host, 0);
+					}
+					
+					continue;
+				}
+				
+				/*
+				Both failed; retry the hedged request as if it was the original one.
+				It is attached again with a fresh output file by transfer_shard_resume().
+				*/
+				if (hedge) {
+					CURL* const handle = download->hedge;
+					download->hedge = NULL;
+					
+					download_discard_hedge(download);
+					download->handle = handle;
+				}
+				
+				download->started_at = 0;
+				
+				long long delay = curl_is_transient(download->handle, msg->data.result) ? curl_get_retry_delay(download->handle, download->retries + 1) : -1;
+				
+				/*
+				The server would not continue where the last attempt stopped; start
+				over from scratch instead.
+				*/
+				if (msg->data.result == CURLE_RANGE_ERROR && download->resumed > 0) {
+					download->resumed = 0;
+					delay = 0;
+				}
+				
+				if (delay < 0) {
+					transfer_report_failure(download, msg->data.result);
+					
+					code = UERR_TRANSFER_RETRIES_EXHAUSTED;
+					break;
+				}
+				
+				download->retries++;
+				download->retry_at = get_monotonic_time() + delay;
+				
+				/*
+				The retry goes through host_acquire() again once it is due, so it also
+				waits for a pause or rate limit of its host.
+				*/
+				if (download->host != NULL) {
+					host_release(download->host, 0);
+				}
+				
+				transfer_timers_push(shard, download);
+				
+				continue;
+			}
+			
+			if (hedge) {
+				/*
+				The hedged request won; the original one is cancelled and the hedged
+				one takes its place.
+				*/
+				if (download->handle != NULL) {
+					transfer_shard_detach(shard, download->handle);
+					curl_easy_release(download->handle);
+					
+					if (download->host != NULL) {
+						host_release(download->host, 0);
+					}
+				}
+				
+				if (download->stream != NULL) {
+					fstream_close(download->stream);
+				}
+				
+				free(download->buffer.data);
+				
+				download->handle = download->hedge;
+				download->stream = download->hedge_stream;
+				download->buffer = download->hedge_buffer;
+				
+				download->hedge = NULL;
+				download->hedge_stream = NULL;
+				memset(&download->hedge_buffer, 0, sizeof(download->hedge_buffer));
+			} else if (download->hedge != NULL) {
+				transfer_shard_detach(shard, download->hedge);
+				download_discard_hedge(download);
+				
+				if (download->host != NULL) {
+					host_release(download->host, 0);
+				}
+			}
+			
+			if (download->stream != NULL) {
+				fstream_close(download->stream);
+				download->stream = NULL;
+			}
+			
+			if (hedge && download->filename != NULL) {
+				char filename[strlen(download->filename) + sizeof(TRANSFER_HEDGE_EXTENSION)];
+				download_get_hedge_filename(download, filename);
+				
+				if (move_file(filename, download->filename) != 0) {
+					const struct SystemError error = get_system_error();
+					
+					fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar mover o arquivo de '%s' para '%s': %s\r\n", filename, download->filename, error.message);
+					
+					code = UERR_FSTREAM_FAILURE;
+					break;
+				}
+			}
+			
+			if (download->length > 0) {
+				curl_off_t bytes = 0;
+				curl_easy_getinfo(download->handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+				
+				if (download->resumed + bytes != download->length) {
+					erase_line();
+					
+					fprintf(stderr, "- Ocorreu uma falha inesperada ao tentar baixar de '%s': %s\r\n", download->url, strurr(UERR_TRANSFER_RANGE_MISMATCH));
+					
+					code = UERR_TRANSFER_RANGE_MISMATCH;
+					break;
+				}
+			}
+			
+			const long long elapsed = get_monotonic_time() - download->started_at;
+			
+			curl_off_t resolve_time = 0;
+			long connects = 0;
+			
+			curl_easy_getinfo(download->handle, CURLINFO_NAMELOOKUP_TIME_T, &resolve_time);
+			curl_easy_getinfo(download->handle, CURLINFO_NUM_CONNECTS, &connects);
+			
+			if (connects > 0 && download->host != NULL) {
+				char* address = NULL;
+				curl_easy_getinfo(download->handle, CURLINFO_PRIMARY_IP, &address);
+				
+				host_set_primary_address(download->host, address);
+			}
+			
+			if (download->host != NULL) {
+				curl_off_t bytes = 0;
+				curl_off_t speed = 0;
+				curl_off_t pretransfer = 0;
+				curl_off_t starttransfer = 0;
+				char* address = NULL;
+				
+				curl_easy_getinfo(download->handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+				curl_easy_getinfo(download->handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+				curl_easy_getinfo(download->handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+				curl_easy_getinfo(download->handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+				curl_easy_getinfo(download->handle, CURLINFO_PRIMARY_IP, &address);
+				
+				host_record_transfer(download->host, address, bytes, speed, starttransfer - pretransfer);
+				host_release(download->host, bytes);
+			}
+			
+			/*
+			Hedged requests may have gone out through another interface; they are
+			not accounted to any.
+			*/
+			if (download->interface != NULL && !hedge) {
+				curl_off_t bytes = 0;
+				curl_easy_getinfo(download->handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+				
+				interface_record(download->interface, bytes);
+			}
+			
+			const int received = (transfer->received == NULL) ? UERR_SUCCESS : (*transfer->received)(download, transfer->userdata);
+			
+			mutex_lock(&transfer->lock);
+			
+			if (connects > 0) {
+				transfer_record_resolve(&transfer->statistics, resolve_time);
+			}
+			
+			const int status = (received != UERR_SUCCESS || transfer->complete == NULL) ? received : (*transfer->complete)(download, transfer->userdata);
+			
+			if (status != UERR_SUCCESS && transfer->code == UERR_SUCCESS) {
+				transfer->code = status;
+			}
+			
+			transfer->done++;
+			transfer->elapsed += elapsed;
+			
+			if (hedge) {
+				transfer->statistics.hedges_won++;
+			}
+			
+			if (download->host != NULL) {
+				transfer->concurrency = host_get_limit(download->host);
+			}
+			
+			transfer_print_progress(transfer);
+			
+			mutex_unlock(&transfer->lock);
+			
+			download_free(download);
+			running--;
+		}
+		
+		if (code != UERR_SUCCESS) {
+			break;
+		}
+		
+		/*
+		Some other shard (or a completion callback) failed; stop as well.
+		*/
+		code = transfer_get_code(transfer);
+		
+		if (code != UERR_SUCCESS) {
+			break;
+		}
+	}
+	
+	if (code != UERR_SUCCESS) {
+		transfer_set_code(transfer, code);
+	}
+	
+	bandwidth_release(transfer->priority, shard->shaped);
+	shard->shaped = 0;
+	
+	for (size_t index = 0; index < shard->capacity; index++) {
+		struct Download* const download = &shard->slots[index];
+		
+		/*
+		Downloads waiting for a retry gave their host connection back already.
+		*/
+		if (download->handle != NULL) {
+			curl_multi_remove_handle(shard->multi, download->handle);
+			
+			if (download->host != NULL && download->started_at != 0) {
+				host_release(download->host, 0);
+			}
+		}
+		
+		if (download->hedge != NULL) {
+			curl_multi_remove_handle(shard->multi, download->hedge);
+			
+			if (download->host != NULL) {
+				host_release(download->host, 0);
+			}
+		}
+		
+		download_discard_hedge(download);
+		
+		/*
+		Unfinished downloads leave nothing behind. Byte ranges are part of a file
+		the caller owns (and may want to continue later).
+		*/
+		if (download->stream != NULL) {
+			fstream_close(download->stream);
+			download->stream = NULL;
+			
+			if (download->length == 0) {
+				remove_file(download->filename);
+			}
+		}
+		
+		download_free(download);
+	}
+	
+	transfer_loop_free(&shard->loop);
+	
+	return code;
+	
+}
+
+int transfer_perform(struct Transfer* const transfer) {
+	/*
+	Downloads everything the producer hands out, keeping at most "window"
+	transfers (and thus open files and easy handles) in flight at once.
+	
+	The window is split between "workers" shards, each one running its own event
+	loop on its own thread. Both the producer and the completion callback are
+	always called with the transfer lock held, so they do not need to be
+	thread-safe themselves.
+	*/
+	
+	if (transfer->window < 1) {
+		transfer->window = TRANSFER_DEFAULT_WINDOW;
+	}
+	
+	if (transfer->workers < 1) {
+		transfer->workers = (size_t) get_cpu_count();
+		
+		if (transfer->workers > TRANSFER_MAX_WORKERS) {
+			transfer->workers = TRANSFER_MAX_WORKERS;
+		}
+	}
+	
+	if (transfer->workers > transfer->window) {
+		transfer->workers = transfer->window;
+	}
+	
+	const size_t count = transfer->workers;
+	const size_t window = (transfer->window + count - 1) / count;
+	
+	struct TransferShard* const shards = calloc(count, sizeof(*shards));
+	
+	if (shards == NULL) {
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	if (hosts_initialize() != UERR_SUCCESS || interfaces_initialize() != UERR_SUCCESS || !mutex_init(&transfer->lock)) {
+		free(shards);
+		return UERR_MEMORY_ALLOCATE_FAILURE;
+	}
+	
+	transfer->exhausted = 0;
+	transfer->code = UERR_SUCCESS;
+	
+	int code = UERR_SUCCESS;
+	size_t initialized = 0;
+	
+	for (; initialized < count; initialized++) {
+		struct TransferShard* const shard = &shards[initialized];
+		
+		shard->transfer = transfer;
+		shard->shards = shards;
+		shard->count = count;
+		shard->index = initialized;
+		shard->window = window;
+		shard->capacity = window;
+		shard->multi = get_worker_curl_multi(initialized);
+		
+		if (shard->multi == NULL) {
+			code = UERR_CURL_FAILURE;
+			break;
+		}
+		
+		shard->slots = calloc(window, sizeof(*shard->slots));
+		shard->queue = calloc(window, sizeof(*shard->queue));
+		shard->timers = calloc(window, sizeof(*shard->timers));
+		
+		if (shard->slots == NULL || shard->queue == NULL || shard->timers == NULL || !mutex_init(&shard->lock)) {
+			free(shard->slots);
+			free(shard->queue);
+			free(shard->timers);
+			
+			code = UERR_MEMORY_ALLOCATE_FAILURE;
+			break;
+		}
+	}
+	
+	if (code == UERR_SUCCESS) {
+		transfer_print_progress(transfer);
+		
+		/*
+		Shards that could not get a thread of their own are simply left out; the
+		remaining ones pick up their share of the work.
+		*/
+		shards[0].started = 1;
+		
+		for (size_t index = 1; index < count; index++) {
+			struct TransferShard* const shard = &shards[index];
+			shard->started = 1;
+			
+			if (!thread_create(&shard->thread, transfer_shard_run, (void*) shard)) {
+				shard->started = 0;
+			}
+		}
+		
+		transfer_shard_run((void*) &shards[0]);
+		
+		for (size_t index = 1; index < count; index++) {
+			struct TransferShard* const shard = &shards[index];
+			
+			if (shard->started) {
+				thread_join(&shard->thread);
+			}
+		}
+		
+		code = transfer->code;
+	}
+	
+	for (size_t index = 0; index < initialized; index++) {
+		struct TransferShard* const shard = &shards[index];
+		
+		/*
+		Downloads still queued when the transfer was aborted.
+		*/
+		while (shard->queued > 0) {
+			struct Download download = {0};
+			transfer_queue_pop_front(shard, &download);
+			download_free(&download);
+		}
+		
+		mutex_destroy(&shard->lock);
+		
+		free(shard->slots);
+		free(shard->queue);
+		free(shard->timers);
+	}
+	
+	free(shards);
+	mutex_destroy(&transfer->lock);
+	
+	return code;
+	
+}
+
+void transfer_print_statistics(const struct Transfer* const transfer) {
+	/*
+	Prints the counters collected during the transfer. Only done when the
+	"SPARKLEC_STATISTICS" environment variable is set.
+	*/
+	
+	const char* const value = getenv("SPARKLEC_STATISTICS");
+	
+	if (value == NULL || *value == '\0') {
+		return;
+	}
+	
+	const struct TransferStatistics* const statistics = &transfer->statistics;
+	
+	fprintf(stderr, "+ Tempo de resolução de nomes em %zu novas conexões:\r\n", statistics->resolves);
+	
+	for (size_t index = 0; index < TRANSFER_RESOLVE_BUCKETS; index++) {
+		if (index == TRANSFER_RESOLVE_BUCKETS - 1) {
+			fprintf(stderr, "+   %u ms ou mais: %zu\r\n", 1u << (index - 1), statistics->resolve_times[index]);
+		} else {
+			fprintf(stderr, "+   menos de %u ms: %zu\r\n", 1u << index, statistics->resolve_times[index]);
+		}
+	}
+	
+	fprintf(stderr, "+ Requisições duplicadas para downloads lentos: %zu (%zu terminaram antes da original)\r\n", statistics->hedges, statistics->hedges_won);
+	
+	curl_off_t wire = 0;
+	curl_off_t decoded = 0;
+	
+	curl_get_metadata_sizes(&wire, &decoded);
+	
+	if (decoded > 0) {
+		const curl_off_t saved = (decoded > wire) ? ((decoded - wire) * 100) / decoded : 0;
+		
+		fprintf(stderr, "+ Metadados: %" CURL_FORMAT_CURL_OFF_T " bytes recebidos e %" CURL_FORMAT_CURL_OFF_T " bytes após a descompressão (%" CURL_FORMAT_CURL_OFF_T "%% de economia)\r\n", wire, decoded, saved);
+	}
+	
+}
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+
+#include "types.h"
+#include "threads.h"
+#include "bandwidth.h"
+
+/*
+Called whenever a slot in the transfer window becomes free. The callback
+must fill in the "url" and "filename" fields of the given download (both
+allocated with malloc(); ownership is passed to the transfer engine). The
+"filename" may be left NULL to have the download received in memory instead.
+The "userdata" field is left untouched and may point to anything the caller
+wants to get back on completion.
+
+Returns (1) if a new download was produced, (0) once there is nothing left
+to download, TRANSFER_NEXT_LATER if there is more to download but not right now
+(whoever consumes the downloads is falling behind; the callback is asked again a
+little later), or one of the UERR_* codes on error.
+*/
+typedef int (*transfer_next_cb)(struct Download* const download, void* const userdata);
+
+#define TRANSFER_NEXT_LATER 2
+
+/*
+Called once a download has been completely written to disk and its output
+file closed (or, for downloads without one, received into its "buffer").
+Returning anything other than UERR_SUCCESS aborts the whole transfer.
+*/
+typedef int (*transfer_done_cb)(const struct Download* const download, void* const userdata);
+
+/*
+Called for each download right before "complete", but without the transfer lock
+held, so that work which only concerns that download (such as decrypting it)
+runs concurrently across shards. The download may be modified in place (its
+"buffer" shrunk, or its output file rewritten). Returning anything other than
+UERR_SUCCESS aborts the whole transfer.
+*/
+typedef int (*transfer_received_cb)(struct Download* const download, void* const userdata);
+
+#define TRANSFER_RESOLVE_BUCKETS 11
+
+/*
+Counters collected while a transfer runs. "resolve_times" is a histogram of how
+long name resolution took for each new connection, in power of two buckets of
+milliseconds (< 1 ms, < 2 ms, < 4 ms, ..., >= 512 ms). "hedges" counts the
+duplicate requests fired for slow downloads near the end of the transfer, and
+"hedges_won" how many of them finished before the original request.
+*/
+struct TransferStatistics {
+	size_t resolves;
+	size_t resolve_times[TRANSFER_RESOLVE_BUCKETS];
+	size_t hedges;
+	size_t hedges_won;
+};
+
+struct Transfer {
+	size_t window;
+	size_t workers;
+	size_t total;
+	size_t produced;
+	size_t done;
+	long long elapsed;
+	transfer_next_cb next;
+	transfer_received_cb received;
+	transfer_done_cb complete;
+	void* userdata;
+	enum BandwidthClass priority;
+	struct Mutex lock;
+	int exhausted;
+	int code;
+	size_t concurrency;
+	struct TransferStatistics statistics;
+};
+
+int transfer_perform(struct Transfer* const transfer);
+void transfer_print_statistics(const struct Transfer* const transfer);
+
+#pragma once
@@ -0,0 +1,358 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ts.h"
+#include "errors.h"
+
+#define TS_SYNC_BYTE 0x47
+#define TS_PID_PAT 0x0000
+
+static long long ts_read_timestamp(const unsigned char* const data) {
+	/*
+	PTS and DTS are 33 bit numbers spread over 5 bytes, with marker bits in between.
+	*/
+	
+	return (
+		((long long) ((data[0] >> 1) & 0x07) << 30) |
+		((long long) data[1] << 22) |
+		((long long) (data[2] >> 1) << 15) |
+		((long long) data[3] << 7) |
+		((long long) (data[4] >> 1))
+	);
+	
+}
+
+static struct TSStream* ts_get_stream(struct TSDemuxer* const demuxer, const int pid) {
+	
+	for (size_t index = 0; index < demuxer->streams_offset; index++) {
+		struct TSStream* const stream = &demuxer->streams[index];
+		
+		if (stream->pid == pid) {
+			return stream;
+		}
+	}
+	
+	return NULL;
+	
+}
+
+static const unsigned char* ts_get_section(const unsigned char* const payload, const size_t size, size_t* const section_size) {
+	/*
+	Locates the PSI section starting in the payload of a packet, skipping its
+	pointer field. "section_size" is set to the size of the section, without its
+	trailing CRC.
+	*/
+	
+	if (size < 1 || (size_t) payload[0] + 1 + 3 > size) {
+		return NULL;
+	}
+	
+	const unsigned char* const section = payload + 1 + payload[0];
+	const size_t available = size - 1 - payload[0];
+	
+	const size_t length = (size_t) (((section[1] & 0x0F) << 8) | section[2]);
+	
+	if (length < 4 || 3 + length > available) {
+		return NULL;
+	}
+	
+	*section_size = 3 + length - 4;
+	
+	return section;
+	
+}
+
+static void ts_parse_pat(struct TSDemuxer* const demuxer, const unsigned char* const payload, const size_t size) {
+	
+	size_t section_size = 0;
+	const unsigned char* const section = ts_get_section(payload, size, &section_size);
+	
+	if (section == NULL || section[0] != 0x00) {
+		return;
+	}
+	
+	for (size_t offset = 8; offset + 4 <= section_size; offset += 4) {
+		const int program_number = (section[offset] << 8) | section[offset + 1];
+		
+		/*
+		Program 0 points to the network information table instead.
+		*/
+		if (program_number == 0) {
+			continue;
+		}
+		
+		demuxer->pmt_pid = ((section[offset + 2] & 0x1F) << 8) | section[offset + 3];
+		
+		break;
+	}
+	
+}
+
+static void ts_parse_pmt(struct TSDemuxer* const demuxer, const unsigned char* const payload, const size_t size) {
+	
+	size_t section_size = 0;
+	const unsigned char* const section = ts_get_section(payload, size, &section_size);
+	
+	if (section == NULL || section[0] != 0x02 || section_size < 12) {
+		return;
+	}
+	
+	const size_t program_info_length = (size_t) (((section[10] & 0x0F) << 8) | section[11]);
+	
+	for (size_t offset = 12 + program_info_length; offset + 5 <= section_size;) {
+		const int type = section[offset];
+		const int pid = ((section[offset + 1] & 0x1F) << 8) | section[offset + 2];
+		const size_t es_info_length = (size_t) (((section[offset + 3] & 0x0F) << 8) | section[offset + 4]);
+		
+		if (demuxer->streams_offset < TS_MAX_STREAMS && ts_get_stream(demuxer, pid) == NULL) {
+			struct TSStream* const stream = &demuxer->streams[demuxer->streams_offset++];
+			
+			memset(stream, 0, sizeof(*stream));
+			
+			stream->pid = pid;
+			stream->type = type;
+			stream->pts = -1;
+			stream->dts = -1;
+		}
+		
+		offset += 5 + es_info_length;
+	}
+	
+	demuxer->pmt_parsed = 1;
+	
+}
+
+static int ts_pes_append(struct TSStream* const stream, const unsigned char* const data, const size_t size) {
+	
+	if (stream->size - stream->offset < size) {
+		size_t capacity = (stream->size == 0) ? 64 * 1024 : stream->size;
+		
+		while (capacity - stream->offset < size) {
+			capacity *= 2;
+		}
+		
+		unsigned char* const buffer = realloc(stream->data, capacity);
+		
+		if (buffer == NULL) {
+			return UERR_MEMORY_ALLOCATE_FAILURE;
+		}
+		
+		stream->data = buffer;
+		stream->size = capacity;
+	}
+	
+	memcpy(stream->data + stream->offset, data, size);
+	stream->offset += size;
+	
+	return UERR_SUCCESS;
+	
+}
+
+static int ts_pes_emit(struct TSDemuxer* const demuxer, struct TSStream* const stream) {
+	
+	if (!stream->started) {
+		return UERR_SUCCESS;
+	}
+	
+	stream->started = 0;
+	
+	const int code = (*demuxer->callback)(stream, stream->data, stream->offset, demuxer->userdata);
+	
+	stream->offset = 0;
+	
+	return code;
+	
+}
+
+static int ts_pes_start(struct TSStream* const stream, const unsigned char* const payload, const size_t size) {
+	/*
+	Parses the header of a new PES packet. Its payload follows right after.
+	*/
+	
+	if (size < 9 || payload[0] != 0x00 || payload[1] != 0x00 || payload[2] != 0x01) {
+		return UERR_SUCCESS;
+	}
+	
+	const int flags = payload[7] >> 6;
+	const size_t header_size = 9 + (size_t) payload[8];
+	
+	if (header_size > size) {
+		return UERR_SUCCESS;
+	}
+	
+	stream->pts = -1;
+	stream->dts = -1;
+	
+	if ((flags & 0x02) && header_size >= 14) {
+		stream->pts = ts_read_timestamp(payload + 9);
+		stream->dts = stream->pts;
+	}
+	
+	if (flags == 0x03 && header_size >= 19) {
+		stream->dts = ts_read_timestamp(payload + 14);
+	}
+	
+	stream->started = 1;
+	
+	return ts_pes_append(stream, payload + header_size, size - header_size);
+	
+}
+
+static int ts_parse_packet(struct TSDemuxer* const demuxer, const unsigned char* const packet) {
+	
+	const int unit_start = (packet[1] & 0x40) != 0;
+	const int pid = ((packet[1] & 0x1F) << 8) | packet[2];
+	const int adaptation = (packet[3] >> 4) & 0x03;
+	
+	size_t offset = 4;
+	
+	if (adaptation & 0x02) {
+		offset += 1 + (size_t) packet[4];
+	}
+	
+	if (!(adaptation & 0x01) || offset >= TS_PACKET_SIZE) {
+		return UERR_SUCCESS;
+	}
+	
+	const unsigned char* const payload = packet + offset;
+	const size_t size = TS_PACKET_SIZE - offset;
+	
+	if (pid == TS_PID_PAT) {
+		if (unit_start && demuxer->pmt_pid == 0) {
+			ts_parse_pat(demuxer, payload, size);
+		}
+		
+		return UERR_SUCCESS;
+	}
+	
+	if (pid == demuxer->pmt_pid) {
+		if (unit_start && !demuxer->pmt_parsed) {
+			ts_parse_pmt(demuxer, payload, size);
+		}
+		
+		return UERR_SUCCESS;
+	}
+	
+	if (demuxer->callback == NULL) {
+		return UERR_SUCCESS;
+	}
+	
+	struct TSStream* const stream = ts_get_stream(demuxer, pid);
+	
+	if (stream == NULL) {
+		return UERR_SUCCESS;
+	}
+	
+	if (unit_start) {
+		const int code = ts_pes_emit(demuxer, stream);
+		
+		if (code != UERR_SUCCESS) {
+			return code;
+		}
+		
+		return ts_pes_start(stream, payload, size);
+	}
+	
+	if (!stream->started) {
+		return UERR_SUCCESS;
+	}
+	
+	return ts_pes_append(stream, payload, size);
+	
+}
+
+int ts_demuxer_push(struct TSDemuxer* const demuxer, const unsigned char* data, size_t size) {
+	/*
+	Feeds more of the byte stream. Bytes outside of packets (i.e. before a sync
+	byte) are skipped.
+	*/
+	
+	while (size > 0) {
+		if (demuxer->packet_offset == 0) {
+			if (*data != TS_SYNC_BYTE) {
+				data++;
+				size--;
+				
+				continue;
+			}
+			
+			/*
+			Whole packets are parsed right from the input.
+			*/
+			if (size >= TS_PACKET_SIZE) {
+				const int code = ts_parse_packet(demuxer, data);
+				
+				if (code != UERR_SUCCESS) {
+					return code;
+				}
+				
+				data += TS_PACKET_SIZE;
+				size -= TS_PACKET_SIZE;
+				
+				continue;
+			}
+		}
+		
+		size_t chunk_size = TS_PACKET_SIZE - demuxer->packet_offset;
+		
+		if (chunk_size > size) {
+			chunk_size = size;
+		}
+		
+		memcpy(demuxer->packet + demuxer->packet_offset, data, chunk_size);
+		
+		demuxer->packet_offset += chunk_size;
+		data += chunk_size;
+		size -= chunk_size;
+		
+		if (demuxer->packet_offset == TS_PACKET_SIZE) {
+			demuxer->packet_offset = 0;
+			
+			const int code = ts_parse_packet(demuxer, demuxer->packet);
+			
+			if (code != UERR_SUCCESS) {
+				return code;
+			}
+		}
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+int ts_demuxer_flush(struct TSDemuxer* const demuxer) {
+	/*
+	Emits the PES packets still being reassembled, once the byte stream ended.
+	*/
+	
+	if (demuxer->callback == NULL) {
+		return UERR_SUCCESS;
+	}
+	
+	for (size_t index = 0; index < demuxer->streams_offset; index++) {
+		const int code = ts_pes_emit(demuxer, &demuxer->streams[index]);
+		
+		if (code != UERR_SUCCESS) {
+			return code;
+		}
+	}
+	
+	return UERR_SUCCESS;
+	
+}
+
+void ts_demuxer_free(struct TSDemuxer* const demuxer) {
+	
+	for (size_t index = 0; index < demuxer->streams_offset; index++) {
+		struct TSStream* const stream = &demuxer->streams[index];
+		
+		free(stream->data);
+		
+		stream->data = NULL;
+		stream->offset = 0;
+		stream->size = 0;
+	}
+	
+	demuxer->streams_offset = 0;
+	
+}
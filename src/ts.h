@@ -0,0 +1,58 @@
+#include <stdlib.h>
+
+#define TS_PACKET_SIZE 188
+#define TS_MAX_STREAMS 8
+
+/*
+The "stream_type" values of the PMT we care about.
+*/
+enum TSStreamType {
+	TS_STREAM_AAC = 0x0F,
+	TS_STREAM_METADATA = 0x15,
+	TS_STREAM_H264 = 0x1B,
+	TS_STREAM_SCTE35 = 0x86
+};
+
+/*
+An elementary stream announced by the PMT, along with the PES packet of it that
+is being reassembled. Timestamps are in units of 90 kHz, or -1 if absent.
+*/
+struct TSStream {
+	int pid;
+	int type;
+	unsigned char* data;
+	size_t offset;
+	size_t size;
+	long long pts;
+	long long dts;
+	int started;
+};
+
+/*
+Called for every complete PES packet of a stream, with its payload. Returning
+anything other than UERR_SUCCESS stops the demuxer.
+*/
+typedef int (*ts_pes_cb)(const struct TSStream* const stream, const unsigned char* const data, const size_t size, void* const userdata);
+
+/*
+Demuxes an MPEG-TS byte stream, which may be pushed in pieces of any size. Only
+the first program is considered, and its PAT and PMT are expected to fit in a
+single packet, as they always do in HLS. Without a "callback", PES packets are
+not even reassembled; that is enough to find out which streams there are.
+*/
+struct TSDemuxer {
+	int pmt_pid;
+	int pmt_parsed;
+	struct TSStream streams[TS_MAX_STREAMS];
+	size_t streams_offset;
+	unsigned char packet[TS_PACKET_SIZE];
+	size_t packet_offset;
+	ts_pes_cb callback;
+	void* userdata;
+};
+
+int ts_demuxer_push(struct TSDemuxer* const demuxer, const unsigned char* data, size_t size);
+int ts_demuxer_flush(struct TSDemuxer* const demuxer);
+void ts_demuxer_free(struct TSDemuxer* const demuxer);
+
+#pragma once
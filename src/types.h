@@ -23,10 +23,51 @@ struct String {
 	size_t slength;
 };
 
+/*
+Grows geometrically; "offset" bytes of the "size" allocated ones are in use.
+*/
+struct DownloadBuffer {
+	size_t offset;
+	size_t size;
+	char* data;
+};
+
+/*
+A download with a non-zero "length" is a byte range of a larger file: the bytes
+[offset, offset + length) of the resource are written at that same position of
+"filename", which must already exist. "resumed" counts the bytes of the response
+earlier attempts already wrote; a retry continues right after them.
+
+A download without a "filename" is received into "buffer" instead, which the
+completion callback may consume (it is freed along with the download). It can
+not be a byte range.
+
+A download with a non-zero "max_size" (which can not be a byte range either) is
+not received if its server announces a larger response. Instead, it completes
+right away with "declined" set, so the caller can fetch it some other way.
+*/
 struct Download {
 	CURL* handle;
+	char* url;
 	char* filename;
 	struct FStream* stream;
+	struct DownloadBuffer buffer;
+	void* userdata;
+	curl_off_t offset;
+	curl_off_t length;
+	curl_off_t resumed;
+	curl_off_t max_size;
+	int declined;
+	struct Host* host;
+	const struct HostAddress* address;
+	struct Interface* interface;
+	size_t retries;
+	long long retry_at;
+	long long started_at;
+	CURL* hedge;
+	struct FStream* hedge_stream;
+	struct DownloadBuffer hedge_buffer;
+	int hedged;
 };
 
 void string_free(struct String* obj);